@@ -0,0 +1,42 @@
+#ifndef BACKEND_H_
+#define BACKEND_H_ 1
+
+#include <postgresql/libpq-fe.h>
+
+/* Outcome of a statement run by a backend, besides its result */
+struct SQL_BackendStatus
+{
+	/* Command tag as PostgreSQL reports it, e.g. "INSERT 0 1" */
+	char tag[64];
+
+	/* Set on failure */
+	char sqlstate[6];
+	char error[256];
+};
+
+/* A database other than a PostgreSQL server, used when the connect
+ * string starts with prefix.  Statements arrive as the printf-style
+ * format given to SQL_Query and friends, with one text argument per
+ * conversion, NULL standing for SQL NULL.  Results are PGresults built
+ * with PQmakeEmptyPGresult, with every column in text format, so that
+ * callers cannot tell the difference.  */
+struct SQL_Backend
+{
+	const char *prefix;
+
+	/* Returns NULL on failure */
+	void *(*open)(const char *connect_string);
+	void (*close)(void *db);
+
+	/* Returns NULL on failure, with status->sqlstate and status->error
+	 * set.  */
+	PGresult *(*execute)(void *db, const char *format, const char *const *argv,
+	                     struct SQL_BackendStatus *status);
+
+	PGTransactionStatusType (*transaction_status)(void *db);
+};
+
+/* Connect string "memory:"; see memory.c */
+extern const struct SQL_Backend SQL_MemoryBackend;
+
+#endif /* !BACKEND_H_ */
@@ -0,0 +1,636 @@
+#define _GNU_SOURCE
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "array.h"
+#include "journal.h"
+
+/* The journal is a text file of tab separated records, appended to and
+ * synced one at a time:
+ *
+ *   E  key  date  kind  account  account_name  counterpart  amount  count
+ *   D  key
+ *
+ * An E record is a mutation to apply; a D record says the entry with that
+ * key has been dealt with.  A line without its newline was cut short by
+ * a crash; it is ignored, and ended when the journal is next opened.  Once
+ * every entry is dealt with, the file is truncated.  Processes sharing the file take turns with flock().  */
+
+#define JOURNAL_LINE_MAX 512
+
+static const char *kind_names[] =
+{
+	"buy", "give", "take", "checkin", "checkout"
+};
+
+#define KIND_COUNT (sizeof(kind_names) / sizeof(kind_names[0]))
+
+typedef ARRAY(struct journal_entry) entry_list;
+
+static char *journal_path;
+static int journal_fd = -1;
+
+/* Protects the journal file, the counters below and the wakeup */
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_wakeup = PTHREAD_COND_INITIALIZER;
+static unsigned int pending, key_sequence;
+
+static char *replay_connect_string;
+static unsigned int replay_interval_sec;
+
+static int WriteRecord(int fd, const char *record);
+
+int Journal_Open(const char *path)
+{
+	struct stat st;
+	char last;
+	int result = 0;
+
+	if (-1 == (journal_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)))
+	{
+		warn("Failed to open journal '%s'", path);
+
+		return -1;
+	}
+
+	if (!(journal_path = strdup(path)))
+		err(EXIT_FAILURE, "strdup failed");
+
+	/* End a record cut short by a crash, so that it does not run into
+	 * the next one.  */
+	flock(journal_fd, LOCK_EX);
+
+	if (-1 != fstat(journal_fd, &st) && st.st_size > 0
+	    && 1 == pread(journal_fd, &last, 1, st.st_size - 1) && last != '\n')
+		result = WriteRecord(journal_fd, "\n");
+
+	flock(journal_fd, LOCK_UN);
+
+	if (result == -1)
+	{
+		warn("Failed to write to journal '%s'", path);
+
+		close(journal_fd);
+		journal_fd = -1;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Copies a field that has to fit in size bytes and in one record */
+static int
+SetField(char *field, size_t size, const char *value)
+{
+	if (!value)
+		value = "";
+
+	if (strlen(value) >= size || strpbrk(value, "\t\n"))
+		return -1;
+
+	strcpy(field, value);
+
+	return 0;
+}
+
+int Journal_InitEntry(struct journal_entry *entry, enum journal_kind kind, int account, const char *account_name,
+                      const char *counterpart, const char *amount, int count)
+{
+	struct timespec now;
+	char host[24];
+	unsigned int sequence;
+
+	memset(entry, 0, sizeof(*entry));
+
+	if (-1 == SetField(entry->account_name, sizeof(entry->account_name), account_name))
+		return JOURNAL_ACCOUNT_NAME;
+
+	if (-1 == SetField(entry->counterpart, sizeof(entry->counterpart), counterpart))
+		return JOURNAL_COUNTERPART;
+
+	if (-1 == SetField(entry->amount, sizeof(entry->amount), amount))
+		return JOURNAL_AMOUNT;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	if (-1 == gethostname(host, sizeof(host)))
+		strcpy(host, "unknown");
+
+	host[sizeof(host) - 1] = 0;
+
+	pthread_mutex_lock(&journal_mutex);
+	sequence = ++key_sequence;
+	pthread_mutex_unlock(&journal_mutex);
+
+	/* Unique across terminals, processes and restarts */
+	snprintf(entry->key, sizeof(entry->key), "%s-%d-%lld.%09ld-%u",
+	         host, (int) getpid(), (long long) now.tv_sec, now.tv_nsec, sequence);
+
+	entry->date = now.tv_sec;
+	entry->kind = kind;
+	entry->account = account;
+	entry->count = count;
+
+	return 0;
+}
+
+/* Online path.  The key is recorded along with the mutation, so that a
+ * copy journaled after an attempt that timed out is not applied again.  */
+
+int Journal_Commit(struct SQL_Connection *conn, const struct journal_entry *entry, long long *transaction)
+{
+	int statement = -1;
+
+	*transaction = 0;
+
+	SQL_ConnPipelineBegin(conn, SQL_SERIALIZABLE);
+
+	switch (entry->kind)
+	{
+	case JOURNAL_CHECKIN:
+	case JOURNAL_CHECKOUT:
+
+		SQL_ConnPipelineQuery(conn, "INSERT INTO checkins (account, type) VALUES (%d, %s)",
+		                      entry->account, kind_names[entry->kind]);
+		SQL_ConnPipelineQuery(conn, "INSERT INTO journal_keys (key) VALUES (%s)", entry->key);
+
+		return SQL_ConnPipelineCommit(conn);
+
+	case JOURNAL_BUY:
+
+		statement = SQL_ConnPipelineQuery(conn, "SELECT * FROM p2k12_buy(%d, %s::INTEGER, %d, %s)",
+		                                  entry->account, entry->counterpart, entry->count, entry->key);
+
+		break;
+
+	case JOURNAL_GIVE:
+	case JOURNAL_TAKE:
+
+		statement = SQL_ConnPipelineQuery(conn, "SELECT * FROM p2k12_transfer(%d, %s, %s::NUMERIC, %s, %s)",
+		                                  entry->account, entry->counterpart, entry->amount, kind_names[entry->kind], entry->key);
+
+		break;
+	}
+
+	if (-1 == SQL_ConnPipelineCommit(conn))
+		return -1;
+
+	*transaction = strtoll(SQL_ConnPipelineValue(conn, statement, 0, 0), 0, 10);
+
+	return 0;
+}
+
+/* Writing */
+
+static int
+WriteRecord(int fd, const char *record)
+{
+	size_t offset = 0, length = strlen(record);
+	ssize_t ret;
+
+	while (offset < length)
+	{
+		if (-1 == (ret = write(fd, record + offset, length - offset)))
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		offset += ret;
+	}
+
+	return fdatasync(fd);
+}
+
+static int
+FormatEntry(char *record, size_t size, const struct journal_entry *entry)
+{
+	if (size <= (size_t) snprintf(record, size, "E\t%s\t%lld\t%s\t%d\t%s\t%s\t%s\t%d\n",
+	                              entry->key, entry->date, kind_names[entry->kind], entry->account,
+	                              entry->account_name, entry->counterpart, entry->amount, entry->count))
+		return -1;
+
+	return 0;
+}
+
+/* Appends a record under the file lock; the caller holds journal_mutex */
+static int
+AppendRecord(const char *record)
+{
+	int result;
+
+	if (journal_fd == -1)
+		return -1;
+
+	if (-1 == flock(journal_fd, LOCK_EX))
+		return -1;
+
+	result = WriteRecord(journal_fd, record);
+
+	flock(journal_fd, LOCK_UN);
+
+	return result;
+}
+
+int Journal_Append(const struct journal_entry *entry)
+{
+	char record[JOURNAL_LINE_MAX];
+	int result;
+
+	if (-1 == FormatEntry(record, sizeof(record), entry))
+		return -1;
+
+	pthread_mutex_lock(&journal_mutex);
+
+	if (-1 != (result = AppendRecord(record)))
+	{
+		++pending;
+
+		pthread_cond_signal(&journal_wakeup);
+	}
+	else
+		syslog(LOG_ERR, "Failed to write journal entry %s: %s", entry->key, strerror(errno));
+
+	pthread_mutex_unlock(&journal_mutex);
+
+	return result;
+}
+
+unsigned int Journal_Pending(void)
+{
+	unsigned int result;
+
+	pthread_mutex_lock(&journal_mutex);
+	result = pending;
+	pthread_mutex_unlock(&journal_mutex);
+
+	return result;
+}
+
+/* Reading */
+
+static int
+ParseEntry(char *line, struct journal_entry *entry)
+{
+	char *fields[9], *endptr;
+	size_t i;
+
+	for (i = 0; i < 9; ++i)
+	{
+		if (!(fields[i] = strsep(&line, "\t")))
+			return -1;
+	}
+
+	if (line || strcmp(fields[0], "E"))
+		return -1;
+
+	memset(entry, 0, sizeof(*entry));
+
+	for (i = 0; i < KIND_COUNT && strcmp(fields[3], kind_names[i]); ++i)
+		;
+
+	if (i == KIND_COUNT)
+		return -1;
+
+	entry->kind = i;
+
+	entry->date = strtoll(fields[2], &endptr, 10);
+
+	if (*endptr)
+		return -1;
+
+	entry->account = strtol(fields[4], &endptr, 10);
+
+	if (*endptr)
+		return -1;
+
+	entry->count = strtol(fields[8], &endptr, 10);
+
+	if (*endptr)
+		return -1;
+
+	if (-1 == SetField(entry->key, sizeof(entry->key), fields[1])
+	    || -1 == SetField(entry->account_name, sizeof(entry->account_name), fields[5])
+	    || -1 == SetField(entry->counterpart, sizeof(entry->counterpart), fields[6])
+	    || -1 == SetField(entry->amount, sizeof(entry->amount), fields[7]))
+		return -1;
+
+	return 0;
+}
+
+/* Reads the entries not yet dealt with, oldest first.  Unless locked is
+ * set, the file is locked for reading meanwhile.  */
+static int
+ReadPending(entry_list *entries, int locked)
+{
+	struct journal_entry entry;
+	FILE *file;
+	char *line = 0;
+	size_t line_size = 0, i;
+	ssize_t length;
+
+	ARRAY_RESET(entries);
+
+	if (!(file = fopen(journal_path, "r")))
+		return -1;
+
+	if (!locked)
+		flock(fileno(file), LOCK_SH);
+
+	while (-1 != (length = getline(&line, &line_size, file)))
+	{
+		if (!length || line[length - 1] != '\n')
+			break;
+
+		line[length - 1] = 0;
+
+		if (!strncmp(line, "D\t", 2))
+		{
+			for (i = 0; i < ARRAY_COUNT(entries); ++i)
+			{
+				if (!strcmp(ARRAY_GET(entries, i).key, line + 2))
+				{
+					ARRAY_REMOVE(entries, i);
+
+					break;
+				}
+			}
+		}
+		else if (-1 != ParseEntry(line, &entry))
+		{
+			ARRAY_ADD(entries, entry);
+
+			if (-1 == ARRAY_RESULT(entries))
+				errx(EXIT_FAILURE, "ARRAY_ADD failed");
+		}
+		else
+			syslog(LOG_WARNING, "Skipping malformed line in journal %s", journal_path);
+	}
+
+	free(line);
+
+	fclose(file);
+
+	return 0;
+}
+
+/* Replay */
+
+static int
+ReplayEntry(struct SQL_Connection *conn, void *arg)
+{
+	const struct journal_entry *entry = arg;
+	struct SQL_Result *res;
+	int result;
+
+	if (!(res = SQL_ConnExecute(conn, "SELECT 1 FROM journal_keys WHERE key = %s", entry->key)))
+		return -1;
+
+	/* Applied before; the D record was lost, or another process got here
+	 * first.  */
+	if (SQL_ResultRowCount(res))
+	{
+		SQL_ResultFree(res);
+
+		return 0;
+	}
+
+	SQL_ResultFree(res);
+
+	/* Audit records name the account the entry was made by */
+	if (-1 == SQL_ConnQuery(conn, "SELECT set_config('p2k12.account', %s, true)", entry->account_name))
+		return -1;
+
+	switch (entry->kind)
+	{
+	case JOURNAL_CHECKIN:
+	case JOURNAL_CHECKOUT:
+
+		result = SQL_ConnQuery(conn, "INSERT INTO checkins (account, type, date) VALUES (%d, %s, TO_TIMESTAMP(%l::DOUBLE PRECISION))",
+		                       entry->account, kind_names[entry->kind], entry->date);
+
+		if (result != -1)
+			result = SQL_ConnQuery(conn, "INSERT INTO journal_keys (key) VALUES (%s)", entry->key);
+
+		return (result == -1) ? -1 : 0;
+
+	case JOURNAL_BUY:
+
+		res = SQL_ConnExecute(conn, "SELECT * FROM p2k12_buy(%d, %s::INTEGER, %d, %s, %s::NUMERIC, TO_TIMESTAMP(%l::DOUBLE PRECISION))",
+		                      entry->account, entry->counterpart, entry->count, entry->key, entry->amount, entry->date);
+
+		break;
+
+	case JOURNAL_GIVE:
+	case JOURNAL_TAKE:
+
+		res = SQL_ConnExecute(conn, "SELECT * FROM p2k12_transfer(%d, %s, %s::NUMERIC, %s, %s, TO_TIMESTAMP(%l::DOUBLE PRECISION))",
+		                      entry->account, entry->counterpart, entry->amount, kind_names[entry->kind], entry->key, entry->date);
+
+		break;
+
+	default:
+
+		return -1;
+	}
+
+	if (!res)
+		return -1;
+
+	SQL_ResultFree(res);
+
+	return 0;
+}
+
+/* Keeps an entry the server will not take where someone can look at it */
+static void
+Reject(const struct journal_entry *entry)
+{
+	char record[JOURNAL_LINE_MAX], *path;
+	int fd;
+
+	FormatEntry(record, sizeof(record), entry);
+
+	syslog(LOG_ERR, "Journal entry rejected by the database: %s", record);
+
+	if (-1 == asprintf(&path, "%s.rejected", journal_path))
+		return;
+
+	if (-1 != (fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)))
+	{
+		WriteRecord(fd, record);
+		close(fd);
+	}
+
+	free(path);
+}
+
+static void
+MarkDone(const struct journal_entry *entry)
+{
+	char record[JOURNAL_LINE_MAX];
+
+	snprintf(record, sizeof(record), "D\t%s\n", entry->key);
+
+	pthread_mutex_lock(&journal_mutex);
+
+	AppendRecord(record);
+
+	if (pending)
+		--pending;
+
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+/* Empties the journal if nothing in it, including entries appended by
+ * other processes since it was read, remains to be applied.  */
+static void
+Compact(void)
+{
+	entry_list entries;
+
+	ARRAY_INIT(&entries);
+
+	pthread_mutex_lock(&journal_mutex);
+
+	if (-1 != flock(journal_fd, LOCK_EX))
+	{
+		if (-1 != ReadPending(&entries, 1) && !ARRAY_COUNT(&entries))
+		{
+			if (-1 == ftruncate(journal_fd, 0))
+				syslog(LOG_WARNING, "Failed to truncate journal %s: %s", journal_path, strerror(errno));
+		}
+
+		flock(journal_fd, LOCK_UN);
+	}
+
+	pending = ARRAY_COUNT(&entries);
+
+	pthread_mutex_unlock(&journal_mutex);
+
+	ARRAY_FREE(&entries);
+}
+
+static void
+ReplayPending(struct SQL_Connection **conn)
+{
+	entry_list entries;
+	struct journal_entry *entry;
+	size_t i;
+
+	ARRAY_INIT(&entries);
+
+	pthread_mutex_lock(&journal_mutex);
+
+	if (-1 != ReadPending(&entries, 0))
+		pending = ARRAY_COUNT(&entries);
+
+	pthread_mutex_unlock(&journal_mutex);
+
+	if (!ARRAY_COUNT(&entries))
+		goto done;
+
+	if (!*conn)
+	{
+		if (!(*conn = SQL_ConnectBackground(replay_connect_string)))
+			goto done;
+
+		SQL_ConnSetTimeouts(*conn, 10000, 10000);
+	}
+
+	for (i = 0; i < ARRAY_COUNT(&entries); ++i)
+	{
+		entry = &ARRAY_GET(&entries, i);
+
+		if (-1 == SQL_ConnTransaction(*conn, SQL_SERIALIZABLE, ReplayEntry, entry))
+		{
+			/* Keep the order; try again on the next round */
+			if (SQL_ConnUnavailable(*conn))
+				goto done;
+
+			Reject(entry);
+		}
+		else
+			syslog(LOG_INFO, "Applied journal entry %s", entry->key);
+
+		MarkDone(entry);
+	}
+
+	Compact();
+
+done:
+
+	ARRAY_FREE(&entries);
+}
+
+static void *
+ReplayThread(void *arg)
+{
+	struct SQL_Connection *conn = 0;
+	struct timespec deadline;
+
+	(void) arg;
+
+	for (;;)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += replay_interval_sec;
+
+		pthread_mutex_lock(&journal_mutex);
+
+		if (!pending)
+			pthread_cond_timedwait(&journal_wakeup, &journal_mutex, &deadline);
+
+		pthread_mutex_unlock(&journal_mutex);
+
+		ReplayPending(&conn);
+
+		/* Back off while the entries cannot be applied */
+		if (Journal_Pending())
+			sleep(replay_interval_sec);
+	}
+
+	return 0;
+}
+
+int Journal_StartReplay(const char *connect_string, unsigned int interval_sec)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int result;
+
+	if (journal_fd == -1 || !(replay_connect_string = strdup(connect_string)))
+		return -1;
+
+	replay_interval_sec = interval_sec ? interval_sec : 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (0 != (result = pthread_create(&thread, &attr, ReplayThread, 0)))
+		syslog(LOG_ERR, "Failed to start journal replay: %s", strerror(result));
+
+	pthread_attr_destroy(&attr);
+
+	return result ? -1 : 0;
+}
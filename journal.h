@@ -0,0 +1,78 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_ 1
+
+#include "postgresql.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum journal_kind
+{
+  JOURNAL_BUY,
+  JOURNAL_GIVE,
+  JOURNAL_TAKE,
+  JOURNAL_CHECKIN,
+  JOURNAL_CHECKOUT
+};
+
+/* A ledger mutation made on behalf of account.  counterpart is the
+ * product ID for purchases and the other account's name for give and
+ * take.  amount is in NOK, and for purchases the price of all count items
+ * according to the last product snapshot.  key identifies the mutation
+ * on the server, so that it is applied at most once.  */
+struct journal_entry
+{
+  char key[64];
+  long long date;
+  enum journal_kind kind;
+  int account;
+  char account_name[64];
+  char counterpart[64];
+  char amount[32];
+  int count;
+};
+
+/* Opens the journal at path, creating it if necessary.  Returns -1 on
+ * failure.  */
+int Journal_Open(const char *path);
+
+/* The fields of an entry given as text */
+enum journal_field
+{
+  JOURNAL_ACCOUNT_NAME = 1,
+  JOURNAL_COUNTERPART,
+  JOURNAL_AMOUNT
+};
+
+/* Fills in an entry with a new key and the current time.  Returns 0, or
+ * the journal_field that is too long for the entry or holds a tab or
+ * newline.  */
+int Journal_InitEntry(struct journal_entry *entry, enum journal_kind kind, int account, const char *account_name,
+                      const char *counterpart, const char *amount, int count);
+
+/* Applies the entry on conn, pricing purchases at the current stock
+ * value.  *transaction is set to the ID of the new transaction, or 0 for
+ * checkins.  Returns 0 on success and -1 on failure; see
+ * SQL_ConnUnavailable for telling an outage from a bad entry.  */
+int Journal_Commit(struct SQL_Connection *conn, const struct journal_entry *entry, long long *transaction);
+
+/* Appends the entry to the journal, returning once it is on disk.
+ * Returns -1 on failure.  */
+int Journal_Append(const struct journal_entry *entry);
+
+/* Starts a thread that applies journaled entries on its own connection
+ * every interval_sec seconds, or sooner after Journal_Append.  Entries
+ * already applied, e.g. by another process, are skipped by key.  Entries
+ * the server rejects are logged and moved to the journal path with
+ * ".rejected" appended.  Returns -1 on failure.  */
+int Journal_StartReplay(const char *connect_string, unsigned int interval_sec);
+
+/* Number of entries not yet applied, as far as this process knows */
+unsigned int Journal_Pending(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* !JOURNAL_H_ */
@@ -3,18 +3,28 @@
 #include <err.h>
 #include <errno.h>
 #include <ctype.h>
+#include <getopt.h>
 #include <locale.h>
+#include <poll.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #include "array.h"
+#include "journal.h"
 #include "postgresql.h"
 
 #define GREEN_ON "\033[32;1m"
@@ -26,12 +36,61 @@
 
 typedef ARRAY (char *) stringlist;
 
+/* Time allowed for all database work done by one command */
+#define READ_COMMAND_BUDGET_MS 5000
+#define WRITE_COMMAND_BUDGET_MS 15000
+
+/* Balance and membership of the user, checked before each command */
+#define STATUS_QUERY \
+  "SELECT -ub.balance, cm.price, cm.flag FROM user_balances ub LEFT JOIN current_membership cm ON cm.account = ub.id WHERE ub.id = %d"
+
+/* Sessions served by one daemon process */
+#define DEFAULT_POOL_SIZE 4
+#define SESSION_IDLE_SEC 120
+#define SESSION_LINE_MAX 1024
+
+/* Ledger mutations made while the database is down are journaled here,
+ * and applied by a background thread once it is back.  */
+#ifdef P2K12_MODE_LIVE
+#define JOURNAL_PATH "/var/lib/p2k12/journal"
+#else
+#define JOURNAL_PATH ".p2k12_journal"
+#endif
+#define JOURNAL_REPLAY_SEC 10
+
+// The certificate from bomba.bitraf.no needs to exist in
+// $HOME/.postgresql/root.crt.
+//
+// The password should be listed in $HOME/.pgpass.
+#ifdef P2K12_MODE_LIVE
+#define CONNECT_STRING "user=p2k12_pos dbname=p2k12 host=bomba.bitraf.no sslmode=verify-full"
+#else
+#define CONNECT_STRING "user=p2k12_pos dbname=p2k12 host=localhost"
+#endif
+
+/* Set while serving sessions from the daemon */
+static int serving;
+
+/* Set when mutations may be journaled instead of failing */
+static int journal_enabled;
+
+/* Products as of the last listing, for selling while the database is
+ * down.  */
+struct product
+{
+  char *id, *name, *stock, *unit_price;
+};
+
+static ARRAY (struct product) products;
+
 #ifdef P2K12_MODE_LIVE
 const int allow_user_creation = 0;
 const int persistent_history = 0;
+const int persistent_sqlstats = 0;
 #else
 static int allow_user_creation = 1;
 static int persistent_history = 1;
+static int persistent_sqlstats = 1;
 #endif
 
 char *
@@ -199,29 +258,176 @@ enable_echo (void)
   tcsetattr (0, TCSANOW, &t);
 }
 
-static long long
-sql_last_id (void)
+static void
+free_product (struct product *product)
+{
+  free (product->id);
+  free (product->name);
+  free (product->stock);
+  free (product->unit_price);
+}
+
+static void
+copy_product (struct product *product, const char *id, const char *name, const char *stock, const char *unit_price)
+{
+  if (!(product->id = strdup (id))
+      || !(product->name = strdup (name))
+      || !(product->stock = strdup (stock))
+      || !(product->unit_price = strdup (unit_price)))
+    err (EXIT_FAILURE, "strdup failed");
+}
+
+/* Replaces the product snapshot with the result of the last SQL_Query */
+static void
+update_products (void)
+{
+  struct product product;
+  int i;
+
+  for (i = 0; i < (int) ARRAY_COUNT (&products); ++i)
+    free_product (&ARRAY_GET (&products, i));
+
+  ARRAY_RESET (&products);
+
+  for (i = 0; i < SQL_RowCount (); ++i)
+    {
+      copy_product (&product, SQL_Value (i, 0), SQL_Value (i, 1), SQL_Value (i, 2), SQL_Value (i, 4));
+
+      ARRAY_ADD (&products, product);
+
+      if (-1 == ARRAY_RESULT (&products))
+        errx (EXIT_FAILURE, "ARRAY_ADD failed");
+    }
+}
+
+/* Looks up a product by ID in the database or, while that is down, in
+ * the snapshot.  The unit price is empty if the product is out of stock.
+ * Returns -1 if there is no such product.  */
+static int
+find_product (const char *id, struct product *product)
 {
-  if (-1 == SQL_Query ("SELECT LASTVAL()"))
+  struct SQL_Result *result = 0;
+  int i;
+
+  if (!SQL_Offline ()
+      && (result = SQL_Execute ("SELECT product, name, stock, unit_price FROM product_inventory WHERE product = %s::INTEGER", id)))
+    {
+      if (!SQL_ResultRowCount (result))
+        {
+          SQL_ResultFree (result);
+
+          return -1;
+        }
+
+      copy_product (product, SQL_ResultValue (result, 0, 0), SQL_ResultValue (result, 0, 1),
+                    SQL_ResultValue (result, 0, 2), SQL_ResultValue (result, 0, 3));
+
+      SQL_ResultFree (result);
+
+      return 0;
+    }
+
+  if (!SQL_Offline () && !SQL_Unavailable ())
     return -1;
 
-  return strtoll (SQL_Value (0, 0), 0, 0);
+  for (i = 0; i < (int) ARRAY_COUNT (&products); ++i)
+    {
+      const struct product *cached = &ARRAY_GET (&products, i);
+
+      if (atoi (cached->id) == atoi (id))
+        {
+          copy_product (product, cached->id, cached->name, cached->stock, cached->unit_price);
+
+          return 0;
+        }
+    }
+
+  return -1;
 }
 
+/* Formats count times unit_price, in NOK, into amount */
+static int
+total_price (char *amount, size_t size, const char *unit_price, int count)
+{
+  long long ore;
+  char *endptr;
+  double price;
+
+  price = strtod (unit_price, &endptr);
+
+  if (!*unit_price || *endptr || price < 0)
+    return -1;
+
+  ore = (long long) (price * 100 + 0.5) * count;
 
+  snprintf (amount, size, "%lld.%02lld", ore / 100, ore % 100);
+
+  return 0;
+}
+
+/* Tells the user why Journal_InitEntry rejected field of an entry of the
+ * given kind.  */
 static void
+report_entry_field (int field, enum journal_kind kind, const char *user_name,
+                    const char *counterpart, const char *amount)
+{
+  switch (field)
+    {
+    case JOURNAL_ACCOUNT_NAME:
+      fprintf (stderr, "Invalid user name '%s'\n", user_name);
+      break;
+
+    case JOURNAL_COUNTERPART:
+      if (kind == JOURNAL_BUY)
+        fprintf (stderr, "Bad product ID '%s'\n", counterpart);
+      else
+        fprintf (stderr, "Invalid user name '%s'\n", counterpart);
+      break;
+
+    case JOURNAL_AMOUNT:
+      fprintf (stderr, "Amount '%s' is too long\n", amount);
+      break;
+    }
+}
+
+/* Commits entry, or journals it if the database is down or does not
+ * answer in time.  Returns 0 once committed, 1 once journaled and -1 on
+ * failure.  */
+static int
+record (const struct journal_entry *entry, long long *transaction)
+{
+  if (!SQL_Offline ()
+      && -1 != Journal_Commit (SQL_DefaultConnection (), entry, transaction))
+    return 0;
+
+  if (!journal_enabled || !(SQL_Offline () || SQL_Unavailable ()))
+    return -1;
+
+  /* A purchase can only be journaled with a known price */
+  if (entry->kind == JOURNAL_BUY && !*entry->amount)
+    return -1;
+
+  return (-1 == Journal_Append (entry)) ? -1 : 1;
+}
+
+static int
 cmd_addproduct (const char *product_name)
 {
+  struct SQL_Result *product;
   int i;
 
-  SQL_Query ("INSERT INTO accounts (name, type) VALUES (%s, 'product') RETURNING id", product_name);
+  product = SQL_Execute ("INSERT INTO accounts (name, type) VALUES (%s, 'product') RETURNING id", product_name);
 
-  if (1 != SQL_RowCount ())
+  if (!product || 1 != SQL_ResultRowCount (product))
     {
-      return;
+      SQL_ResultFree (product);
+
+      return -1;
     }
 
-  SQL_Query ("SELECT * FROM product_stock WHERE id = %s", SQL_Value (0, 0));
+  SQL_Query ("SELECT product, name, stock, amount FROM product_inventory WHERE product = %s::INTEGER", SQL_ResultValue (product, 0, 0));
+
+  SQL_ResultFree (product);
 
   printf (YELLOW_ON "%-5s %-5s %7s %-20s\n" YELLOW_OFF, "ID", "Count", "Value", "Name");
 
@@ -229,9 +435,11 @@ cmd_addproduct (const char *product_name)
     {
       printf ("%-5s %-5s %7s %-20s\n", SQL_Value (i, 0), SQL_Value (i, 2), SQL_Value (i, 3), SQL_Value (i, 1));
     }
+
+  return 0;
 }
 
-static void
+static int
 cmd_become (int user_id, const char *price)
 {
   if (!strcmp (price, "300"))
@@ -245,18 +453,26 @@ cmd_become (int user_id, const char *price)
     {
       fprintf (stderr, "Unknown membership type\n");
 
-      return;
+      return -1;
     }
 
-  SQL_Query ("SELECT p2k12_become_member(%d, %s)", user_id, price);
+  if (-1 == SQL_Query ("SELECT p2k12_become_member(%d, %s)", user_id, price))
+    return -1;
+
   printf ("Your membership has been changed to type: %s\n", price);
+
+  return 0;
 }
 
-static void
+static int
 cmd_officeuser (int user_id)
 {
-  SQL_Query ("INSERT INTO members (full_name, email, price, account, flag) SELECT full_name, email, price, account, %s  FROM members WHERE account = %d ORDER BY date DESC LIMIT 1", "m_office", user_id);
+  if (-1 == SQL_Query ("SELECT p2k12_become_office_user(%d)", user_id))
+    return -1;
+
   printf ("m_office flag set\n");
+
+  return 0;
 }
 
 static void
@@ -268,7 +484,7 @@ cmd_dns_usage()
   fprintf (stderr, "Usage: dns list\n");
 }
 
-static void
+static int
 cmd_dns (int user_id, size_t argc, stringlist argv)
 {
   const char *cmd;
@@ -276,7 +492,7 @@ cmd_dns (int user_id, size_t argc, stringlist argv)
   if (argc < 2)
     {
       cmd_dns_usage();
-      return;
+      return -1;
     }
 
   cmd = ARRAY_GET (&argv, 1);
@@ -306,38 +522,32 @@ cmd_dns (int user_id, size_t argc, stringlist argv)
       else
         {
           cmd_dns_usage();
-          return;
+          return -1;
         }
 
-      if (-1 != SQL_Query("BEGIN")
-          && -1 != SQL_Query("INSERT INTO dns_entries(account, fqdn, ip4, ip6, cname) VALUES(%d, %s::TEXT, %s::CIDR, %s::CIDR, %s) RETURNING id", user_id, fqdn, ip4, ip6, cname)
-          && -1 != SQL_Query("COMMIT"))
-        {
-          fprintf (stderr, "Entry added. Now talk to ops about reloading the DNS server.\n");
-        }
-      else
-        {
-          SQL_Query ("ROLLBACK");
-        }
+      /* A single statement, so that it can also be part of a batch */
+      if (-1 == SQL_Query("INSERT INTO dns_entries(account, fqdn, ip4, ip6, cname) VALUES(%d, %s::TEXT, %s::CIDR, %s::CIDR, %s) RETURNING id", user_id, fqdn, ip4, ip6, cname))
+        return -1;
+
+      fprintf (stderr, "Entry added. Now talk to ops about reloading the DNS server.\n");
     }
   else if (!strcmp("rm", cmd) && argc == 3)
     {
       const char *fqdn = ARRAY_GET (&argv, 2);
 
-      if (-1 != SQL_Query("BEGIN")
-          && -1 != SQL_Query("DELETE FROM dns_entries WHERE account=%d AND fqdn=%s", user_id, fqdn)
-          && -1 != SQL_Query("COMMIT"))
-        {
-          fprintf (stderr, "Entry removed. Now talk to ops about reloading the DNS server.\n");
-        }
-      else
-        {
-          SQL_Query ("ROLLBACK");
-        }
+      if (-1 == SQL_Query("DELETE FROM dns_entries WHERE account=%d AND fqdn=%s", user_id, fqdn))
+        return -1;
+
+      fprintf (stderr, "Entry removed. Now talk to ops about reloading the DNS server.\n");
     }
   else if (!strcmp("list", cmd) && argc == 2)
     {
-      if (SQL_Query("SELECT host, zone, account_name, ip4, ip6, cname FROM pretty_dns_entries ORDER BY zone, host"))
+      int result;
+
+      if (-1 == (result = SQL_Query("SELECT host, zone, account_name, ip4, ip6, cname FROM pretty_dns_entries ORDER BY zone, host")))
+        return -1;
+
+      if (result)
         {
           int rowCount = SQL_RowCount ();
 
@@ -371,10 +581,13 @@ cmd_dns (int user_id, size_t argc, stringlist argv)
   else
     {
       cmd_dns_usage();
+      return -1;
     }
+
+  return 0;
 }
 
-static void
+static int
 cmd_addstock (int user_id, const char *product_id, const char *sum_value, const char *stock)
 {
   char *endptr;
@@ -389,72 +602,229 @@ cmd_addstock (int user_id, const char *product_id, const char *sum_value, const
     fprintf (stderr, "Invalid sum value.  Must be a positive number\n");
   else
     {
-      if (-1 != SQL_Query ("BEGIN")
-          && -1 != SQL_Query ("INSERT INTO transactions (reason) VALUES ('add stock')")
-          && -1 != SQL_Query ("INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency, stock) VALUES (LASTVAL(), %s::INTEGER, %d, %s::NUMERIC, 'NOK', %s::INTEGER)", product_id, user_id, sum_value, stock)
-          && -1 != SQL_Query ("COMMIT"))
+      SQL_PipelineBegin (SQL_SERIALIZABLE);
+      SQL_PipelineQuery ("SELECT * FROM p2k12_add_stock(%d, %s::INTEGER, %s::NUMERIC, %s::INTEGER)", user_id, product_id, sum_value, stock);
+
+      if (-1 != SQL_PipelineCommit ())
         {
           fprintf (stderr, "Commited to transaction log\n");
+
+          return 0;
         }
-      else
-        {
-          SQL_Query ("ROLLBACK");
-          fprintf (stderr, "SQL Error; Did not commit anything\n");
-        }
+
+      fprintf (stderr, "SQL Error; Did not commit anything\n");
     }
+
+  return -1;
 }
 
-static void
-cmd_lastlog (int user_id, const char *variant)
+/* Lower bound on transaction dates for each lastlog variant */
+#define LASTLOG_SINCE \
+  "CASE %s::TEXT WHEN 'day' THEN CURRENT_TIMESTAMP - INTERVAL '1 day' " \
+  "WHEN 'week' THEN CURRENT_TIMESTAMP - INTERVAL '7 days' " \
+  "WHEN 'year' THEN DATE_TRUNC('year', NOW()) ELSE '-infinity' END"
+
+/* Position of the last page shown, for "lastlog next" */
+struct lastlog_page
+{
+  int user_id;
+  const char *variant;
+  int limit;
+  long long before;
+};
+
+static struct lastlog_page lastlog_page;
+
+struct lastlog_state
+{
+  int rows;
+  long long last;
+};
+
+static int
+lastlog_row (const struct SQL_Result *result, unsigned int row, void *arg)
+{
+  struct lastlog_state *state = arg;
+  long long transaction;
+
+  if (!state->rows++)
+    printf ("%19s %-7s %-7s %8s %5s %-20s %-20s\n",
+            "Date", "TID", "Amount", "Currency", "Items", "Debit", "Credit");
+
+  printf ("%19.*s %7s %7s %8s %5s %-20s %-20s\n",
+          19, SQL_ResultValue (result, row, 8), SQL_ResultValue (result, row, 0), SQL_ResultValue (result, row, 3),
+          SQL_ResultValue (result, row, 4), SQL_ResultValue (result, row, 5), SQL_ResultValue (result, row, 6),
+          SQL_ResultValue (result, row, 7));
+
+  /* Pages come newest first, so their last row is the oldest */
+  if (-1 != SQL_ResultInt (result, row, 0, &transaction))
+    state->last = transaction;
+
+  return 0;
+}
+
+static int
+cmd_lastlog (int user_id, int argc, stringlist argv)
 {
+  struct lastlog_state state;
+  const char *variant = "all";
+  long long before = 0;
+  char before_text[32];
+  char *endptr;
+  int i, limit = 0, result;
 
-  if (variant != NULL)
+  if (argc == 2 && !strcmp (ARRAY_GET (&argv, 1), "next"))
     {
-      if (!strcmp (variant, "d") || !strcmp (variant, "day"))
-        {
-          SQL_Query ("SELECT * FROM pretty_transaction_lines WHERE %d IN (debit_account, credit_account) AND date > CURRENT_TIMESTAMP - INTERVAL '1 day'", user_id);
-        }
-      else if (!strcmp (variant, "w") || !strcmp (variant, "week"))
-        {
-          SQL_Query ("SELECT * FROM pretty_transaction_lines WHERE %d IN (debit_account, credit_account) AND date > CURRENT_TIMESTAMP - INTERVAL '7 days'", user_id);
-        }
-      else if (!strcmp (variant, "y") || !strcmp (variant, "year"))
+      if (lastlog_page.user_id != user_id || !lastlog_page.before)
         {
-          SQL_Query ("SELECT * FROM pretty_transaction_lines WHERE %d IN (debit_account, credit_account) AND EXTRACT(YEAR FROM date)=EXTRACT(YEAR FROM NOW())", user_id);
+          fprintf (stderr, "No more transactions.\n");
+
+          return 0;
         }
-      else
+
+      variant = lastlog_page.variant;
+      limit = lastlog_page.limit;
+      before = lastlog_page.before;
+    }
+  else
+    {
+      for (i = 1; i < argc; ++i)
         {
-          fprintf (stderr, "Usage: lastlog [day, week, year]\n");
-          return;
+          const char *arg = ARRAY_GET (&argv, i);
+
+          if (!strcmp (arg, "d") || !strcmp (arg, "day"))
+            variant = "day";
+          else if (!strcmp (arg, "w") || !strcmp (arg, "week"))
+            variant = "week";
+          else if (!strcmp (arg, "y") || !strcmp (arg, "year"))
+            variant = "year";
+          else if (!strcmp (arg, "--limit") && i + 1 < argc
+                   && 0 < (limit = (int) strtol (ARRAY_GET (&argv, i + 1), &endptr, 0)) && !*endptr)
+            ++i;
+          else if (!strcmp (arg, "--before") && i + 1 < argc
+                   && 0 < (before = strtoll (ARRAY_GET (&argv, i + 1), &endptr, 0)) && !*endptr)
+            ++i;
+          else
+            {
+              fprintf (stderr, "Usage: lastlog [day, week, year] [--limit N] [--before TID]\n"
+                               "       lastlog next\n");
+              return -1;
+            }
         }
+
+      /* Pages go backwards from the newest transaction */
+      if (before && !limit)
+        limit = 20;
+    }
+
+  memset (&state, 0, sizeof (state));
+
+  if (!limit)
+    {
+      result = SQL_Stream (lastlog_row, &state,
+                           "SELECT * FROM p2k12_account_history(%d, " LASTLOG_SINCE ") ORDER BY date, transaction",
+                           user_id, variant);
     }
   else
     {
-      SQL_Query ("SELECT * FROM pretty_transaction_lines WHERE %d IN (debit_account, credit_account)", user_id);
+      /* The limit counts transactions rather than lines, so that a page
+       * never ends in the middle of a transaction.  */
+      snprintf (before_text, sizeof (before_text), "%lld", before);
+
+      result = SQL_Stream (lastlog_row, &state,
+                           "SELECT * FROM p2k12_account_history(%d, " LASTLOG_SINCE ", %s::INTEGER, %d)"
+                           " ORDER BY date DESC, transaction DESC",
+                           user_id, variant, before ? before_text : NULL, limit);
+    }
+
+  if (result == -1)
+    return -1;
+
+  if (!state.rows)
+    {
+      printf ("No transactions found.\n");
+
+      lastlog_page.before = 0;
+
+      return 0;
+    }
+
+  if (limit)
+    {
+      lastlog_page.user_id = user_id;
+      lastlog_page.variant = variant;
+      lastlog_page.limit = limit;
+      lastlog_page.before = state.last;
+
+      printf ("Type \"lastlog next\" for older transactions.\n");
     }
 
-  int rowCount = SQL_RowCount ();
-  if (rowCount > 0)
+  return 0;
+}
+
+/* Products by amount sold in a range, from the sales rollups.  What
+ * each member bought is theirs to see alone, so p2k12_member_sales() is
+ * left to reports run on the server.  */
+static int
+cmd_sales (int argc, stringlist argv)
+{
+  const char *variant = "all", *since = 0, *until = 0;
+  char *endptr;
+  int i, top = 10;
+
+  for (i = 1; i < argc; ++i)
     {
-      printf ("%19s %-7s %-7s %8s %5s %-20s %-20s\n",
-              "Date", "TID", "Amount", "Currency", "Items", "Debit", "Credit");
-      int i;
-      for (i = 0; i < rowCount; ++i)
+      const char *arg = ARRAY_GET (&argv, i);
+
+      if (!strcmp (arg, "d") || !strcmp (arg, "day"))
+        variant = "day";
+      else if (!strcmp (arg, "w") || !strcmp (arg, "week"))
+        variant = "week";
+      else if (!strcmp (arg, "y") || !strcmp (arg, "year"))
+        variant = "year";
+      else if (!strcmp (arg, "--since") && i + 1 < argc)
+        since = ARRAY_GET (&argv, ++i);
+      else if (!strcmp (arg, "--until") && i + 1 < argc)
+        until = ARRAY_GET (&argv, ++i);
+      else if (!strcmp (arg, "--top") && i + 1 < argc
+               && 0 < (top = (int) strtol (ARRAY_GET (&argv, i + 1), &endptr, 0)) && !*endptr)
+        ++i;
+      else
         {
-          printf ("%19.*s %7s %7s %8s %5s %-20s %-20s\n",
-                  19, SQL_Value (i, 8), SQL_Value (i, 0), SQL_Value (i, 3), SQL_Value (i, 4), SQL_Value (i, 5), SQL_Value (i, 6), SQL_Value (i, 7));
+          fprintf (stderr, "Usage: sales [day, week, year] [--since DATE] [--until DATE] [--top N]\n");
+          return -1;
         }
     }
-  else
-    printf ("No transactions found.\n");
+
+  if (-1 == SQL_Query ("SELECT * FROM p2k12_product_sales(COALESCE(%s::TIMESTAMPTZ, " LASTLOG_SINCE "), "
+                       "COALESCE(%s::TIMESTAMPTZ, 'infinity'), %d)",
+                       since, variant, until, top))
+    return -1;
+
+  if (!SQL_RowCount ())
+    {
+      printf ("No sales found.\n");
+
+      return 0;
+    }
+
+  printf (YELLOW_ON "%-5s %-20s %6s %10s\n" YELLOW_OFF, "ID", "Product", "Units", "Amount");
+
+  for (i = 0; i < SQL_RowCount (); ++i)
+    {
+      printf ("%-5s %-20s %6s %10s\n", SQL_Value (i, 0), SQL_Value (i, 1), SQL_Value (i, 2), SQL_Value (i, 3));
+    }
+
+  return 0;
 }
 
-static void
+static int
 cmd_checkins (int user_id)
 {
   int i;
 
-  SQL_Query ("SELECT date, type FROM checkins WHERE account=%d", user_id);
+  if (-1 == SQL_Query ("SELECT date, type FROM checkins WHERE account=%d", user_id))
+    return -1;
 
   printf ("%-19s %-7s\n",
           "Date", "Type");
@@ -463,6 +833,8 @@ cmd_checkins (int user_id)
     {
       printf ("%19.*s %7s\n", 19, SQL_Value (i, 0), SQL_Value (i, 1));
     }
+
+  return 0;
 }
 
 static void
@@ -518,18 +890,40 @@ read_password (char password[256])
   printf ("\n");
 }
 
-static void
+struct password_update
+{
+  int user_id;
+  const char *realm;
+  const char *password_hash;
+};
+
+static int
+store_password (struct SQL_Connection *conn, void *arg)
+{
+  struct password_update *update = arg;
+  int rows;
+
+  rows = SQL_ConnQuery (conn, "UPDATE auth SET data = %S WHERE realm = %s AND account = %d", update->password_hash, update->realm, update->user_id);
+
+  if (rows == 0)
+    rows = SQL_ConnQuery (conn, "INSERT INTO auth (account, realm, data) VALUES (%d, %s, %S)", update->user_id, update->realm, update->password_hash);
+
+  return (rows == -1) ? -1 : 0;
+}
+
+static int
 cmd_passwd (int user_id, const char *realm)
 {
+  struct password_update update;
   char password[256];
-  char salt[256], *password_hash;
+  char salt[256];
   size_t i, chars, minchars = 5;
 
   if (strcmp (realm, "login") && strcmp (realm, "door"))
     {
       printf ("Unknown realm\n");
 
-      return;
+      return -1;
     }
 
   printf ("Password for realm \"%s\": ", realm);
@@ -562,30 +956,43 @@ cmd_passwd (int user_id, const char *realm)
                   "  * \"test\"\n",
               chars, minchars);
 
-      return;
+      return -1;
     }
 
-  SQL_Query ("BEGIN");
-
   gensalt (salt);
 
-  password_hash = crypt (password, salt);
+  update.user_id = user_id;
+  update.realm = realm;
+  update.password_hash = crypt (password, salt);
 
-  if (0 == SQL_Query ("UPDATE auth SET data = %s WHERE realm = %s AND account = %d", password_hash, realm, user_id))
-    {
-
-      SQL_Query ("INSERT INTO auth (account, realm, data) VALUES (%d, %s, %s)", user_id, realm, password_hash);
-    }
-
-  SQL_Query ("COMMIT");
+  return SQL_Transaction (SQL_SERIALIZABLE, store_password, &update);
 }
 
-static void
+static int
 cmd_ls (void)
 {
   int i;
 
-  SQL_Query ("SELECT *, (amount / stock)::NUMERIC(10,2) AS unit_price FROM product_stock WHERE stock > 0 ORDER BY name");
+  if (-1 == SQL_Query ("SELECT product, name, stock, amount, unit_price FROM product_inventory WHERE stock > 0 ORDER BY name"))
+    {
+      if (!ARRAY_COUNT (&products) || !(SQL_Offline () || SQL_Unavailable ()))
+        return -1;
+
+      printf ("The database is unavailable; showing products as last listed.\n");
+
+      printf (YELLOW_ON "%-5s %-5s %7s %-20s\n" YELLOW_OFF, "ID", "Count", "Price", "Name");
+
+      for (i = 0; i < (int) ARRAY_COUNT (&products); ++i)
+        {
+          const struct product *product = &ARRAY_GET (&products, i);
+
+          printf ("%-5s %-5s %7s %-20s\n", product->id, product->stock, product->unit_price, product->name);
+        }
+
+      return 0;
+    }
+
+  update_products ();
 
   printf (YELLOW_ON "%-5s %-5s %7s %-20s\n" YELLOW_OFF, "ID", "Count", "Price", "Name");
 
@@ -593,24 +1000,60 @@ cmd_ls (void)
     {
       printf ("%-5s %-5s %7s %-20s\n", SQL_Value (i, 0), SQL_Value (i, 2), SQL_Value (i, 4), SQL_Value (i, 1));
     }
+
+  return 0;
 }
 
-static void
-cmd_products (const char *pattern)
+/* Rows shown by "products PATTERN" */
+#define PRODUCT_SEARCH_LIMIT 20
+
+/* Products matching any of the words given, allowing for typos, best
+ * match first; all products without words.  */
+static int
+cmd_products (int argc, stringlist argv)
 {
-  int i;
+  char pattern[SESSION_LINE_MAX];
+  size_t length = 0;
+  int i, max_rows;
 
-  SQL_Query ("SELECT * FROM product_stock WHERE name ILIKE '%%' || %s || '%%' ORDER BY id", pattern);
+  pattern[0] = 0;
 
-  printf (YELLOW_ON "%-5s %-5s %7s %-20s\n" YELLOW_OFF, "ID", "Count", "Value", "Name");
+  for (i = 1; i < argc && length < sizeof (pattern); ++i)
+    length += snprintf (pattern + length, sizeof (pattern) - length, "%s%s",
+                        (i > 1) ? " " : "", ARRAY_GET (&argv, i));
 
-  for (i = 0; i < SQL_RowCount (); ++i)
+  if (length >= sizeof (pattern))
+    {
+      fprintf (stderr, "Pattern too long\n");
+
+      return -1;
+    }
+
+  /* One row more than is shown tells whether there are more matches.  A
+   * limit of 0 becomes NULL, i.e. all products.  */
+  if (-1 == SQL_Query ("SELECT * FROM p2k12_search_products(%s, NULLIF(%d, 0))",
+                       pattern, (argc > 1) ? PRODUCT_SEARCH_LIMIT + 1 : 0))
+    return -1;
+
+  max_rows = SQL_RowCount ();
+
+  if (argc > 1 && max_rows > PRODUCT_SEARCH_LIMIT)
+    max_rows = PRODUCT_SEARCH_LIMIT;
+
+  printf (YELLOW_ON "%-5s %-5s %7s %-20s\n" YELLOW_OFF, "ID", "Count", "Value", "Name");
+
+  for (i = 0; i < max_rows; ++i)
     {
       printf ("%-5s %-5s %7s %-20s\n", SQL_Value (i, 0), SQL_Value (i, 2), SQL_Value (i, 3), SQL_Value (i, 1));
     }
+
+  if (max_rows < SQL_RowCount ())
+    printf ("More than %d products match; refine the pattern\n", PRODUCT_SEARCH_LIMIT);
+
+  return 0;
 }
 
-static void
+static int
 cmd_retdeposit (int user_id, const char *amount)
 {
   char *endptr;
@@ -619,377 +1062,743 @@ cmd_retdeposit (int user_id, const char *amount)
     fprintf (stderr, "Invalid amount.  Must be a positive number\n");
   else
     {
-      if (-1 != SQL_Query ("BEGIN")
-          && -1 != SQL_Query ("INSERT INTO transactions (reason) VALUES ('return deposit')")
-          && -1 != SQL_Query ("INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency, stock) VALUES (LASTVAL(), %d, (SELECT id FROM accounts WHERE name = 'deposit' LIMIT 1), %s::NUMERIC, 'NOK', 1)", user_id, amount)
-          && -1 != SQL_Query ("COMMIT"))
+      SQL_PipelineBegin (SQL_SERIALIZABLE);
+      SQL_PipelineQuery ("SELECT * FROM p2k12_return_deposit(%d, %s::NUMERIC)", user_id, amount);
+
+      if (-1 != SQL_PipelineCommit ())
         {
           fprintf (stderr, "Commited to transaction log\n");
+
+          return 0;
         }
-      else
-        {
-          SQL_Query ("ROLLBACK");
-          fprintf (stderr, "SQL Error; Did not commit anything\n");
-        }
+
+      fprintf (stderr, "SQL Error; Did not commit anything\n");
     }
+
+  return -1;
 }
 
-static void
-cmd_undo (const char *transaction)
+static int
+cmd_undo (int user_id, const char *transaction)
 {
-  long long int undo_transaction;
+  SQL_PipelineBegin (SQL_SERIALIZABLE);
+  SQL_PipelineQuery ("SELECT * FROM p2k12_undo(%d, %s::INTEGER)", user_id, transaction);
 
-  if (-1 != SQL_Query ("BEGIN")
-      && -1 != SQL_Query ("INSERT INTO transactions (reason) VALUES ('undo ' || %s)", transaction)
-      && -1 != (undo_transaction = sql_last_id ())
-      && -1 != SQL_Query ("INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency, stock) SELECT %l, credit_account, debit_account, amount, currency, stock FROM transaction_lines WHERE transaction = %s::INTEGER",
-                          undo_transaction, transaction)
-      && -1 != SQL_Query ("COMMIT"))
+  if (-1 != SQL_PipelineCommit ())
     {
       fprintf (stderr, "Commited to transaction log.\n");
+
+      return 0;
     }
-  else
-    {
-      SQL_Query ("ROLLBACK");
-      fprintf (stderr, "SQL Error; Did not commit anything\n");
-    }
+
+  fprintf (stderr, "SQL Error; Did not commit anything\n");
+
+  return -1;
 }
 
-static void
+static int
 cmd_checkin (const char *user_name, int user_id, int checkin_type)
 {
-  if (checkin_type == 0)
-    {
-      if (strcmp (user_name, "deficit"))
-        SQL_Query ("INSERT INTO checkins (account, type) VALUES (%d, 'checkout')", user_id);
-    }
-  else if (checkin_type == 1)
+  struct journal_entry entry;
+  long long transaction;
+
+  if (strcmp (user_name, "deficit"))
     {
-      if (strcmp (user_name, "deficit"))
-        SQL_Query ("INSERT INTO checkins (account, type) VALUES (%d, 'checkin')", user_id);
+      if (0 != Journal_InitEntry (&entry, checkin_type == 0 ? JOURNAL_CHECKOUT : JOURNAL_CHECKIN,
+                                  user_id, user_name, 0, 0, 0)
+          || -1 == record (&entry, &transaction))
+        return -1;
     }
 
   printf ("You're now checked %s.\n", checkin_type == 0 ? "out" : "in");
+
+  return 0;
 }
 
 static void
-log_in (const char *user_name, int user_id, int register_checkin)
+write_sqlstats (void)
 {
-  char *command;
+  FILE *f;
 
-  if (persistent_history)
-    {
-      read_history (".p2k12_history");
-    }
-  else
-    {
-      clear_history ();
-    }
+  if (0 == (f = fopen (".p2k12_sqlstats", "w")))
+    return;
 
-  SQL_SetP2k12Account (user_name);
+  SQL_PrintStats (f);
 
-  printf ("Bam, you're logged in!  (No password authentication for now)\n"
-          "Press Ctrl-D to terminate session.  Type \"help\" for help\n"
-          "\n");
+  fclose (f);
+}
 
-  if (register_checkin)
-    cmd_checkin (user_name, user_id, 1);
+static unsigned int
+command_budget (const char *command)
+{
+  static const char *read_commands[] =
+    {
+      "checkins", "help", "lastlog", "ls", "products", "sales", "sqlstats", 0
+    };
+  size_t i;
 
-  cmd_ls ();
+  /* Waits for the user to type a password */
+  if (!strcmp (command, "passwd"))
+    return 0;
 
-  for (; ;)
+  for (i = 0; read_commands[i]; ++i)
     {
-      char *prompt, *argv0, *endptr;
-      stringlist argv;
-      size_t argc;
-
-      SQL_Query ("SELECT -balance FROM user_balances WHERE id = %d", user_id);
+      if (!strcmp (command, read_commands[i]))
+        return READ_COMMAND_BUDGET_MS;
+    }
 
-      asprintf (&prompt, GREEN_ON "%s (%s)> " GREEN_OFF, user_name, SQL_Value (0, 0));
+  return WRITE_COMMAND_BUDGET_MS;
+}
 
-      alarm (120);
+/* Line passed to the readline callback, NULL at end of input */
+static char *input_line;
+static int input_ready;
 
-      if (!(command = trim (readline (prompt))))
-        break;
+static void
+input_handler (char *line)
+{
+  input_line = line;
+  input_ready = 1;
 
-      add_history(command);
+  /* Commands run with the terminal in its normal mode */
+  rl_callback_handler_remove ();
+}
 
-      if (persistent_history)
-        {
-          write_history (".p2k12_history");
-        }
+/* Reads a command while the user's status query, already sent with
+ * SQL_SendQuery, is running.  The balance is added to the prompt as
+ * soon as it arrives.  */
+static char *
+read_command (const char *user_name, struct SQL_Result **status)
+{
+  struct pollfd fds[2];
+  char *prompt;
+  int pending = 1;
 
-      alarm (0);
+  asprintf (&prompt, GREEN_ON "%s (...)> " GREEN_OFF, user_name);
+  input_ready = 0;
+  rl_callback_handler_install (prompt, input_handler);
+  free (prompt);
 
-      free (prompt);
+  while (!input_ready)
+    {
+      fds[0].fd = STDIN_FILENO;
+      fds[0].events = POLLIN;
+      fds[1].fd = SQL_Socket ();
+      fds[1].events = POLLIN;
 
-      if (-1 == argv_parse (&argv, command))
+      if (-1 == poll (fds, pending ? 2 : 1, -1))
         {
-          free (command);
+          if (errno == EINTR)
+            continue;
 
-          continue;
+          err (EXIT_FAILURE, "poll failed");
         }
 
-      argc = ARRAY_COUNT (&argv);
-
-      if (!argc)
+      if (pending && fds[1].revents && 0 != SQL_AsyncPoll ())
         {
-          ARRAY_FREE (&argv);
-          free (command);
+          pending = 0;
 
-          continue;
+          if ((*status = SQL_AsyncResult ()) && SQL_ResultRowCount (*status))
+            asprintf (&prompt, GREEN_ON "%s (%s)> " GREEN_OFF, user_name, SQL_ResultValue (*status, 0, 0));
+          else
+            asprintf (&prompt, GREEN_ON "%s (?)> " GREEN_OFF, user_name);
+
+          rl_set_prompt (prompt);
+          rl_forced_update_display ();
+          free (prompt);
         }
 
-      argv0 = ARRAY_GET (&argv, 0);
+      if (fds[0].revents)
+        rl_callback_read_char ();
+    }
 
-      if (strcmp (user_name, "deficit") != 0 && strcmp (user_name, "deposit") != 0)
-        {
-          SQL_Query ("SELECT price, flag FROM active_members WHERE account = %d", user_id);
+  if (pending)
+    *status = SQL_AsyncResult ();
 
-          int membership_price;
+  return input_line;
+}
 
-          const char *flag;
+/* Runs one command line on behalf of the user.  status is the result
+ * of the status query made before the command, or NULL.  Returns 0 if
+ * the command succeeded, -1 otherwise.  */
+static int
+run_command (const char *user_name, int user_id, char *command, const struct SQL_Result *status)
+{
+  struct journal_entry entry;
+  long long transaction;
+  char *argv0, *endptr;
+  stringlist argv;
+  size_t argc;
+  int result = -1, field;
+
+  if (-1 == argv_parse (&argv, command))
+    return -1;
 
-          if (SQL_RowCount() > 0)
-            {
-              membership_price = (int) strtol(SQL_Value(0, 0), 0, 0);
-              flag = SQL_Value(0, 1);
-            }
-          else
-            {
-              membership_price = 0;
-              flag = "";
-            }
+  argc = ARRAY_COUNT (&argv);
 
-          if (strcmp (argv0, "become") != 0 && membership_price < 100 && strcmp (argv0, "help") != 0 && strcmp (flag, "m_office") != 0
-              && strcmp (argv0, "officeuser") != 0 && strcmp (argv0, "lastlog") != 0)
-            {
-              fprintf (stderr, "p2k12 is a members only system.\nUse the become command to get more privileges.\nThe help command lists public commands.\n");
+  if (!argc)
+    {
+      ARRAY_FREE (&argv);
 
-              ARRAY_FREE (&argv);
-              free (command);
-              continue;
-            }
-        }
+      return 0;
+    }
 
-      if (!strcmp (argv0, "give") && argc == 3)
-        {
-          char *target, *amount;
+  argv0 = ARRAY_GET (&argv, 0);
 
-          target = ARRAY_GET (&argv, 1);
-          amount = ARRAY_GET (&argv, 2);
+  if (strcmp (user_name, "deficit") != 0 && strcmp (user_name, "deposit") != 0)
+    {
+      long long membership_price;
 
-          if (amount[0] == '-')
-            {
-              fprintf (stderr, "You cannot give away negative amounts\n");
-            }
-          else if (-1 != SQL_Query ("BEGIN")
-                   && -1 != SQL_Query ("INSERT INTO transactions (reason) VALUES ('give')")
-                   && -1 != SQL_Query ("INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency) VALUES (LASTVAL(), %d, (SELECT id FROM accounts WHERE name = %s), %s::NUMERIC, 'NOK')", user_id, target, amount)
-                   && -1 != SQL_Query ("COMMIT"))
-            {
-              fprintf (stderr, "Commited to transaction log: %s gives %s %s NOK\n", user_name, target, amount);
-            }
-          else
-            {
-              SQL_Query ("ROLLBACK");
+      const char *flag;
 
-              fprintf (stderr, "Not ok\n");
-            }
+      if (status && SQL_ResultRowCount (status) > 0
+          && !SQL_ResultIsNull (status, 0, 1))
+        {
+          if (-1 == SQL_ResultInt (status, 0, 1, &membership_price))
+            membership_price = 0;
+
+          flag = SQL_ResultValue(status, 0, 2);
         }
-      else if (!strcmp (argv0, "take") && argc == 3)
+      else
         {
-          char *target, *amount;
+          membership_price = 0;
+          flag = "";
+        }
 
-          target = ARRAY_GET (&argv, 1);
-          amount = ARRAY_GET (&argv, 2);
+      if (strcmp (argv0, "become") != 0 && membership_price < 100 && strcmp (argv0, "help") != 0 && strcmp (flag, "m_office") != 0
+          && strcmp (argv0, "officeuser") != 0 && strcmp (argv0, "lastlog") != 0)
+        {
+          fprintf (stderr, "p2k12 is a members only system.\nUse the become command to get more privileges.\nThe help command lists public commands.\n");
 
-          if (amount[0] == '-')
-            {
-              fprintf (stderr, "You cannot take negative amounts\n");
-            }
-          else if (-1 != SQL_Query ("BEGIN")
-                   && -1 != SQL_Query ("INSERT INTO transactions (reason) VALUES ('take')")
-                   && -1 != SQL_Query ("INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency) VALUES (LASTVAL(), (SELECT id FROM accounts WHERE name = %s), %d, %s::NUMERIC, 'NOK')", target, user_id, amount)
-                   && -1 != SQL_Query ("COMMIT"))
-            {
-              fprintf (stderr, "Commited to transaction log: %s takes %s NOK from %s\n", user_name, amount, target);
-            }
-          else
-            {
-              SQL_Query ("ROLLBACK");
+          ARRAY_FREE (&argv);
 
-              fprintf (stderr, "Not ok\n");
-            }
+          return -1;
         }
-      else if (!strcmp (argv0, "become"))
+    }
+
+  SQL_SetCommandDeadline (command_budget (argv0));
+
+  if (!strcmp (argv0, "give") && argc == 3)
+    {
+      char *target, *amount;
+
+      target = ARRAY_GET (&argv, 1);
+      amount = ARRAY_GET (&argv, 2);
+
+      if (amount[0] == '-')
         {
-          if (argc == 2)
-            cmd_become (user_id, ARRAY_GET (&argv, 1));
-          else
-            fprintf (stderr, "Usage: %s <PRICE>\n", argv0);
+          fprintf (stderr, "You cannot give away negative amounts\n");
         }
-      else if (!strcmp (argv0, "dns"))
+      else if (0 > strtod (amount, &endptr) || *endptr)
         {
-          cmd_dns (user_id, argc, argv);
+          fprintf (stderr, "Invalid amount '%s'\n", amount);
         }
-      else if (!strcmp (argv0, "officeuser"))
+      else if (0 != (field = Journal_InitEntry (&entry, JOURNAL_GIVE, user_id, user_name, target, amount, 0)))
         {
-          cmd_officeuser (user_id);
+          report_entry_field (field, JOURNAL_GIVE, user_name, target, amount);
         }
-      else if (!strcmp (argv0, "addproduct"))
+      else
         {
-          if (argc == 2)
-            cmd_addproduct (ARRAY_GET (&argv, 1));
-          else
-            fprintf (stderr, "Usage: %s <NAME>\n", argv0);
+          switch (record (&entry, &transaction))
+            {
+            case 0:
+              fprintf (stderr, "Commited to transaction log: %s gives %s %s NOK\n", user_name, target, amount);
+              result = 0;
+              break;
+
+            case 1:
+              fprintf (stderr, "Saved to the offline journal: %s gives %s %s NOK\n", user_name, target, amount);
+              result = 0;
+              break;
+
+            default:
+              fprintf (stderr, "Not ok\n");
+            }
         }
-      else if (!strcmp (argv0, "addstock"))
+    }
+  else if (!strcmp (argv0, "take") && argc == 3)
+    {
+      char *target, *amount;
+
+      target = ARRAY_GET (&argv, 1);
+      amount = ARRAY_GET (&argv, 2);
+
+      if (amount[0] == '-')
         {
-          if (argc == 4)
-            cmd_addstock (user_id, ARRAY_GET (&argv, 1), ARRAY_GET (&argv, 2), ARRAY_GET (&argv, 3));
-          else
-            fprintf (stderr, "Usage: %s <PRODUCT-ID> <SUM-VALUE> <STOCK>\n", argv0);
+          fprintf (stderr, "You cannot take negative amounts\n");
         }
-      else if (!strcmp (argv0, "lastlog"))
+      else if (0 > strtod (amount, &endptr) || *endptr)
         {
-          if (argc == 2)
-            cmd_lastlog (user_id, ARRAY_GET(&argv, 1));
-          else if (argc == 1)
-            cmd_lastlog (user_id, 0);
-          else
-            fprintf (stderr, "Usage: %s [day, week, year]\n", argv0);
+          fprintf (stderr, "Invalid amount '%s'\n", amount);
         }
-      else if (!strcmp (argv0, "checkins"))
+      else if (0 != (field = Journal_InitEntry (&entry, JOURNAL_TAKE, user_id, user_name, target, amount, 0)))
         {
-          if (argc == 1)
-            cmd_checkins (user_id);
-          else
-            fprintf (stderr, "Usage: %s\n", argv0);
+          report_entry_field (field, JOURNAL_TAKE, user_name, target, amount);
         }
-      else if (!strcmp (argv0, "passwd"))
+      else
         {
-          if (argc == 2)
-            cmd_passwd (user_id, ARRAY_GET (&argv, 1));
-          else
-            fprintf (stderr, "Usage: %s <REALM>\n", argv0);
+          switch (record (&entry, &transaction))
+            {
+            case 0:
+              fprintf (stderr, "Commited to transaction log: %s takes %s NOK from %s\n", user_name, amount, target);
+              result = 0;
+              break;
+
+            case 1:
+              fprintf (stderr, "Saved to the offline journal: %s takes %s NOK from %s\n", user_name, amount, target);
+              result = 0;
+              break;
+
+            default:
+              fprintf (stderr, "Not ok\n");
+            }
         }
-      else if (!strcmp (argv0, "ls"))
+    }
+  else if (!strcmp (argv0, "become"))
+    {
+      if (argc == 2)
+        result = cmd_become (user_id, ARRAY_GET (&argv, 1));
+      else
+        fprintf (stderr, "Usage: %s <PRICE>\n", argv0);
+    }
+  else if (!strcmp (argv0, "dns"))
+    {
+      result = cmd_dns (user_id, argc, argv);
+    }
+  else if (!strcmp (argv0, "officeuser"))
+    {
+      result = cmd_officeuser (user_id);
+    }
+  else if (!strcmp (argv0, "addproduct"))
+    {
+      if (argc == 2)
+        result = cmd_addproduct (ARRAY_GET (&argv, 1));
+      else
+        fprintf (stderr, "Usage: %s <NAME>\n", argv0);
+    }
+  else if (!strcmp (argv0, "addstock"))
+    {
+      if (argc == 4)
+        result = cmd_addstock (user_id, ARRAY_GET (&argv, 1), ARRAY_GET (&argv, 2), ARRAY_GET (&argv, 3));
+      else
+        fprintf (stderr, "Usage: %s <PRODUCT-ID> <SUM-VALUE> <STOCK>\n", argv0);
+    }
+  else if (!strcmp (argv0, "lastlog"))
+    {
+      result = cmd_lastlog (user_id, argc, argv);
+    }
+  else if (!strcmp (argv0, "sales"))
+    {
+      result = cmd_sales (argc, argv);
+    }
+  else if (!strcmp (argv0, "checkins"))
+    {
+      if (argc == 1)
+        result = cmd_checkins (user_id);
+      else
+        fprintf (stderr, "Usage: %s\n", argv0);
+    }
+  else if (!strcmp (argv0, "passwd"))
+    {
+      /* The daemon cannot turn off echo on the user's terminal */
+      if (serving)
+        fprintf (stderr, "passwd is only available when logged in over ssh\n");
+      else if (argc == 2)
+        result = cmd_passwd (user_id, ARRAY_GET (&argv, 1));
+      else
+        fprintf (stderr, "Usage: %s <REALM>\n", argv0);
+    }
+  else if (!strcmp (argv0, "ls"))
+    {
+      if (argc == 1)
+        result = cmd_ls ();
+      else
+        fprintf (stderr, "Usage: %s\n", argv0);
+    }
+  else if (!strcmp (argv0, "products"))
+    {
+      result = cmd_products (argc, argv);
+    }
+  else if (!strcmp (argv0, "retdeposit"))
+    {
+      if (argc == 2)
+        result = cmd_retdeposit (user_id, ARRAY_GET (&argv, 1));
+      else
+        fprintf (stderr, "Usage: %s <AMOUNT>\n", argv0);
+    }
+  else if (!strcmp (argv0, "undo"))
+    {
+      if (argc == 2)
+        result = cmd_undo (user_id, ARRAY_GET (&argv, 1));
+      else
+        fprintf (stderr, "Usage: %s <TRANSACTION>\n", argv0);
+    }
+  else if (!strcmp (argv0, "help"))
+    {
+      fprintf (stderr,
+               "become PRICE                 switch membership price to PRICE\n"
+               "                                prices: 0, 300, 500, 1000, 1500\n"
+               "checkin                      register arrival to space\n"
+               "checkins                     list all your registered checkins\n"
+               "checkout                     register departure from space\n"
+               "give USER AMOUNT             give AMOUNT to USER from own account\n"
+               "take USER AMOUNT             take AMOUNT from USER to own account\n"
+               "addproduct NAME              adds PRODUCT to the inventory\n"
+               "addstock PRODUCT-ID SUM-VALUE STOCK\n"
+               "                             adds STOCK items of product with ID PRODUCT-ID\n"
+               "                               and total value SUM-VALUE to stock\n"
+               "lastlog [day, week, year]    list all transactions involving you\n"
+               "  [--limit N] [--before TID] show N transactions at a time, older than TID\n"
+               "lastlog next                 show the next page\n"
+               "passwd REALM                 set password for given realm\n"
+               "                               realms: door, login\n"
+               "products [PATTERN]           list all products and their IDs\n"
+               "                             or if supplied, the best matches for PATTERN\n"
+               "retdeposit AMOUNT            return deposit taken from storage to p2k12\n"
+               "sales [day, week, year]      list the N best selling products,\n"
+               "  [--since DATE] [--until DATE] [--top N]\n"
+               "                               10 by default\n"
+               "sqlstats                     show database query statistics\n"
+               "undo TRANSACTION             undo a transaction\n"
+               "help                         display this help text\n"
+               "[0-9]+ COUNT                 buy a product\n"
+               "\n\nUse SHIFT+[PAGE_UP, PAGE_DOWN] too see previous commands or output\n");
+
+      result = 0;
+    }
+  else if (strtol (argv0, &endptr, 0) && !*endptr)
+    {
+      struct product product;
+      char amount[32] = "";
+      int count = 1;
+
+      if (argc > 2)
+        fprintf (stderr, "Usage: <PRODUCT-ID> [COUNT]\n");
+      else if (argc == 2
+               && (0 >= (count = (int) strtol (ARRAY_GET (&argv, 1), &endptr, 0))
+                   || *endptr))
         {
-          if (argc == 1)
-            cmd_ls ();
-          else
-            fprintf (stderr, "Usage: %s\n", argv0);
+          fprintf (stderr, "Invalid count '%s'\n", ARRAY_GET (&argv, 1));
         }
-      else if (!strcmp (argv0, "products"))
+      else if (-1 == find_product (argv0, &product))
         {
-          if (argc == 2)
-            cmd_products (ARRAY_GET(&argv, 1));
-          else if (argc == 1)
-            cmd_products ("");
-          else
-            fprintf (stderr, "Usage: %s [PATTERN]\n", argv0);
+          fprintf (stderr, "Bad product ID\n");
         }
-      else if (!strcmp (argv0, "retdeposit"))
+      else
         {
-          if (argc == 2)
-            cmd_retdeposit (user_id, ARRAY_GET (&argv, 1));
+          /* Only used if the purchase has to be journaled */
+          total_price (amount, sizeof (amount), product.unit_price, count);
+
+          if (0 != (field = Journal_InitEntry (&entry, JOURNAL_BUY, user_id, user_name, product.id, amount, count)))
+            report_entry_field (field, JOURNAL_BUY, user_name, product.id, amount);
           else
-            fprintf (stderr, "Usage: %s <AMOUNT>\n", argv0);
+            {
+              switch (record (&entry, &transaction))
+                {
+                case 0:
+                  fprintf (stderr, "Commited to transaction log: %s buys %d %s.  To undo, type undo %lld\n", user_name, count, product.name, transaction);
+                  result = 0;
+                  break;
+
+                case 1:
+                  fprintf (stderr, "Saved to the offline journal: %s buys %d %s for %s NOK\n", user_name, count, product.name, amount);
+                  result = 0;
+                  break;
+
+                default:
+                  fprintf (stderr, "SQL Error; Did not commit anything\n");
+                }
+            }
+
+          free_product (&product);
         }
-      else if (!strcmp (argv0, "undo"))
+    }
+  else if (!strcmp (argv0, "checkin"))
+    {
+      if (argc == 1)
+        result = cmd_checkin (user_name, user_id, 1);
+      else
+        fprintf (stderr, "Usage: %s\n", argv0);
+    }
+  else if (!strcmp (argv0, "sqlstats"))
+    {
+      if (argc == 1)
         {
-          if (argc == 2)
-            cmd_undo (ARRAY_GET (&argv, 1));
-          else
-            fprintf (stderr, "Usage: %s <TRANSACTION>\n", argv0);
+          SQL_PrintStats (stdout);
+          result = 0;
         }
-      else if (!strcmp (argv0, "help"))
+      else
+        fprintf (stderr, "Usage: %s\n", argv0);
+    }
+  else if (!strcmp (argv0, "checkout"))
+    {
+      if (argc == 1)
+        result = cmd_checkin (user_name, user_id, 0);
+      else
+        fprintf (stderr, "Usage: %s\n", argv0);
+    }
+  else
+    fprintf (stderr, "Unknown command '%s'.  Try 'help'\n", argv0);
+
+  SQL_SetCommandDeadline (0);
+
+  ARRAY_FREE (&argv);
+
+  return result;
+}
+
+static void
+log_in (const char *user_name, int user_id, int register_checkin)
+{
+  struct SQL_Result *last_status = 0;
+  char *command;
+
+  if (persistent_history)
+    {
+      read_history (".p2k12_history");
+    }
+  else
+    {
+      clear_history ();
+    }
+
+  SQL_SetP2k12Account (user_name);
+
+  printf ("Bam, you're logged in!  (No password authentication for now)\n"
+          "Press Ctrl-D to terminate session.  Type \"help\" for help\n"
+          "\n");
+
+  if (register_checkin)
+    cmd_checkin (user_name, user_id, 1);
+
+  cmd_ls ();
+
+  for (; ;)
+    {
+      struct SQL_Result *status = 0;
+
+      /* Fetched while the user types */
+      SQL_SendQuery (STATUS_QUERY, user_id);
+
+      alarm (120);
+
+      if (!(command = trim (read_command (user_name, &status))))
         {
-          fprintf (stderr,
-                   "become PRICE                 switch membership price to PRICE\n"
-                   "                                prices: 0, 300, 500, 1000, 1500\n"
-                   "checkin                      register arrival to space\n"
-                   "checkins                     list all your registered checkins\n"
-                   "checkout                     register departure from space\n"
-                   "give USER AMOUNT             give AMOUNT to USER from own account\n"
-                   "take USER AMOUNT             take AMOUNT from USER to own account\n"
-                   "addproduct NAME              adds PRODUCT to the inventory\n"
-                   "addstock PRODUCT-ID SUM-VALUE STOCK\n"
-                   "                             adds STOCK items of product with ID PRODUCT-ID\n"
-                   "                               and total value SUM-VALUE to stock\n"
-                   "lastlog [day, week, year]    list all transactions involving you\n"
-                   "passwd REALM                 set password for given realm\n"
-                   "                               realms: door, login\n"
-                   "products [PATTERN]           list all products and their IDs\n"
-                   "                             or if supplied, only those that match PATTERN\n"
-                   "retdeposit AMOUNT            return deposit taken from storage to p2k12\n"
-                   "undo TRANSACTION             undo a transaction\n"
-                   "help                         display this help text\n"
-                   "[0-9]+ COUNT                 buy a product\n"
-                   "\n\nUse SHIFT+[PAGE_UP, PAGE_DOWN] too see previous commands or output\n");
+          SQL_ResultFree (status);
+
+          break;
         }
-      else if (strtol (argv0, &endptr, 0) && !*endptr)
+
+      add_history(command);
+
+      if (persistent_history)
+        {
+          write_history (".p2k12_history");
+        }
+
+      alarm (0);
+
+      /* While the database is down, go by the last status known */
+      if (status)
         {
-          int count = 1;
+          SQL_ResultFree (last_status);
+          last_status = status;
+        }
+
+      run_command (user_name, user_id, command, last_status);
+
+      free (command);
+    }
+
+  SQL_ResultFree (last_status);
+
+  if (persistent_sqlstats)
+    write_sqlstats ();
+}
+
+/* Fetches the balance and membership again after a command that may
+ * have changed them, keeping *status if that fails.  */
+static void
+refresh_status (int user_id, struct SQL_Result **status)
+{
+  struct SQL_Result *result;
+
+  if ((result = SQL_Execute (STATUS_QUERY, user_id)))
+    {
+      SQL_ResultFree (*status);
+      *status = result;
+    }
+}
+
+/* Runs one scripted command and reports its outcome and duration on
+ * stderr.  */
+static int
+run_scripted (const char *user_name, int user_id, const char *line, unsigned int line_number,
+              struct SQL_Result **status)
+{
+  struct timespec start, end;
+  char *command;
+  int result;
+
+  if (!(command = strdup (line)))
+    err (EXIT_FAILURE, "strdup failed");
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  result = run_command (user_name, user_id, command, *status);
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  if (result != -1)
+    refresh_status (user_id, status);
+
+  fflush (stdout);
+
+  fprintf (stderr, "line %u: %s (%.1f ms): %s\n", line_number,
+           (result == -1) ? "FAILED" : "ok",
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+           line);
+
+  free (command);
+
+  return result;
+}
+
+/* Runs one scripted command repeat times, reporting only the failure
+ * count and throughput on stderr.  Returns the number of failed runs.  */
+static unsigned int
+run_repeated (const char *user_name, int user_id, const char *line, unsigned int repeat,
+              struct SQL_Result **status)
+{
+  struct timespec start, end;
+  unsigned int i, failures = 0;
+  char *command;
+  double seconds;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < repeat; ++i)
+    {
+      if (!(command = strdup (line)))
+        err (EXIT_FAILURE, "strdup failed");
+
+      if (-1 == run_command (user_name, user_id, command, *status))
+        ++failures;
+      else
+        refresh_status (user_id, status);
+
+      free (command);
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  fflush (stdout);
+
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  fprintf (stderr, "%u runs, %u failed, %.3f s, %.0f runs/s: %s\n",
+           repeat, failures, seconds, (seconds > 0) ? repeat / seconds : 0.0, line);
+
+  return failures;
+}
+
+/* Runs commands for the given user without an interactive session: either
+ * the single command, repeat times, or every line of batch.  With
+ * single_transaction, all commands share one transaction that is
+ * committed only if every command succeeds.  Each command still runs its
+ * own queries, pipelined within the command, since it prints their
+ * results before the next line is read.  Returns the process exit
+ * status.  */
+static int
+run_script (const char *user_name, const char *command, unsigned int repeat, FILE *batch,
+            int single_transaction)
+{
+  struct SQL_Result *account, *status;
+  long long user_id;
+  unsigned int line_number = 0, failures = 0;
+  char *line = 0;
+  size_t line_size = 0;
+  ssize_t length;
+
+  if (!(account = SQL_Execute ("SELECT id, name FROM accounts WHERE LOWER(name) = LOWER(%s)", user_name)))
+    errx (EXIT_FAILURE, "SQL query failed");
+
+  if (!SQL_ResultRowCount (account)
+      || -1 == SQL_ResultInt (account, 0, 0, &user_id))
+    errx (EXIT_FAILURE, "Unknown user '%s'", user_name);
+
+  user_name = SQL_ResultValue (account, 0, 1);
+
+  SQL_SetP2k12Account (user_name);
+
+  if (!(status = SQL_Execute (STATUS_QUERY, (int) user_id)))
+    errx (EXIT_FAILURE, "SQL query failed");
+
+  if (single_transaction && -1 == SQL_Query ("BEGIN"))
+    errx (EXIT_FAILURE, "Failed to start transaction");
+
+  /* Journaled commands would escape the transaction */
+  if (single_transaction)
+    journal_enabled = 0;
+
+  if (command && repeat > 1)
+    failures = run_repeated (user_name, user_id, command, repeat, &status);
+  else if (command)
+    {
+      if (-1 == run_scripted (user_name, user_id, command, 1, &status))
+        ++failures;
+    }
+  else
+    {
+      while (-1 != (length = getline (&line, &line_size, batch)))
+        {
+          char *text;
+
+          ++line_number;
 
-          if (argc > 2)
-            fprintf (stderr, "Usage: <PRODUCT-ID> [COUNT]\n");
-          else if (-1 == SQL_Query ("SELECT name FROM accounts WHERE (id = %s::INTEGER OR name = %s) AND type = 'product'", argv0, argv0)
-                   || !SQL_RowCount ())
-            {
-              fprintf (stderr, "Bad product ID\n");
-            }
-          else if (argc == 2
-                   && (0 >= (count = (int) strtol (ARRAY_GET (&argv, 1), &endptr, 0))
-                       || *endptr))
-            {
-              fprintf (stderr, "Invalid count '%s'\n", ARRAY_GET (&argv, 1));
-            }
-          else
-            {
-              char *product_name;
-              long long transaction;
+          while (length && isspace (line[length - 1]))
+            line[--length] = 0;
 
-              product_name = strdup (SQL_Value (0, 0));
+          text = line;
 
-              if (-1 != SQL_Query ("BEGIN")
-                  && -1 != SQL_Query ("INSERT INTO transactions (reason) VALUES ('buy')")
-                  && -1 != (transaction = sql_last_id ())
-                  && -1 != SQL_Query ("INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency, stock) VALUES (%l, %d, %s::INTEGER, (SELECT %d * amount / stock FROM product_stock WHERE id = %s::INTEGER), 'NOK', %d)", transaction, user_id, command, count, command, count)
-                  && -1 != SQL_Query ("COMMIT"))
-                {
-                  fprintf (stderr, "Commited to transaction log: %s buys %d %s.  To undo, type undo %lld\n", user_name, count, product_name, transaction);
-                }
-              else
-                {
-                  SQL_Query ("ROLLBACK");
-                  fprintf (stderr, "SQL Error; Did not commit anything\n");
-                }
+          while (isspace (*text))
+            ++text;
+
+          if (!*text || *text == '#')
+            continue;
 
-              free (product_name);
+          if (-1 == run_scripted (user_name, user_id, text, line_number, &status))
+            {
+              ++failures;
+
+              /* The remaining commands would be rolled back anyway */
+              if (single_transaction)
+                break;
             }
         }
-      else if (!strcmp (argv0, "checkin"))
-        {
-          if (argc == 1)
-            cmd_checkin (user_name, user_id, 1);
-          else
-            fprintf (stderr, "Usage: %s\n", argv0);
-        }
-      else if (!strcmp (argv0, "checkout"))
-        {
-          if (argc == 1)
-            cmd_checkin (user_name, user_id, 0);
-          else
-            fprintf (stderr, "Usage: %s\n", argv0);
-        }
+
+      free (line);
+    }
+
+  if (single_transaction)
+    {
+      if (!failures && -1 != SQL_Query ("COMMIT"))
+        fprintf (stderr, "Committed all commands\n");
       else
-        fprintf (stderr, "Unknown command '%s'.  Try 'help'\n", argv0);
+        {
+          SQL_Query ("ROLLBACK");
 
-      ARRAY_FREE (&argv);
-      free (command);
+          fprintf (stderr, "Rolled back all commands\n");
+
+          if (!failures)
+            failures = 1;
+        }
     }
+
+  SQL_ResultFree (status);
+  SQL_ResultFree (account);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 void
@@ -1075,6 +1884,8 @@ register_member ()
   for (;;)
     {
       char *user_name;
+      struct SQL_Result *account;
+      long long account_id;
 
       struct termios t;
 
@@ -1094,18 +1905,21 @@ register_member ()
       if (!user_name || !*user_name)
         exit (EXIT_FAILURE);
 
-      if (-1 == SQL_Query ("SELECT id, name FROM accounts WHERE LOWER(name) = LOWER(%s)", user_name))
+      if (!(account = SQL_Execute ("SELECT id, name FROM accounts WHERE LOWER(name) = LOWER(%s)", user_name)))
         errx (EXIT_FAILURE, "SQL query failed");
 
-      if (SQL_RowCount ())
+      if (SQL_ResultRowCount (account)
+          && -1 != SQL_ResultInt (account, 0, 0, &account_id))
         {
-          user_name = strdup (SQL_Value (0, 1));
+          log_in (SQL_ResultValue (account, 0, 1), account_id, 1);
 
-          log_in (user_name, atoi (SQL_Value (0, 0)), 1);
+          SQL_ResultFree (account);
 
           return;
         }
 
+      SQL_ResultFree (account);
+
       if (allow_user_creation)
         {
           create_user (user_name);
@@ -1117,9 +1931,495 @@ register_member ()
     }
 }
 
+/* Daemon mode.  Terminals connect to a Unix socket, send their user name
+ * and then command lines.  Commands run one at a time, each on a
+ * connection taken from a small pool, with the process' standard output
+ * and error redirected to the session's socket meanwhile.  */
+
+struct session
+{
+  int fd;
+  char line[SESSION_LINE_MAX];
+  size_t length;
+
+  /* NULL until logged in */
+  char *user_name;
+  int user_id;
+
+  time_t active;
+  struct SQL_Result *status;
+  struct lastlog_page lastlog;
+};
+
+static ARRAY (struct session *) sessions;
+static struct SQL_Pool *pool;
+static int epoll_fd, saved_stdout, saved_stderr;
+
+static void
+redirect_output (int fd)
+{
+  fflush (stdout);
+  fflush (stderr);
+
+  dup2 (fd, STDOUT_FILENO);
+  dup2 (fd, STDERR_FILENO);
+}
+
+static void
+session_prompt (struct session *session)
+{
+  if (!session->user_name)
+    printf ("Your user name: ");
+  else if (session->status && SQL_ResultRowCount (session->status))
+    printf (GREEN_ON "%s (%s)> " GREEN_OFF, session->user_name, SQL_ResultValue (session->status, 0, 0));
+  else
+    printf (GREEN_ON "%s (?)> " GREEN_OFF, session->user_name);
+}
+
+static void
+session_log_in (struct session *session, const char *user_name)
+{
+  struct SQL_Result *account;
+  long long account_id;
+
+  if (!*user_name
+      || !(account = SQL_Execute ("SELECT id, name FROM accounts WHERE LOWER(name) = LOWER(%s)", user_name)))
+    return;
+
+  if (SQL_ResultRowCount (account)
+      && -1 != SQL_ResultInt (account, 0, 0, &account_id))
+    {
+      session->user_name = strdup (SQL_ResultValue (account, 0, 1));
+      session->user_id = account_id;
+
+      printf ("Bam, you're logged in!  (No password authentication for now)\n"
+              "Press Ctrl-D to terminate session.  Type \"help\" for help\n"
+              "\n");
+    }
+  else
+    printf ("Username not recognized.\n\n");
+
+  SQL_ResultFree (account);
+}
+
+static void
+session_command (struct session *session, char *command)
+{
+  struct SQL_Connection *conn;
+
+  if (!(conn = SQL_PoolAcquire (pool, session->user_name)))
+    {
+      dprintf (session->fd, "Database unavailable; please try again later\n");
+
+      return;
+    }
+
+  SQL_SetDefaultConnection (conn);
+  redirect_output (session->fd);
+
+  if (!session->user_name)
+    {
+      session_log_in (session, trim (command));
+
+      /* The check-in is audited as the user, so it runs on a connection
+       * set up for them.  */
+      if (session->user_name)
+        {
+          SQL_PoolRelease (pool, conn);
+
+          if ((conn = SQL_PoolAcquire (pool, session->user_name)))
+            {
+              SQL_SetDefaultConnection (conn);
+
+              cmd_checkin (session->user_name, session->user_id, 1);
+              cmd_ls ();
+            }
+          else
+            printf ("Database unavailable; please try again later\n");
+        }
+    }
+  else
+    {
+      lastlog_page = session->lastlog;
+      run_command (session->user_name, session->user_id, trim (command), session->status);
+      session->lastlog = lastlog_page;
+    }
+
+  /* While the database is down, go by the last status known */
+  if (conn && session->user_name)
+    refresh_status (session->user_id, &session->status);
+
+  session_prompt (session);
+
+  fflush (stdout);
+  fflush (stderr);
+  dup2 (saved_stdout, STDOUT_FILENO);
+  dup2 (saved_stderr, STDERR_FILENO);
+
+  if (conn)
+    SQL_PoolRelease (pool, conn);
+}
+
+static void
+session_close (struct session *session)
+{
+  size_t i;
+
+  epoll_ctl (epoll_fd, EPOLL_CTL_DEL, session->fd, 0);
+  close (session->fd);
+
+  for (i = 0; i < ARRAY_COUNT (&sessions); ++i)
+    {
+      if (ARRAY_GET (&sessions, i) == session)
+        {
+          ARRAY_REMOVE (&sessions, i);
+
+          break;
+        }
+    }
+
+  SQL_ResultFree (session->status);
+  free (session->user_name);
+  free (session);
+}
+
+static void
+session_accept (int listen_fd)
+{
+  struct session *session;
+  struct epoll_event event;
+  struct timeval timeout;
+  int fd;
+
+  if (-1 == (fd = accept4 (listen_fd, 0, 0, SOCK_CLOEXEC)))
+    return;
+
+  /* A terminal that stops reading must not stall the others for long */
+  timeout.tv_sec = 5;
+  timeout.tv_usec = 0;
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+  if (!(session = calloc (1, sizeof (*session))))
+    errx (EXIT_FAILURE, "calloc failed");
+
+  session->fd = fd;
+  session->active = time (0);
+
+  ARRAY_ADD (&sessions, session);
+
+  if (-1 == ARRAY_RESULT (&sessions))
+    errx (EXIT_FAILURE, "ARRAY_ADD failed");
+
+  event.events = EPOLLIN;
+  event.data.ptr = session;
+
+  if (-1 == epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &event))
+    {
+      session_close (session);
+
+      return;
+    }
+
+  dprintf (fd, "Welcome to P2K12!\n\nYour user name: ");
+}
+
+/* Runs each complete line received.  Returns -1 when the session ends.  */
+static int
+session_read (struct session *session)
+{
+  char *newline;
+  ssize_t size;
+
+  size = read (session->fd, session->line + session->length, sizeof (session->line) - session->length - 1);
+
+  if (size <= 0)
+    return -1;
+
+  session->length += size;
+  session->line[session->length] = 0;
+  session->active = time (0);
+
+  while (0 != (newline = strchr (session->line, '\n')))
+    {
+      *newline = 0;
+
+      if (newline > session->line && newline[-1] == '\r')
+        newline[-1] = 0;
+
+      session_command (session, session->line);
+
+      session->length -= newline + 1 - session->line;
+      memmove (session->line, newline + 1, session->length + 1);
+    }
+
+  if (session->length == sizeof (session->line) - 1)
+    {
+      dprintf (session->fd, "Line too long\n");
+
+      session->length = 0;
+    }
+
+  return 0;
+}
+
+static int
+serve (const char *path, unsigned int pool_size)
+{
+  struct epoll_event events[16];
+  struct sockaddr_un address;
+  struct stat st;
+  int listen_fd, i, count;
+  size_t j;
+  time_t now;
+
+  serving = 1;
+
+  signal (SIGPIPE, SIG_IGN);
+
+  if (strlen (path) >= sizeof (address.sun_path))
+    errx (EXIT_FAILURE, "Socket path too long: %s", path);
+
+  memset (&address, 0, sizeof (address));
+  address.sun_family = AF_UNIX;
+  strcpy (address.sun_path, path);
+
+  /* Replace the socket of an earlier run, but nothing else */
+  if (0 == lstat (path, &st))
+    {
+      if (!S_ISSOCK (st.st_mode))
+        errx (EXIT_FAILURE, "%s exists and is not a socket", path);
+
+      unlink (path);
+    }
+
+  if (-1 == (listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))
+      || -1 == bind (listen_fd, (struct sockaddr *) &address, sizeof (address))
+      || -1 == listen (listen_fd, 16))
+    err (EXIT_FAILURE, "Failed to listen on %s", path);
+
+  /* New connections in the pool get the time zone by environment */
+  setenv ("PGTZ", "CET", 1);
+
+  pool = SQL_PoolCreate (SQL_DefaultConnection (), pool_size);
+
+  if (-1 == (epoll_fd = epoll_create1 (EPOLL_CLOEXEC)))
+    err (EXIT_FAILURE, "epoll_create1 failed");
+
+  events[0].events = EPOLLIN;
+  events[0].data.ptr = 0;
+
+  if (-1 == epoll_ctl (epoll_fd, EPOLL_CTL_ADD, listen_fd, &events[0]))
+    err (EXIT_FAILURE, "epoll_ctl failed");
+
+  saved_stdout = dup (STDOUT_FILENO);
+  saved_stderr = dup (STDERR_FILENO);
+
+  ARRAY_INIT (&sessions);
+
+  for (;;)
+    {
+      if (-1 == (count = epoll_wait (epoll_fd, events, sizeof (events) / sizeof (events[0]), 1000)))
+        {
+          if (errno == EINTR)
+            continue;
+
+          err (EXIT_FAILURE, "epoll_wait failed");
+        }
+
+      for (i = 0; i < count; ++i)
+        {
+          struct session *session = events[i].data.ptr;
+
+          if (!session)
+            session_accept (listen_fd);
+          else if (-1 == session_read (session))
+            session_close (session);
+        }
+
+      now = time (0);
+
+      for (j = ARRAY_COUNT (&sessions); j-- > 0; )
+        {
+          struct session *session = ARRAY_GET (&sessions, j);
+
+          if (now - session->active >= SESSION_IDLE_SEC)
+            {
+              dprintf (session->fd, "\nSession timed out\n");
+              session_close (session);
+            }
+        }
+    }
+}
+
+/* Returns 1 if running with rights other than the caller's */
+static int
+running_setuid (void)
+{
+  return getuid () != geteuid () || getgid () != getegid ();
+}
+
+/* Connects to the database given, or the default one if NULL, and sets
+ * up the session and the journal.  */
+static void
+open_database (const char *connect_string)
+{
+  setenv ("TZ", "CET", 1);
+
+  SQL_Init (connect_string ? connect_string : CONNECT_STRING);
+
+  SQL_Query ("SET TIME ZONE 'CET'");
+
+  SQL_SetTimeouts (10000, 30000);
+
+  /* Optional hot standby for the read-only commands */
+  if (getenv ("P2K12_REPLICA"))
+    SQL_SetReplica (getenv ("P2K12_REPLICA"), 2000);
+
+#ifdef P2K12_MODE_LIVE
+  SQL_SetSlowQueryLog (250, 0);
+#else
+  SQL_SetSlowQueryLog (250, ".p2k12_slowlog");
+#endif
+
+  /* The journal holds mutations for the real database only */
+  if (!connect_string
+      && -1 != Journal_Open (JOURNAL_PATH)
+      && -1 != Journal_StartReplay (CONNECT_STRING, JOURNAL_REPLAY_SEC))
+    journal_enabled = 1;
+}
+
 int
 main (int argc, char **argv)
 {
+  static const struct option options[] =
+    {
+      { "daemon", required_argument, 0, 'D' },
+      { "pool", required_argument, 0, 'P' },
+      { "user", required_argument, 0, 'u' },
+      { "command", required_argument, 0, 'c' },
+      { "batch", required_argument, 0, 'b' },
+      { "single-transaction", no_argument, 0, '1' },
+      { "repeat", required_argument, 0, 'r' },
+      { "database", required_argument, 0, 'd' },
+      { 0, 0, 0, 0 }
+    };
+  const char *socket_path = 0, *connect_string = 0;
+  const char *script_user = 0, *script_command = 0, *batch_path = 0;
+  int single_transaction = 0;
+  unsigned int pool_size = DEFAULT_POOL_SIZE, repeat = 1;
+  int option;
+
+  while (-1 != (option = getopt_long (argc, argv, "c:", options, 0)))
+    {
+      switch (option)
+        {
+        case 'D':
+
+          socket_path = optarg;
+
+          break;
+
+        case 'P':
+
+          if (0 >= (int) (pool_size = strtol (optarg, 0, 0)))
+            errx (EXIT_FAILURE, "Invalid pool size '%s'", optarg);
+
+          break;
+
+        case 'u':
+
+          script_user = optarg;
+
+          break;
+
+        case 'c':
+
+          script_command = optarg;
+
+          break;
+
+        case 'b':
+
+          batch_path = optarg;
+
+          break;
+
+        case '1':
+
+          single_transaction = 1;
+
+          break;
+
+        case 'r':
+
+          if (0 >= (int) (repeat = strtol (optarg, 0, 0)))
+            errx (EXIT_FAILURE, "Invalid repeat count '%s'", optarg);
+
+          break;
+
+        case 'd':
+
+          connect_string = optarg;
+
+          break;
+
+        default:
+
+          fprintf (stderr,
+                   "Usage: %s [--database CONNECT-STRING] [--daemon SOCKET [--pool N]]\n"
+                   "       %s [--database CONNECT-STRING] --user NAME\n"
+                   "           {-c COMMAND [--repeat N] | --batch FILE} [--single-transaction]\n",
+                   argv[0], argv[0]);
+
+          return EXIT_FAILURE;
+        }
+    }
+
+  if (script_user && !script_command == !batch_path)
+    errx (EXIT_FAILURE, "--user requires exactly one of -c or --batch");
+
+  if (!script_user && (script_command || batch_path || single_transaction))
+    errx (EXIT_FAILURE, "-c, --batch and --single-transaction require --user");
+
+  if (repeat > 1 && !script_command)
+    errx (EXIT_FAILURE, "--repeat requires -c");
+
+  /* Installed setuid root, the daemon would create and replace files
+   * anywhere on behalf of whoever runs it.  */
+  if (socket_path && running_setuid ())
+    errx (EXIT_FAILURE, "--daemon may only be run by root when installed setuid");
+
+  /* Likewise, scripts would be read as root and run as any user, and
+   * libpq would connect wherever it is told with root's files.  */
+  if ((script_user || connect_string) && running_setuid ())
+    errx (EXIT_FAILURE, "--user and --database may only be used by root when installed setuid");
+
+  /* The daemon and scripts; the terminal itself is closed for now */
+  if (socket_path)
+    {
+      open_database (connect_string);
+
+      return serve (socket_path, pool_size);
+    }
+
+  if (script_user)
+    {
+      FILE *batch = 0;
+      int result;
+
+      open_database (connect_string);
+
+      if (batch_path && !(batch = strcmp (batch_path, "-") ? fopen (batch_path, "r") : stdin))
+        err (EXIT_FAILURE, "Failed to open '%s'", batch_path);
+
+      result = run_script (script_user, script_command, repeat, batch, single_transaction);
+
+      if (batch && batch != stdin)
+        fclose (batch);
+
+      return result;
+    }
+
   // TODO(mastensg): authenticate with p2k16
   printf (CLEAR_SCREEN);
   printf ("New membership system!\n");
@@ -1163,22 +2463,7 @@ main (int argc, char **argv)
 #if 0
   uid_t uid;
 
-  (void) argc;
-  (void) argv;
-
-  setenv ("TZ", "CET", 1);
-
-  // The certificate from bomba.bitraf.no needs to exist in
-  // $HOME/.postgresql/root.crt.
-  //
-  // The password should be listed in $HOME/.pgpass.
-#ifdef P2K12_MODE_LIVE
-  SQL_Init ("user=p2k12_pos dbname=p2k12 host=bomba.bitraf.no sslmode=verify-full");
-#else
-  SQL_Init ("user=p2k12_pos dbname=p2k12 host=localhost");
-#endif
-
-  SQL_Query ("SET TIME ZONE 'CET'");
+  open_database (connect_string);
 
   enable_icanon ();
   enable_echo ();
@@ -1197,15 +2482,23 @@ main (int argc, char **argv)
 
       if (NULL != (pw = getpwuid (uid)))
         {
-          if (-1 == SQL_Query ("SELECT id FROM accounts WHERE name = %s", pw->pw_name))
+          struct SQL_Result *account;
+          long long account_id;
+
+          if (!(account = SQL_ExecuteBinary ("SELECT id FROM accounts WHERE name = %s", pw->pw_name)))
             errx (EXIT_FAILURE, "SQL query failed");
 
-          if (SQL_RowCount ())
+          if (SQL_ResultRowCount (account)
+              && -1 != SQL_ResultInt (account, 0, 0, &account_id))
             {
-              log_in (pw->pw_name, atoi (SQL_Value (0, 0)), 0);
+              SQL_ResultFree (account);
+
+              log_in (pw->pw_name, account_id, 0);
 
               return EXIT_SUCCESS;
             }
+
+          SQL_ResultFree (account);
         }
     }
 
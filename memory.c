@@ -0,0 +1,2478 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <err.h>
+
+#include <postgresql/libpq-fe.h>
+
+#include "array.h"
+#include "backend.h"
+
+/* In-process stand-in for the p2k12 database, for testing and for
+ * profiling the client without a server.  It knows the statements p2k12
+ * sends by their format strings, and keeps just the state needed to
+ * answer them: accounts with running balances and stock counts, the
+ * ledger, checkins, memberships and journal keys.
+ *
+ * Transactions and savepoints are undone by truncating every table to
+ * its length when they began, which also hands out the same IDs again,
+ * unlike PostgreSQL sequences.  All connections share one database and
+ * see each other's uncommitted changes; they must be used from a single
+ * thread.  Names are compared byte by byte, and case folding is ASCII
+ * only.  */
+
+#define MAX_COLUMNS 16
+
+struct account
+{
+	char *name, *type;
+
+	/* Debits less credits, in øre and in items */
+	long long amount, stock;
+
+	/* Ledger lines and checkins of the account, oldest first */
+	ARRAY(size_t) lines;
+	ARRAY(size_t) checkins;
+
+	/* Current membership, or -1 */
+	long member;
+};
+
+struct transaction
+{
+	long long date;
+	char *reason;
+
+	/* Lines of the transaction come no earlier than this */
+	size_t first_line;
+};
+
+struct line
+{
+	int transaction, debit, credit;
+	long long amount;
+	int stock;
+};
+
+struct checkin
+{
+	int account;
+	long long date;
+	char *type;
+};
+
+struct member
+{
+	int account;
+	long long date;
+	char *full_name, *email, *flag;
+	int price;
+
+	/* Membership this one replaced, or -1 */
+	long previous;
+};
+
+struct journal_key
+{
+	char *key;
+	int transaction;
+};
+
+/* Table lengths where a transaction or savepoint began */
+struct mark
+{
+	char *savepoint;
+	size_t accounts, transactions, lines, checkins, members, journal_keys;
+};
+
+/* Open addressing hash index from strings to row numbers */
+struct index_slot
+{
+	unsigned int hash;
+
+	/* Row number plus one, or 0 for a free slot */
+	size_t row;
+};
+
+struct index
+{
+	struct index_slot *slots;
+	size_t size, count;
+};
+
+struct memory
+{
+	unsigned int references;
+
+	ARRAY(struct account) accounts;
+	ARRAY(struct transaction) transactions;
+	ARRAY(struct line) lines;
+	ARRAY(struct checkin) checkins;
+	ARRAY(struct member) members;
+	ARRAY(struct journal_key) journal_keys;
+
+	/* Account names are unique regardless of case */
+	struct index account_names, journal_key_index;
+
+	/* The open transaction block and its savepoints, if any */
+	ARRAY(struct mark) marks;
+	int failed;
+
+	long long txid, current_txid;
+
+	/* "p2k12.account", for the session and the transaction */
+	char *account, *local_account;
+};
+
+struct statement
+{
+	const char *format;
+	PGresult *(*run)(struct memory *db, const struct statement *statement, const char *const *argv,
+	                 struct SQL_BackendStatus *status);
+
+	/* Handler specific */
+	const char *data;
+
+	/* The format is only the start of the statement */
+	int prefix;
+
+	/* Transaction control, which manages the block itself */
+	int control;
+};
+
+static struct memory *shared_db;
+
+#define ADD(array, value) \
+	do \
+	{ \
+		ARRAY_ADD(array, value); \
+		if (-1 == ARRAY_RESULT(array)) \
+			errx(EXIT_FAILURE, "ARRAY_ADD failed"); \
+	} \
+	while (0)
+
+static char *
+Strdup(const char *string)
+{
+	char *result;
+
+	if (!string)
+		return 0;
+
+	if (!(result = strdup(string)))
+		errx(EXIT_FAILURE, "strdup failed");
+
+	return result;
+}
+
+static long long
+Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Hash indexes */
+
+static unsigned int
+Hash(const char *key, int fold)
+{
+	unsigned int hash = 2166136261u;
+
+	for (; *key; ++key)
+		hash = (hash ^ (unsigned char) (fold ? tolower((unsigned char) *key) : *key)) * 16777619u;
+
+	return hash;
+}
+
+static void
+IndexAdd(struct index *index, unsigned int hash, size_t row)
+{
+	struct index_slot *slots;
+	size_t size, i, j;
+
+	if ((index->count + 1) * 2 > index->size)
+	{
+		size = index->size ? index->size * 2 : 64;
+
+		if (!(slots = calloc(size, sizeof(*slots))))
+			errx(EXIT_FAILURE, "calloc failed");
+
+		for (i = 0; i < index->size; ++i)
+		{
+			if (!index->slots[i].row)
+				continue;
+
+			for (j = index->slots[i].hash & (size - 1); slots[j].row; j = (j + 1) & (size - 1))
+				;
+
+			slots[j] = index->slots[i];
+		}
+
+		free(index->slots);
+		index->slots = slots;
+		index->size = size;
+	}
+
+	for (j = hash & (index->size - 1); index->slots[j].row; j = (j + 1) & (index->size - 1))
+		;
+
+	index->slots[j].hash = hash;
+	index->slots[j].row = row + 1;
+	++index->count;
+}
+
+/* Returns the next row whose key may match hash, or -1 if there is no
+ * more.  *position must be 0 on the first call.  */
+static long
+IndexNext(const struct index *index, unsigned int hash, size_t *position)
+{
+	const struct index_slot *slot;
+
+	while (*position < index->size)
+	{
+		slot = &index->slots[(hash + (*position)++) & (index->size - 1)];
+
+		if (!slot->row)
+			break;
+
+		if (slot->hash == hash)
+			return slot->row - 1;
+	}
+
+	return -1;
+}
+
+static void
+IndexFree(struct index *index)
+{
+	free(index->slots);
+	memset(index, 0, sizeof(*index));
+}
+
+/* Errors and results */
+
+static int
+Error(struct SQL_BackendStatus *status, const char *sqlstate, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(status->error, sizeof(status->error), fmt, ap);
+	va_end(ap);
+
+	snprintf(status->sqlstate, sizeof(status->sqlstate), "%s", sqlstate);
+
+	return -1;
+}
+
+static int
+NotNull(struct SQL_BackendStatus *status, const char *column)
+{
+	return Error(status, "23502", "null value in column \"%s\" violates not-null constraint", column);
+}
+
+static PGresult *
+Command(struct SQL_BackendStatus *status, const char *fmt, ...)
+{
+	PGresult *res;
+	va_list ap;
+
+	if (!(res = PQmakeEmptyPGresult(0, PGRES_COMMAND_OK)))
+		errx(EXIT_FAILURE, "PQmakeEmptyPGresult failed");
+
+	va_start(ap, fmt);
+	vsnprintf(status->tag, sizeof(status->tag), fmt, ap);
+	va_end(ap);
+
+	return res;
+}
+
+/* An empty result with the given columns, terminated by NULL */
+static PGresult *
+Rows(const char *const *columns)
+{
+	PGresAttDesc attributes[MAX_COLUMNS];
+	PGresult *res;
+	int count;
+
+	memset(attributes, 0, sizeof(attributes));
+
+	for (count = 0; columns[count]; ++count)
+	{
+		assert(count < MAX_COLUMNS);
+
+		attributes[count].name = (char *) columns[count];
+	}
+
+	if (!(res = PQmakeEmptyPGresult(0, PGRES_TUPLES_OK))
+	    || !PQsetResultAttrs(res, count, attributes))
+		errx(EXIT_FAILURE, "PQmakeEmptyPGresult failed");
+
+	return res;
+}
+
+static void
+AddRow(PGresult *res, const char *const *values)
+{
+	int row, i;
+
+	row = PQntuples(res);
+
+	for (i = 0; i < PQnfields(res); ++i)
+	{
+		if (!PQsetvalue(res, row, i, (char *) values[i], values[i] ? (int) strlen(values[i]) : -1))
+			errx(EXIT_FAILURE, "PQsetvalue failed");
+	}
+}
+
+/* Sets the tag of a query result */
+static PGresult *
+Selected(struct SQL_BackendStatus *status, PGresult *res, const char *command)
+{
+	snprintf(status->tag, sizeof(status->tag), "%s %d", command, PQntuples(res));
+
+	return res;
+}
+
+/* A result of one row and column */
+static PGresult *
+Value(struct SQL_BackendStatus *status, const char *column, const char *value)
+{
+	const char *columns[] = { column, 0 };
+	PGresult *res;
+
+	res = Rows(columns);
+	AddRow(res, &value);
+
+	return Selected(status, res, "SELECT");
+}
+
+/* Values */
+
+static int
+ParseInteger(const char *text, int *value, const char *column, struct SQL_BackendStatus *status)
+{
+	char *endptr;
+	long result;
+
+	if (!text)
+		return NotNull(status, column);
+
+	errno = 0;
+	result = strtol(text, &endptr, 10);
+
+	while (isspace((unsigned char) *endptr))
+		++endptr;
+
+	if (endptr == text || *endptr)
+		return Error(status, "22P02", "invalid input syntax for type integer: \"%s\"", text);
+
+	if (errno || result < INT_MIN || result > INT_MAX)
+		return Error(status, "22003", "value \"%s\" is out of range for type integer", text);
+
+	*value = result;
+
+	return 0;
+}
+
+/* Parses NUMERIC(10,2) text into øre, rounding half away from zero */
+static int
+ParseAmount(const char *text, long long *ore, struct SQL_BackendStatus *status)
+{
+	const char *c = text;
+	long long value = 0;
+	int negative = 0, digits = 0, decimals = 0, round = 0;
+
+	if (!text)
+		return NotNull(status, "amount");
+
+	while (isspace((unsigned char) *c))
+		++c;
+
+	if (*c == '-' || *c == '+')
+		negative = (*c++ == '-');
+
+	for (; isdigit((unsigned char) *c); ++c, ++digits)
+	{
+		if (value >= 100000000LL)
+			return Error(status, "22003", "numeric field overflow");
+
+		value = value * 10 + (*c - '0');
+	}
+
+	if (*c == '.')
+	{
+		for (++c; isdigit((unsigned char) *c); ++c, ++digits)
+		{
+			if (decimals < 2)
+				value = value * 10 + (*c - '0');
+			else if (decimals == 2)
+				round = (*c >= '5');
+
+			++decimals;
+		}
+	}
+
+	while (isspace((unsigned char) *c))
+		++c;
+
+	if (!digits || *c)
+		return Error(status, "22P02", "invalid input syntax for type numeric: \"%s\"", text);
+
+	for (; decimals < 2; ++decimals)
+		value *= 10;
+
+	value += round;
+
+	if (value >= 10000000000LL)
+		return Error(status, "22003", "numeric field overflow");
+
+	*ore = negative ? -value : value;
+
+	return 0;
+}
+
+/* numerator / denominator rounded half away from zero, like NUMERIC */
+static long long
+Divide(long long numerator, long long denominator)
+{
+	long long quotient = numerator / denominator, remainder = numerator % denominator;
+
+	if (2 * llabs(remainder) >= llabs(denominator))
+		quotient += ((numerator < 0) != (denominator < 0)) ? -1 : 1;
+
+	return quotient;
+}
+
+/* Sums over no lines are the integer 0, like COALESCE(NULL, 0) */
+static void
+FormatAmount(char *buffer, size_t size, long long ore, int exact)
+{
+	if (!exact)
+		snprintf(buffer, size, "0");
+	else
+		snprintf(buffer, size, "%s%lld.%02lld", ore < 0 ? "-" : "", llabs(ore) / 100, llabs(ore) % 100);
+}
+
+/* As PostgreSQL prints TIMESTAMPTZ in the ISO DateStyle */
+static void
+FormatTimestamp(char *buffer, size_t size, long long usec)
+{
+	struct tm tm;
+	time_t sec;
+	size_t length;
+	long offset;
+
+	sec = usec / 1000000;
+	localtime_r(&sec, &tm);
+
+	length = strftime(buffer, size, "%Y-%m-%d %H:%M:%S", &tm);
+
+	if (usec % 1000000)
+	{
+		length += snprintf(buffer + length, size - length, ".%06lld", usec % 1000000);
+
+		while (buffer[length - 1] == '0')
+			buffer[--length] = 0;
+	}
+
+	offset = tm.tm_gmtoff;
+
+	length += snprintf(buffer + length, size - length, "%c%02ld", offset < 0 ? '-' : '+', labs(offset) / 3600);
+
+	if (labs(offset) % 3600)
+		snprintf(buffer + length, size - length, ":%02ld", labs(offset) % 3600 / 60);
+}
+
+/* Accounts */
+
+static struct account *
+Account(struct memory *db, int id)
+{
+	if (id < 1 || (size_t) id > ARRAY_COUNT(&db->accounts))
+		return 0;
+
+	return &ARRAY_GET(&db->accounts, id - 1);
+}
+
+/* Returns the ID of the account called name, ignoring case if fold is
+ * set, or 0 if there is none.  */
+static int
+FindAccount(struct memory *db, const char *name, int fold)
+{
+	const char *other;
+	size_t position = 0;
+	long row;
+
+	if (!name)
+		return 0;
+
+	while (-1 != (row = IndexNext(&db->account_names, Hash(name, 1), &position)))
+	{
+		other = ARRAY_GET(&db->accounts, row).name;
+
+		if (fold ? !strcasecmp(other, name) : !strcmp(other, name))
+			return row + 1;
+	}
+
+	return 0;
+}
+
+/* Returns the ID of the new account, or 0 on failure */
+static int
+AddAccount(struct memory *db, const char *name, const char *type, struct SQL_BackendStatus *status)
+{
+	struct account account;
+
+	if (!name)
+	{
+		NotNull(status, "name");
+
+		return 0;
+	}
+
+	if (FindAccount(db, name, 1))
+	{
+		Error(status, "23505", "duplicate key value violates unique constraint \"accounts_lower_name\"");
+
+		return 0;
+	}
+
+	memset(&account, 0, sizeof(account));
+	account.name = Strdup(name);
+	account.type = Strdup(type);
+	account.member = -1;
+	ARRAY_INIT(&account.lines);
+	ARRAY_INIT(&account.checkins);
+
+	ADD(&db->accounts, account);
+	IndexAdd(&db->account_names, Hash(name, 1), ARRAY_COUNT(&db->accounts) - 1);
+
+	return ARRAY_COUNT(&db->accounts);
+}
+
+static int
+IsProduct(const struct account *account)
+{
+	return account && !strcmp(account->type, "product");
+}
+
+/* Ledger */
+
+static int
+AddTransaction(struct memory *db, long long date, const char *reason)
+{
+	struct transaction transaction;
+
+	transaction.date = date;
+	transaction.reason = Strdup(reason);
+	transaction.first_line = ARRAY_COUNT(&db->lines);
+
+	ADD(&db->transactions, transaction);
+
+	return ARRAY_COUNT(&db->transactions);
+}
+
+static struct transaction *
+Transaction(struct memory *db, int id)
+{
+	if (id < 1 || (size_t) id > ARRAY_COUNT(&db->transactions))
+		return 0;
+
+	return &ARRAY_GET(&db->transactions, id - 1);
+}
+
+/* Applies or, with sign -1, reverts the effect of the last line on the
+ * balances of its accounts.  */
+static void
+Post(struct memory *db, size_t index, int sign)
+{
+	const struct line *line = &ARRAY_GET(&db->lines, index);
+	struct account *debit, *credit;
+
+	debit = Account(db, line->debit);
+	credit = Account(db, line->credit);
+
+	debit->amount += sign * line->amount;
+	debit->stock += sign * line->stock;
+	credit->amount -= sign * line->amount;
+	credit->stock -= sign * line->stock;
+
+	if (sign > 0)
+	{
+		ADD(&debit->lines, index);
+
+		if (credit != debit)
+			ADD(&credit->lines, index);
+	}
+	else
+	{
+		--ARRAY_COUNT(&debit->lines);
+
+		if (credit != debit)
+			--ARRAY_COUNT(&credit->lines);
+	}
+}
+
+static PGresult *
+InsertLine(struct memory *db, int transaction, int debit, int credit, long long amount, int stock,
+           struct SQL_BackendStatus *status)
+{
+	struct line line;
+
+	if (!Transaction(db, transaction))
+	{
+		Error(status, "23503", "insert or update on table \"transaction_lines\" violates foreign key constraint \"transaction_line_transaction_fkey\"");
+
+		return 0;
+	}
+
+	if (!Account(db, debit) || !Account(db, credit))
+	{
+		Error(status, "23503", "insert or update on table \"transaction_lines\" violates foreign key constraint \"transaction_line_%s_account_fkey\"", Account(db, debit) ? "credit" : "debit");
+
+		return 0;
+	}
+
+	if (amount < 0)
+	{
+		Error(status, "23514", "new row for relation \"transaction_lines\" violates check constraint \"transaction_lines_amount_check\"");
+
+		return 0;
+	}
+
+	line.transaction = transaction;
+	line.debit = debit;
+	line.credit = credit;
+	line.amount = amount;
+	line.stock = stock;
+
+	ADD(&db->lines, line);
+	Post(db, ARRAY_COUNT(&db->lines) - 1, 1);
+
+	return Command(status, "INSERT 0 1");
+}
+
+/* Checkins and memberships */
+
+static PGresult *
+InsertCheckin(struct memory *db, int account, const char *type, long long date, struct SQL_BackendStatus *status)
+{
+	struct checkin checkin;
+
+	if (!Account(db, account))
+	{
+		Error(status, "23503", "insert or update on table \"checkins\" violates foreign key constraint \"checkins_account_fkey\"");
+
+		return 0;
+	}
+
+	if (!type)
+	{
+		NotNull(status, "type");
+
+		return 0;
+	}
+
+	checkin.account = account;
+	checkin.date = date;
+	checkin.type = Strdup(type);
+
+	ADD(&db->checkins, checkin);
+	ADD(&Account(db, account)->checkins, ARRAY_COUNT(&db->checkins) - 1);
+
+	return Command(status, "INSERT 0 1");
+}
+
+static int
+InsertMember(struct memory *db, int account, const char *full_name, const char *email, int price,
+             const char *flag, struct SQL_BackendStatus *status)
+{
+	struct account *owner;
+	struct member member;
+	const char *at;
+
+	if (!(owner = Account(db, account)))
+		return Error(status, "23503", "insert or update on table \"members\" violates foreign key constraint \"members_account_fkey\"");
+
+	if (!full_name || !*full_name)
+		return Error(status, "23514", "new row for relation \"members\" violates check constraint \"members_full_name_check\"");
+
+	if (!email || !(at = strchr(email, '@')) || !strchr(at + 1, '.'))
+		return Error(status, "23514", "new row for relation \"members\" violates check constraint \"members_email_check\"");
+
+	if (price < 0)
+		return Error(status, "23514", "new row for relation \"members\" violates check constraint \"nonnegative_price\"");
+
+	if (flag && strlen(flag) > 10)
+		return Error(status, "22001", "value too long for type character varying(10)");
+
+	member.account = account;
+	member.date = Now();
+	member.full_name = Strdup(full_name);
+	member.email = Strdup(email);
+	member.flag = Strdup(flag);
+	member.price = price;
+	member.previous = owner->member;
+
+	ADD(&db->members, member);
+	owner->member = ARRAY_COUNT(&db->members) - 1;
+
+	return 0;
+}
+
+static const struct member *
+CurrentMember(struct memory *db, int account)
+{
+	const struct account *owner = Account(db, account);
+
+	if (!owner || owner->member == -1)
+		return 0;
+
+	return &ARRAY_GET(&db->members, owner->member);
+}
+
+/* Journal keys */
+
+static int
+FindJournalKey(struct memory *db, const char *key)
+{
+	size_t position = 0;
+	long row;
+
+	while (-1 != (row = IndexNext(&db->journal_key_index, Hash(key, 0), &position)))
+	{
+		if (!strcmp(ARRAY_GET(&db->journal_keys, row).key, key))
+			return 1;
+	}
+
+	return 0;
+}
+
+static PGresult *
+InsertJournalKey(struct memory *db, const char *key, int transaction, struct SQL_BackendStatus *status)
+{
+	struct journal_key entry;
+
+	if (!key)
+	{
+		NotNull(status, "key");
+
+		return 0;
+	}
+
+	if (FindJournalKey(db, key))
+	{
+		Error(status, "23505", "duplicate key value violates unique constraint \"journal_keys_pkey\"");
+
+		return 0;
+	}
+
+	if (transaction && !Transaction(db, transaction))
+	{
+		Error(status, "23503", "insert or update on table \"journal_keys\" violates foreign key constraint \"journal_keys_transaction_fkey\"");
+
+		return 0;
+	}
+
+	entry.key = Strdup(key);
+	entry.transaction = transaction;
+
+	ADD(&db->journal_keys, entry);
+	IndexAdd(&db->journal_key_index, Hash(key, 0), ARRAY_COUNT(&db->journal_keys) - 1);
+
+	return Command(status, "INSERT 0 1");
+}
+
+/* Transactions */
+
+static void
+Mark(struct memory *db, struct mark *mark, const char *savepoint)
+{
+	mark->savepoint = Strdup(savepoint);
+	mark->accounts = ARRAY_COUNT(&db->accounts);
+	mark->transactions = ARRAY_COUNT(&db->transactions);
+	mark->lines = ARRAY_COUNT(&db->lines);
+	mark->checkins = ARRAY_COUNT(&db->checkins);
+	mark->members = ARRAY_COUNT(&db->members);
+	mark->journal_keys = ARRAY_COUNT(&db->journal_keys);
+}
+
+/* Removes every row added since mark was taken */
+static void
+Undo(struct memory *db, const struct mark *mark)
+{
+	struct account *account;
+	struct checkin *checkin;
+	struct member *member;
+	size_t i;
+
+	while (ARRAY_COUNT(&db->lines) > mark->lines)
+		Post(db, --ARRAY_COUNT(&db->lines), -1);
+
+	while (ARRAY_COUNT(&db->checkins) > mark->checkins)
+	{
+		checkin = &ARRAY_GET(&db->checkins, --ARRAY_COUNT(&db->checkins));
+
+		--ARRAY_COUNT(&Account(db, checkin->account)->checkins);
+		free(checkin->type);
+	}
+
+	while (ARRAY_COUNT(&db->members) > mark->members)
+	{
+		member = &ARRAY_GET(&db->members, --ARRAY_COUNT(&db->members));
+
+		Account(db, member->account)->member = member->previous;
+		free(member->full_name);
+		free(member->email);
+		free(member->flag);
+	}
+
+	if (ARRAY_COUNT(&db->journal_keys) > mark->journal_keys)
+	{
+		while (ARRAY_COUNT(&db->journal_keys) > mark->journal_keys)
+			free(ARRAY_GET(&db->journal_keys, --ARRAY_COUNT(&db->journal_keys)).key);
+
+		IndexFree(&db->journal_key_index);
+
+		for (i = 0; i < ARRAY_COUNT(&db->journal_keys); ++i)
+			IndexAdd(&db->journal_key_index, Hash(ARRAY_GET(&db->journal_keys, i).key, 0), i);
+	}
+
+	while (ARRAY_COUNT(&db->transactions) > mark->transactions)
+		free(ARRAY_GET(&db->transactions, --ARRAY_COUNT(&db->transactions)).reason);
+
+	if (ARRAY_COUNT(&db->accounts) > mark->accounts)
+	{
+		while (ARRAY_COUNT(&db->accounts) > mark->accounts)
+		{
+			account = &ARRAY_GET(&db->accounts, --ARRAY_COUNT(&db->accounts));
+
+			free(account->name);
+			free(account->type);
+			ARRAY_FREE(&account->lines);
+			ARRAY_FREE(&account->checkins);
+		}
+
+		IndexFree(&db->account_names);
+
+		for (i = 0; i < ARRAY_COUNT(&db->accounts); ++i)
+			IndexAdd(&db->account_names, Hash(ARRAY_GET(&db->accounts, i).name, 1), i);
+	}
+}
+
+/* Drops the marks from index on */
+static void
+PopMarks(struct memory *db, size_t index)
+{
+	while (ARRAY_COUNT(&db->marks) > index)
+		free(ARRAY_GET(&db->marks, --ARRAY_COUNT(&db->marks)).savepoint);
+}
+
+static void
+EndTransaction(struct memory *db)
+{
+	PopMarks(db, 0);
+
+	db->failed = 0;
+	db->current_txid = 0;
+
+	free(db->local_account);
+	db->local_account = 0;
+}
+
+/* Finds the latest savepoint called name */
+static long
+FindSavepoint(struct memory *db, const char *name, struct SQL_BackendStatus *status)
+{
+	size_t i;
+
+	for (i = ARRAY_COUNT(&db->marks); i-- > 1; )
+	{
+		if (!strcasecmp(ARRAY_GET(&db->marks, i).savepoint, name))
+			return i;
+	}
+
+	return Error(status, "3B001", "savepoint \"%s\" does not exist", name);
+}
+
+/* Transaction control statements */
+
+static PGresult *
+Begin(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	struct mark mark;
+
+	(void) statement;
+	(void) argv;
+
+	/* PostgreSQL only warns about this */
+	if (!ARRAY_COUNT(&db->marks))
+	{
+		Mark(db, &mark, 0);
+		ADD(&db->marks, mark);
+	}
+
+	return Command(status, "BEGIN");
+}
+
+static PGresult *
+Commit(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	int failed = db->failed;
+
+	(void) statement;
+	(void) argv;
+
+	if (failed)
+		Undo(db, &ARRAY_GET(&db->marks, 0));
+
+	EndTransaction(db);
+
+	/* COMMIT of a failed transaction reports ROLLBACK */
+	return Command(status, failed ? "ROLLBACK" : "COMMIT");
+}
+
+static PGresult *
+Rollback(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	(void) statement;
+	(void) argv;
+
+	if (ARRAY_COUNT(&db->marks))
+		Undo(db, &ARRAY_GET(&db->marks, 0));
+
+	EndTransaction(db);
+
+	return Command(status, "ROLLBACK");
+}
+
+static PGresult *
+Savepoint(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	struct mark mark;
+
+	(void) argv;
+
+	if (!ARRAY_COUNT(&db->marks))
+	{
+		Error(status, "25P01", "SAVEPOINT can only be used in transaction blocks");
+
+		return 0;
+	}
+
+	if (db->failed)
+	{
+		Error(status, "25P02", "current transaction is aborted, commands ignored until end of transaction block");
+
+		return 0;
+	}
+
+	Mark(db, &mark, statement->format);
+	ADD(&db->marks, mark);
+
+	return Command(status, "SAVEPOINT");
+}
+
+static PGresult *
+Release(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	long index;
+
+	(void) argv;
+
+	if (!ARRAY_COUNT(&db->marks))
+	{
+		Error(status, "25P01", "RELEASE SAVEPOINT can only be used in transaction blocks");
+
+		return 0;
+	}
+
+	if (db->failed)
+	{
+		Error(status, "25P02", "current transaction is aborted, commands ignored until end of transaction block");
+
+		return 0;
+	}
+
+	if (-1 == (index = FindSavepoint(db, statement->format, status)))
+		return 0;
+
+	PopMarks(db, index);
+
+	return Command(status, "RELEASE");
+}
+
+static PGresult *
+RollbackTo(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	long index;
+
+	(void) argv;
+
+	if (!ARRAY_COUNT(&db->marks))
+	{
+		Error(status, "25P01", "ROLLBACK TO SAVEPOINT can only be used in transaction blocks");
+
+		return 0;
+	}
+
+	if (-1 == (index = FindSavepoint(db, statement->format, status)))
+		return 0;
+
+	/* The savepoint itself remains */
+	Undo(db, &ARRAY_GET(&db->marks, index));
+	PopMarks(db, index + 1);
+	db->failed = 0;
+
+	return Command(status, "ROLLBACK");
+}
+
+/* Session */
+
+static PGresult *
+SetAccount(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	char **setting;
+
+	/* A local setting outside a transaction block lasts one statement */
+	if (statement->data)
+		setting = &db->local_account;
+	else
+		setting = &db->account;
+
+	free(*setting);
+	*setting = Strdup(argv[0]);
+
+	return Value(status, "set_config", argv[0]);
+}
+
+static PGresult *
+ResetAccount(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	(void) statement;
+	(void) argv;
+
+	free(db->account);
+	db->account = 0;
+
+	return Command(status, "SET");
+}
+
+static PGresult *
+Set(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	(void) db;
+	(void) statement;
+	(void) argv;
+
+	return Command(status, "SET");
+}
+
+static PGresult *
+TxidCurrent(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	char txid[32];
+
+	(void) statement;
+	(void) argv;
+
+	if (!db->current_txid)
+		db->current_txid = ++db->txid;
+
+	snprintf(txid, sizeof(txid), "%lld", db->current_txid);
+
+	return Value(status, "txid_current", txid);
+}
+
+/* Accounts and balances */
+
+static PGresult *
+FindAccountByName(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	static const char *const both[] = { "id", "name", 0 };
+	static const char *const id_only[] = { "id", 0 };
+	const char *values[2];
+	char id_text[16];
+	PGresult *res;
+	int id;
+
+	res = Rows(statement->data ? both : id_only);
+
+	if ((id = FindAccount(db, argv[0], statement->data != 0)))
+	{
+		snprintf(id_text, sizeof(id_text), "%d", id);
+
+		values[0] = id_text;
+		values[1] = Account(db, id)->name;
+
+		AddRow(res, values);
+	}
+
+	return Selected(status, res, "SELECT");
+}
+
+static PGresult *
+InsertProduct(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	static const char *const columns[] = { "id", 0 };
+	const char *value;
+	char id_text[16];
+	PGresult *res;
+	int id;
+
+	(void) statement;
+
+	if (!(id = AddAccount(db, argv[0], "product", status)))
+		return 0;
+
+	snprintf(id_text, sizeof(id_text), "%d", id);
+	value = id_text;
+
+	res = Rows(columns);
+	AddRow(res, &value);
+
+	return Selected(status, res, "INSERT 0");
+}
+
+static PGresult *
+Status(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	static const char *const columns[] = { "?column?", "price", "flag", 0 };
+	const struct account *account;
+	const struct member *member;
+	const char *values[3];
+	char balance[32], price[16];
+	PGresult *res;
+	int id;
+
+	(void) statement;
+
+	if (-1 == ParseInteger(argv[0], &id, "id", status))
+		return 0;
+
+	res = Rows(columns);
+
+	if ((account = Account(db, id)) && !strcmp(account->type, "user"))
+	{
+		FormatAmount(balance, sizeof(balance), -account->amount, ARRAY_COUNT(&account->lines) > 0);
+
+		values[0] = balance;
+		values[1] = values[2] = 0;
+
+		if ((member = CurrentMember(db, id)))
+		{
+			snprintf(price, sizeof(price), "%d", member->price);
+
+			values[1] = price;
+			values[2] = member->flag;
+		}
+
+		AddRow(res, values);
+	}
+
+	return Selected(status, res, "SELECT");
+}
+
+/* Products */
+
+/* Adds a row of product_inventory.  The unit price, NULL for products out
+ * of stock, goes in column price_column unless that is -1.  */
+static void
+AddProductRow(struct memory *db, PGresult *res, const struct account *account, int price_column)
+{
+	char id_text[16], stock[32], amount[32], price[32];
+	const char *values[5];
+
+	snprintf(id_text, sizeof(id_text), "%d", (int) (account - &ARRAY_GET(&db->accounts, 0)) + 1);
+	snprintf(stock, sizeof(stock), "%lld", account->stock);
+	FormatAmount(amount, sizeof(amount), account->amount, ARRAY_COUNT(&account->lines) > 0);
+
+	values[0] = id_text;
+	values[1] = account->name;
+	values[2] = stock;
+	values[3] = amount;
+	values[4] = 0;
+
+	if (price_column != -1)
+	{
+		values[price_column] = 0;
+
+		if (account->stock)
+		{
+			FormatAmount(price, sizeof(price), Divide(account->amount, account->stock), 1);
+			values[price_column] = price;
+		}
+	}
+
+	AddRow(res, values);
+}
+
+static int
+CompareNames(const void *lhs, const void *rhs)
+{
+	const struct account *const *a = lhs, *const *b = rhs;
+
+	return strcmp((*a)->name, (*b)->name);
+}
+
+static PGresult *
+ListProducts(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	static const char *const columns[] = { "product", "name", "stock", "amount", "unit_price", 0 };
+	ARRAY(const struct account *) products;
+	const struct account *account;
+	PGresult *res;
+	size_t i;
+
+	(void) statement;
+	(void) argv;
+
+	ARRAY_INIT(&products);
+
+	for (i = 0; i < ARRAY_COUNT(&db->accounts); ++i)
+	{
+		account = &ARRAY_GET(&db->accounts, i);
+
+		if (IsProduct(account) && account->stock > 0)
+			ADD(&products, account);
+	}
+
+	if (ARRAY_COUNT(&products))
+		qsort(ARRAY_DATA(&products), ARRAY_COUNT(&products), sizeof(account), CompareNames);
+
+	res = Rows(columns);
+
+	for (i = 0; i < ARRAY_COUNT(&products); ++i)
+		AddProductRow(db, res, ARRAY_GET(&products, i), 4);
+
+	ARRAY_FREE(&products);
+
+	return Selected(status, res, "SELECT");
+}
+
+/* word_similarity() at or above which "word <% name" holds, as
+ * pg_trgm.word_similarity_threshold by default.  */
+#define WORD_SIMILARITY_THRESHOLD 0.6
+
+#define TRIGRAM_MAX 256
+
+struct product_match
+{
+	const struct account *account;
+	double score;
+};
+
+static int
+IsWordChar(char ch)
+{
+	return isalnum((unsigned char) ch) || (unsigned char) ch >= 0x80;
+}
+
+/* Character pos of word padded the way pg_trgm pads words: lowercased,
+ * with two blanks in front and one behind.  */
+static char
+PaddedChar(const char *word, size_t length, size_t pos)
+{
+	return (pos < 2 || pos - 2 >= length) ? ' ' : tolower((unsigned char) word[pos - 2]);
+}
+
+/* Sets trigrams to the distinct trigrams of the padded words in
+ * text[0..length).  Returns their number, at most TRIGRAM_MAX.  */
+static size_t
+Trigrams(char (*trigrams)[3], const char *text, size_t length)
+{
+	size_t count = 0, start, end, pos, i;
+	char trigram[3];
+
+	for (start = 0; start < length; start = end)
+	{
+		while (start < length && !IsWordChar(text[start]))
+			++start;
+
+		for (end = start; end < length && IsWordChar(text[end]); ++end)
+			;
+
+		for (pos = 0; end > start && pos <= end - start; ++pos)
+		{
+			trigram[0] = PaddedChar(text + start, end - start, pos);
+			trigram[1] = PaddedChar(text + start, end - start, pos + 1);
+			trigram[2] = PaddedChar(text + start, end - start, pos + 2);
+
+			for (i = 0; i < count && memcmp(trigrams[i], trigram, 3); ++i)
+				;
+
+			if (i == count && count < TRIGRAM_MAX)
+				memcpy(trigrams[count++], trigram, 3);
+		}
+	}
+
+	return count;
+}
+
+/* The share of the trigrams of word found in the best matching word of
+ * name, approximating pg_trgm's word_similarity(word, name).  */
+static double
+WordSimilarity(const char *word, const char *name)
+{
+	char word_trigrams[TRIGRAM_MAX][3], name_trigrams[TRIGRAM_MAX][3];
+	size_t word_count, name_count, shared, start, end, i, j;
+	double best = 0;
+
+	if (!(word_count = Trigrams(word_trigrams, word, strlen(word))))
+		return 0;
+
+	for (start = 0; name[start]; start = end)
+	{
+		while (name[start] && !IsWordChar(name[start]))
+			++start;
+
+		for (end = start; name[end] && IsWordChar(name[end]); ++end)
+			;
+
+		name_count = Trigrams(name_trigrams, name + start, end - start);
+
+		for (i = 0, shared = 0; i < word_count; ++i)
+		{
+			for (j = 0; j < name_count && memcmp(word_trigrams[i], name_trigrams[j], 3); ++j)
+				;
+
+			shared += (j < name_count);
+		}
+
+		if ((double) shared / word_count > best)
+			best = (double) shared / word_count;
+	}
+
+	return best;
+}
+
+/* By score descending, then ID */
+static int
+CompareMatches(const void *lhs, const void *rhs)
+{
+	const struct product_match *a = lhs, *b = rhs;
+
+	if (a->score != b->score)
+		return (a->score > b->score) ? -1 : 1;
+
+	return (a->account > b->account) - (a->account < b->account);
+}
+
+/* p2k12_search_products(pattern, NULLIF(max_rows, 0)): products matching any
+ * whitespace separated word of pattern, as a substring (score 1) or with
+ * a word similarity of at least WORD_SIMILARITY_THRESHOLD, by total
+ * score.  All products by ID without words.  The server also breaks ties
+ * by similarity to the whole pattern.  */
+static PGresult *
+SearchProducts(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	static const char *const columns[] = { "product", "name", "stock", "amount", 0 };
+	ARRAY(struct product_match) matches;
+	ARRAY(const char *) words;
+	struct product_match match;
+	const struct account *account;
+	char *pattern, *word, *saveptr;
+	int max_rows = INT_MAX;
+	double similarity;
+	PGresult *res;
+	size_t i, j;
+
+	(void) statement;
+
+	if (-1 == ParseInteger(argv[1], &max_rows, "max_rows", status))
+		return 0;
+
+	/* NULLIF(max_rows, 0) */
+	if (!max_rows)
+		max_rows = INT_MAX;
+
+	if (!(pattern = strdup(argv[0] ? argv[0] : "")))
+		err(EXIT_FAILURE, "strdup failed");
+
+	ARRAY_INIT(&matches);
+	ARRAY_INIT(&words);
+
+	for (word = strtok_r(pattern, " \t\n\r\f\v", &saveptr); word; word = strtok_r(0, " \t\n\r\f\v", &saveptr))
+	{
+		for (i = 0; i < ARRAY_COUNT(&words) && strcasecmp(ARRAY_GET(&words, i), word); ++i)
+			;
+
+		if (i == ARRAY_COUNT(&words))
+			ADD(&words, word);
+	}
+
+	for (i = 0; i < ARRAY_COUNT(&db->accounts); ++i)
+	{
+		account = &ARRAY_GET(&db->accounts, i);
+
+		if (!IsProduct(account))
+			continue;
+
+		match.account = account;
+		match.score = ARRAY_COUNT(&words) ? 0 : 1;
+
+		for (j = 0; j < ARRAY_COUNT(&words); ++j)
+		{
+			word = (char *) ARRAY_GET(&words, j);
+
+			if (strcasestr(account->name, word))
+				match.score += 1;
+			else if ((similarity = WordSimilarity(word, account->name)) >= WORD_SIMILARITY_THRESHOLD)
+				match.score += similarity;
+		}
+
+		if (match.score > 0)
+			ADD(&matches, match);
+	}
+
+	if (ARRAY_COUNT(&matches))
+		qsort(ARRAY_DATA(&matches), ARRAY_COUNT(&matches), sizeof(match), CompareMatches);
+
+	res = Rows(columns);
+
+	for (i = 0; i < ARRAY_COUNT(&matches) && (int) i < max_rows; ++i)
+		AddProductRow(db, res, ARRAY_GET(&matches, i).account, -1);
+
+	ARRAY_FREE(&words);
+	ARRAY_FREE(&matches);
+	free(pattern);
+
+	return Selected(status, res, "SELECT");
+}
+
+/* One product by ID, with the unit price in place of the amount if
+ * statement->data is set.  */
+static PGresult *
+FindProduct(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	static const char *const stock_columns[] = { "product", "name", "stock", "amount", 0 };
+	static const char *const price_columns[] = { "product", "name", "stock", "unit_price", 0 };
+	const struct account *account;
+	PGresult *res;
+	int id;
+
+	if (-1 == ParseInteger(argv[0], &id, "product", status))
+		return 0;
+
+	res = Rows(statement->data ? price_columns : stock_columns);
+
+	if (IsProduct(account = Account(db, id)))
+		AddProductRow(db, res, account, statement->data ? 3 : -1);
+
+	return Selected(status, res, "SELECT");
+}
+
+/* Ledger functions */
+
+/* Fails a ledger function with the message it raises */
+static PGresult *
+Raise(struct SQL_BackendStatus *status, const char *message)
+{
+	Error(status, "P0001", "%s", message);
+
+	return 0;
+}
+
+/* The row every ledger function returns: the new transaction, the balance
+ * of the account as p2k12 shows it, and the unit price of the product, if
+ * any, NULL while out of stock.  */
+static PGresult *
+LedgerResult(struct memory *db, int transaction, int account, int product, struct SQL_BackendStatus *status)
+{
+	static const char *const columns[] = { "transaction", "balance", "unit_price", 0 };
+	const struct account *owner = Account(db, account), *item = Account(db, product);
+	char id_text[16], balance[32], price[32];
+	const char *values[3];
+	PGresult *res;
+
+	snprintf(id_text, sizeof(id_text), "%d", transaction);
+	FormatAmount(balance, sizeof(balance), owner ? -owner->amount : 0, owner && ARRAY_COUNT(&owner->lines) > 0);
+
+	values[0] = id_text;
+	values[1] = balance;
+	values[2] = 0;
+
+	if (IsProduct(item) && item->stock)
+	{
+		FormatAmount(price, sizeof(price), Divide(item->amount, item->stock), 1);
+		values[2] = price;
+	}
+
+	res = Rows(columns);
+	AddRow(res, values);
+
+	return Selected(status, res, "SELECT");
+}
+
+/* Adds a line and, unless key is NULL, the journal key of its transaction */
+static int
+InsertJournaledLine(struct memory *db, int transaction, int debit, int credit, long long amount, int stock,
+                    const char *key, struct SQL_BackendStatus *status)
+{
+	PGresult *res;
+
+	if (!(res = InsertLine(db, transaction, debit, credit, amount, stock, status)))
+		return -1;
+
+	PQclear(res);
+
+	if (key)
+	{
+		if (!(res = InsertJournalKey(db, key, transaction, status)))
+			return -1;
+
+		PQclear(res);
+	}
+
+	return 0;
+}
+
+/* Transaction date of a replayed mutation, given in seconds */
+static int
+ReplayDate(const char *text, long long *date, struct SQL_BackendStatus *status)
+{
+	if (!text)
+		return NotNull(status, "date");
+
+	*date = strtoll(text, 0, 10) * 1000000;
+
+	return 0;
+}
+
+/* p2k12_buy: (account, product, count, key), and amount and date when
+ * replayed */
+static PGresult *
+Buy(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	const struct account *item;
+	int account, product, count, transaction;
+	long long amount, date = Now();
+
+	if (-1 == ParseInteger(argv[0], &account, "account_id", status)
+	    || -1 == ParseInteger(argv[1], &product, "product_id", status)
+	    || -1 == ParseInteger(argv[2], &count, "count", status))
+		return 0;
+
+	if (count <= 0)
+		return Raise(status, "p2k12_invalid_count");
+
+	if (!IsProduct(item = Account(db, product)))
+		return Raise(status, "p2k12_unknown_product");
+
+	if (statement->data && -1 == ReplayDate(argv[5], &date, status))
+		return 0;
+
+	if (statement->data && argv[4])
+	{
+		if (-1 == ParseAmount(argv[4], &amount, status))
+			return 0;
+	}
+	else
+	{
+		if (!item->stock)
+			return Raise(status, "p2k12_out_of_stock");
+
+		amount = Divide(count * item->amount, item->stock);
+	}
+
+	transaction = AddTransaction(db, date, "buy");
+
+	if (-1 == InsertJournaledLine(db, transaction, account, product, amount, count, argv[3], status))
+		return 0;
+
+	return LedgerResult(db, transaction, account, product, status);
+}
+
+/* p2k12_transfer: (account, counterpart, amount, reason, key), and date
+ * when replayed */
+static PGresult *
+Transfer(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	int account, other, transaction, give;
+	long long amount, date = Now();
+
+	if (-1 == ParseInteger(argv[0], &account, "account_id", status)
+	    || -1 == ParseAmount(argv[2], &amount, status))
+		return 0;
+
+	if (!argv[3] || (strcmp(argv[3], "give") && strcmp(argv[3], "take")))
+		return Raise(status, "p2k12_invalid_reason");
+
+	if (!argv[1] || !(other = FindAccount(db, argv[1], 0)))
+		return Raise(status, "p2k12_unknown_account");
+
+	if (amount < 0)
+		return Raise(status, "p2k12_invalid_amount");
+
+	if (statement->data && -1 == ReplayDate(argv[5], &date, status))
+		return 0;
+
+	give = !strcmp(argv[3], "give");
+	transaction = AddTransaction(db, date, argv[3]);
+
+	if (-1 == InsertJournaledLine(db, transaction, give ? account : other, give ? other : account, amount, 0, argv[4], status))
+		return 0;
+
+	return LedgerResult(db, transaction, account, 0, status);
+}
+
+/* p2k12_add_stock: (account, product, amount, count) */
+static PGresult *
+AddStock(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	int account, product, count, transaction;
+	long long amount;
+
+	(void) statement;
+
+	if (-1 == ParseInteger(argv[0], &account, "account_id", status)
+	    || -1 == ParseInteger(argv[1], &product, "product_id", status)
+	    || -1 == ParseAmount(argv[2], &amount, status)
+	    || -1 == ParseInteger(argv[3], &count, "count", status))
+		return 0;
+
+	if (!IsProduct(Account(db, product)))
+		return Raise(status, "p2k12_unknown_product");
+
+	if (amount <= 0)
+		return Raise(status, "p2k12_invalid_amount");
+
+	if (count <= 0)
+		return Raise(status, "p2k12_invalid_count");
+
+	transaction = AddTransaction(db, Now(), "add stock");
+
+	if (-1 == InsertJournaledLine(db, transaction, product, account, amount, count, 0, status))
+		return 0;
+
+	return LedgerResult(db, transaction, account, product, status);
+}
+
+/* p2k12_return_deposit: (account, amount) */
+static PGresult *
+ReturnDeposit(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	int account, deposit, transaction;
+	long long amount;
+
+	(void) statement;
+
+	if (-1 == ParseInteger(argv[0], &account, "account_id", status)
+	    || -1 == ParseAmount(argv[1], &amount, status))
+		return 0;
+
+	if (amount <= 0)
+		return Raise(status, "p2k12_invalid_amount");
+
+	if (!(deposit = FindAccount(db, "deposit", 0)))
+	{
+		NotNull(status, "credit_account");
+
+		return 0;
+	}
+
+	transaction = AddTransaction(db, Now(), "return deposit");
+
+	if (-1 == InsertJournaledLine(db, transaction, account, deposit, amount, 1, 0, status))
+		return 0;
+
+	return LedgerResult(db, transaction, account, 0, status);
+}
+
+/* p2k12_undo: (account, transaction), reversing the lines of the
+ * transaction with debit and credit swapped */
+static PGresult *
+UndoTransaction(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	const struct transaction *original;
+	struct line line;
+	char reason[32];
+	int account, id, transaction;
+	size_t i, first, end;
+
+	(void) statement;
+
+	if (-1 == ParseInteger(argv[0], &account, "account_id", status)
+	    || -1 == ParseInteger(argv[1], &id, "transaction_id", status))
+		return 0;
+
+	if (!(original = Transaction(db, id)))
+		return Raise(status, "p2k12_unknown_transaction");
+
+	first = original->first_line;
+	end = ARRAY_COUNT(&db->lines);
+
+	snprintf(reason, sizeof(reason), "undo %d", id);
+	transaction = AddTransaction(db, Now(), reason);
+
+	for (i = first; i < end; ++i)
+	{
+		line = ARRAY_GET(&db->lines, i);
+
+		if (line.transaction != id)
+			continue;
+
+		if (-1 == InsertJournaledLine(db, transaction, line.credit, line.debit, line.amount, line.stock, 0, status))
+			return 0;
+	}
+
+	return LedgerResult(db, transaction, account, 0, status);
+}
+
+/* Checkins */
+
+static PGresult *
+InsertCheckinNow(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	int account;
+
+	(void) statement;
+
+	if (-1 == ParseInteger(argv[0], &account, "account", status))
+		return 0;
+
+	return InsertCheckin(db, account, argv[1], Now(), status);
+}
+
+static PGresult *
+InsertDatedCheckin(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	int account;
+
+	(void) statement;
+
+	if (-1 == ParseInteger(argv[0], &account, "account", status))
+		return 0;
+
+	if (!argv[2])
+	{
+		NotNull(status, "date");
+
+		return 0;
+	}
+
+	return InsertCheckin(db, account, argv[1], strtoll(argv[2], 0, 10) * 1000000, status);
+}
+
+static PGresult *
+ListCheckins(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	static const char *const columns[] = { "date", "type", 0 };
+	const struct account *account;
+	const struct checkin *checkin;
+	const char *values[2];
+	char date[48];
+	PGresult *res;
+	int id;
+	size_t i;
+
+	(void) statement;
+
+	if (-1 == ParseInteger(argv[0], &id, "account", status))
+		return 0;
+
+	res = Rows(columns);
+
+	for (i = 0; (account = Account(db, id)) && i < ARRAY_COUNT(&account->checkins); ++i)
+	{
+		checkin = &ARRAY_GET(&db->checkins, ARRAY_GET(&account->checkins, i));
+
+		FormatTimestamp(date, sizeof(date), checkin->date);
+
+		values[0] = date;
+		values[1] = checkin->type;
+
+		AddRow(res, values);
+	}
+
+	return Selected(status, res, "SELECT");
+}
+
+/* Journal keys */
+
+static PGresult *
+InsertKey(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	(void) statement;
+
+	return InsertJournalKey(db, argv[0], 0, status);
+}
+
+static PGresult *
+FindKey(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	static const char *const columns[] = { "?column?", 0 };
+	static const char *const one[] = { "1" };
+	PGresult *res;
+
+	(void) statement;
+
+	res = Rows(columns);
+
+	if (argv[0] && FindJournalKey(db, argv[0]))
+		AddRow(res, one);
+
+	return Selected(status, res, "SELECT");
+}
+
+/* Memberships */
+
+static PGresult *
+BecomeMember(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	const struct member *member;
+	int account, price;
+
+	(void) statement;
+
+	if (-1 == ParseInteger(argv[0], &account, "account_id", status)
+	    || -1 == ParseInteger(argv[1], &price, "price", status))
+		return 0;
+
+	/* Only an existing membership changes */
+	if ((member = CurrentMember(db, account))
+	    && -1 == InsertMember(db, account, member->full_name, member->email, price, member->flag, status))
+		return 0;
+
+	return Value(status, "p2k12_become_member", "");
+}
+
+static PGresult *
+BecomeOfficeUser(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	const struct member *member;
+	int account;
+
+	(void) statement;
+
+	if (-1 == ParseInteger(argv[0], &account, "account_id", status))
+		return 0;
+
+	if ((member = CurrentMember(db, account))
+	    && -1 == InsertMember(db, account, member->full_name, member->email, member->price, "m_office", status))
+		return 0;
+
+	return Value(status, "p2k12_become_office_user", "");
+}
+
+static PGresult *
+CreateMember(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	char id_text[16];
+	int account;
+
+	(void) statement;
+
+	if (FindAccount(db, argv[0], 0))
+	{
+		Error(status, "P0001", "p2k12_username_exists");
+
+		return 0;
+	}
+
+	if (!(account = AddAccount(db, argv[0], "user", status))
+	    || -1 == InsertMember(db, account, argv[1], argv[2], 0, 0, status))
+		return 0;
+
+	PQclear(InsertCheckin(db, account, "checkin", Now(), status));
+
+	snprintf(id_text, sizeof(id_text), "%d", account);
+
+	return Value(status, "p2k12_create_member", id_text);
+}
+
+/* History */
+
+struct history_line
+{
+	long long date;
+	int transaction;
+	size_t line;
+};
+
+/* By (date, transaction), and lines in order */
+static int
+CompareHistory(const void *lhs, const void *rhs)
+{
+	const struct history_line *a = lhs, *b = rhs;
+
+	if (a->date != b->date)
+		return (a->date < b->date) ? -1 : 1;
+
+	if (a->transaction != b->transaction)
+		return (a->transaction < b->transaction) ? -1 : 1;
+
+	return (a->line < b->line) ? -1 : (a->line > b->line);
+}
+
+/* Lower bound of LASTLOG_SINCE in main.c */
+static long long
+Since(const char *variant)
+{
+	struct tm tm;
+	time_t now;
+
+	if (!variant)
+		return LLONG_MIN;
+
+	if (!strcmp(variant, "day"))
+		return Now() - 86400 * 1000000LL;
+
+	if (!strcmp(variant, "week"))
+		return Now() - 7 * 86400 * 1000000LL;
+
+	if (!strcmp(variant, "year"))
+	{
+		now = time(0);
+		localtime_r(&now, &tm);
+
+		tm.tm_mon = 0;
+		tm.tm_mday = 1;
+		tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+
+		return mktime(&tm) * 1000000LL;
+	}
+
+	return LLONG_MIN;
+}
+
+static void
+AddHistoryRow(struct memory *db, PGresult *res, size_t index)
+{
+	const struct line *line = &ARRAY_GET(&db->lines, index);
+	char transaction[16], debit[16], credit[16], amount[32], stock[16], date[48];
+	const char *values[9];
+
+	snprintf(transaction, sizeof(transaction), "%d", line->transaction);
+	snprintf(debit, sizeof(debit), "%d", line->debit);
+	snprintf(credit, sizeof(credit), "%d", line->credit);
+	FormatAmount(amount, sizeof(amount), line->amount, 1);
+	snprintf(stock, sizeof(stock), "%d", line->stock);
+	FormatTimestamp(date, sizeof(date), Transaction(db, line->transaction)->date);
+
+	values[0] = transaction;
+	values[1] = debit;
+	values[2] = credit;
+	values[3] = amount;
+	values[4] = "NOK";
+	values[5] = stock;
+	values[6] = Account(db, line->debit)->name;
+	values[7] = Account(db, line->credit)->name;
+	values[8] = date;
+
+	AddRow(res, values);
+}
+
+/* The ORDER BY of a page of p2k12_account_history, as opposed to all of it */
+#define HISTORY_PAGE_ORDER " ORDER BY date DESC, transaction DESC"
+
+/* p2k12_account_history of an account since the start of a period, by
+ * (date, transaction).  A page, as told by its ORDER BY, has only the
+ * lines of the last limit transactions before a given one, newest first.  */
+static PGresult *
+History(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	static const char *const columns[] =
+	{
+		"transaction", "debit_account", "credit_account", "amount", "currency", "stock",
+		"debit_account_name", "credit_account_name", "date", 0
+	};
+	ARRAY(struct history_line) lines;
+	struct history_line item;
+	const struct account *account;
+	const struct transaction *before = 0;
+	size_t i, first, end, length;
+	int id, before_id = 0, limit = INT_MAX, transactions = 0, page;
+	long long since;
+	PGresult *res;
+
+	length = strlen(statement->format);
+	page = length >= strlen(HISTORY_PAGE_ORDER)
+	       && !strcmp(statement->format + length - strlen(HISTORY_PAGE_ORDER), HISTORY_PAGE_ORDER);
+
+	if (-1 == ParseInteger(argv[0], &id, "account_id", status))
+		return 0;
+
+	since = Since(argv[1]);
+
+	if (page)
+	{
+		if ((argv[2] && -1 == ParseInteger(argv[2], &before_id, "before_transaction", status))
+		    || -1 == ParseInteger(argv[3], &limit, "max_transactions", status))
+			return 0;
+
+		/* Nothing comes before a transaction that does not exist */
+		if (argv[2] && !(before = Transaction(db, before_id)))
+			id = 0;
+	}
+
+	ARRAY_INIT(&lines);
+
+	for (i = 0; (account = Account(db, id)) && i < ARRAY_COUNT(&account->lines); ++i)
+	{
+		item.line = ARRAY_GET(&account->lines, i);
+		item.transaction = ARRAY_GET(&db->lines, item.line).transaction;
+		item.date = Transaction(db, item.transaction)->date;
+
+		if (item.date <= since)
+			continue;
+
+		if (before && (item.date > before->date || (item.date == before->date && item.transaction >= before_id)))
+			continue;
+
+		ADD(&lines, item);
+	}
+
+	if (ARRAY_COUNT(&lines))
+		qsort(ARRAY_DATA(&lines), ARRAY_COUNT(&lines), sizeof(item), CompareHistory);
+
+	res = Rows(columns);
+
+	if (!page)
+	{
+		for (i = 0; i < ARRAY_COUNT(&lines); ++i)
+			AddHistoryRow(db, res, ARRAY_GET(&lines, i).line);
+	}
+	else
+	{
+		/* Newest transactions first, each with its lines in order */
+		for (end = ARRAY_COUNT(&lines); end > 0 && transactions++ < limit; end = first)
+		{
+			for (first = end - 1; first > 0 && ARRAY_GET(&lines, first - 1).transaction == ARRAY_GET(&lines, end - 1).transaction; --first)
+				;
+
+			for (i = first; i < end; ++i)
+				AddHistoryRow(db, res, ARRAY_GET(&lines, i).line);
+		}
+	}
+
+	ARRAY_FREE(&lines);
+
+	return Selected(status, res, "SELECT");
+}
+
+/* Sales */
+
+#define HOUR_USEC (3600 * 1000000LL)
+
+struct sales_total
+{
+	int id;
+	long long units, amount;
+};
+
+/* As p2k12_sale_sign(): 1 for a sale, -1 for one taken back */
+static int
+SaleSign(const char *reason, const struct account *debit, const struct account *credit)
+{
+	if (reason && !strncmp(reason, "undo ", 5))
+		return (!strcmp(debit->type, "product") && !strcmp(credit->type, "user")) ? -1 : 0;
+
+	return (!strcmp(debit->type, "user") && !strcmp(credit->type, "product")) ? 1 : 0;
+}
+
+/* Parses a date, with an optional time of day, in local time */
+static int
+ParseTimestamp(const char *text, long long *usec, struct SQL_BackendStatus *status)
+{
+	struct tm tm;
+	const char *end;
+
+	memset(&tm, 0, sizeof(tm));
+
+	if ((!(end = strptime(text, "%Y-%m-%d %H:%M:%S", &tm))
+	     && !(end = strptime(text, "%Y-%m-%d %H:%M", &tm))
+	     && !(end = strptime(text, "%Y-%m-%d", &tm)))
+	    || *end)
+		return Error(status, "22007", "invalid input syntax for type timestamp with time zone: \"%s\"", text);
+
+	tm.tm_isdst = -1;
+	*usec = mktime(&tm) * 1000000LL;
+
+	return 0;
+}
+
+/* Rounds down to a whole hour, leaving the infinities alone */
+static long long
+TruncateHour(long long usec)
+{
+	if (usec == LLONG_MIN || usec == LLONG_MAX)
+		return usec;
+
+	return usec - ((usec % HOUR_USEC) + HOUR_USEC) % HOUR_USEC;
+}
+
+/* By amount descending, then ID */
+static int
+CompareSales(const void *lhs, const void *rhs)
+{
+	const struct sales_total *a = lhs, *b = rhs;
+
+	if (a->amount != b->amount)
+		return (a->amount > b->amount) ? -1 : 1;
+
+	return (a->id > b->id) - (a->id < b->id);
+}
+
+/* p2k12_product_sales(since, variant, until, max_rows), where the variant
+ * stands in for since when that is NULL.  Computed from the ledger, there
+ * being no rollups here.  */
+static PGresult *
+Sales(struct memory *db, const struct statement *statement, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	static const char *const columns[] = { "product", "name", "units", "amount", 0 };
+	const struct transaction *transaction;
+	const struct account *debit, *credit;
+	const struct line *line;
+	struct sales_total *totals;
+	const char *values[4];
+	char id_text[16], units[32], amount[32];
+	long long since, until = LLONG_MAX;
+	int max_rows, sign, id;
+	size_t i, count = 0;
+	PGresult *res;
+
+	(void) statement;
+
+	if (argv[0])
+	{
+		if (-1 == ParseTimestamp(argv[0], &since, status))
+			return 0;
+	}
+	else
+		since = Since(argv[1]);
+
+	if ((argv[2] && -1 == ParseTimestamp(argv[2], &until, status))
+	    || -1 == ParseInteger(argv[3], &max_rows, "max_rows", status))
+		return 0;
+
+	since = TruncateHour(since);
+	until = TruncateHour(until);
+
+	if (!(totals = calloc(ARRAY_COUNT(&db->accounts) + 1, sizeof(*totals))))
+		err(EXIT_FAILURE, "calloc failed");
+
+	for (i = 0; i < ARRAY_COUNT(&db->lines); ++i)
+	{
+		line = &ARRAY_GET(&db->lines, i);
+		transaction = Transaction(db, line->transaction);
+
+		if (transaction->date < since || transaction->date >= until)
+			continue;
+
+		debit = Account(db, line->debit);
+		credit = Account(db, line->credit);
+
+		if (!(sign = SaleSign(transaction->reason, debit, credit)))
+			continue;
+
+		id = (sign > 0) ? line->credit : line->debit;
+
+		totals[id].id = id;
+		totals[id].units += sign * line->stock;
+		totals[id].amount += sign * line->amount;
+	}
+
+	for (i = 1; i <= ARRAY_COUNT(&db->accounts); ++i)
+	{
+		if (totals[i].units || totals[i].amount)
+			totals[count++] = totals[i];
+	}
+
+	qsort(totals, count, sizeof(*totals), CompareSales);
+
+	res = Rows(columns);
+
+	for (i = 0; i < count && (int) i < max_rows; ++i)
+	{
+		snprintf(id_text, sizeof(id_text), "%d", totals[i].id);
+		snprintf(units, sizeof(units), "%lld", totals[i].units);
+		FormatAmount(amount, sizeof(amount), totals[i].amount, 1);
+
+		values[0] = id_text;
+		values[1] = Account(db, totals[i].id)->name;
+		values[2] = units;
+		values[3] = amount;
+
+		AddRow(res, values);
+	}
+
+	free(totals);
+
+	return Selected(status, res, "SELECT");
+}
+
+/* The statements p2k12 sends, by format */
+static const struct statement statements[] =
+{
+	/* Transaction control and session */
+	{ "BEGIN", Begin, 0, 0, 1 },
+	{ "BEGIN ISOLATION LEVEL ", Begin, 0, 1, 1 },
+	{ "COMMIT", Commit, 0, 0, 1 },
+	{ "ROLLBACK", Rollback, 0, 0, 1 },
+	{ "SAVEPOINT ", Savepoint, 0, 1, 1 },
+	{ "RELEASE SAVEPOINT ", Release, 0, 1, 1 },
+	{ "ROLLBACK TO SAVEPOINT ", RollbackTo, 0, 1, 1 },
+	{ "SELECT set_config('p2k12.account', %s, false)", SetAccount, 0, 0, 0 },
+	{ "SELECT set_config('p2k12.account', %s, true)", SetAccount, "local", 0, 0 },
+	{ "SET \"p2k12.account\" TO DEFAULT", ResetAccount, 0, 0, 0 },
+	{ "SET TIME ZONE 'CET'", Set, 0, 0, 0 },
+	{ "SELECT txid_current()", TxidCurrent, 0, 0, 0 },
+
+	/* Accounts and products */
+	{ "SELECT id, name FROM accounts WHERE LOWER(name) = LOWER(%s)", FindAccountByName, "fold", 0, 0 },
+	{ "SELECT id FROM accounts WHERE name = %s", FindAccountByName, 0, 0, 0 },
+	{ "INSERT INTO accounts (name, type) VALUES (%s, 'product') RETURNING id", InsertProduct, 0, 0, 0 },
+	{ "SELECT -ub.balance, cm.price, cm.flag FROM user_balances ub LEFT JOIN current_membership cm ON cm.account = ub.id WHERE ub.id = %d",
+	  Status, 0, 0, 0 },
+	{ "SELECT product, name, stock, amount, unit_price FROM product_inventory WHERE stock > 0 ORDER BY name", ListProducts, 0, 0, 0 },
+	{ "SELECT * FROM p2k12_search_products(%s, NULLIF(%d, 0))", SearchProducts, 0, 0, 0 },
+	{ "SELECT product, name, stock, amount FROM product_inventory WHERE product = %s::INTEGER", FindProduct, 0, 0, 0 },
+	{ "SELECT product, name, stock, unit_price FROM product_inventory WHERE product = %s::INTEGER", FindProduct, "price", 0, 0 },
+
+	/* Ledger, online and as replayed from the journal */
+	{ "SELECT * FROM p2k12_buy(%d, %s::INTEGER, %d, %s)", Buy, 0, 0, 0 },
+	{ "SELECT * FROM p2k12_buy(%d, %s::INTEGER, %d, %s, %s::NUMERIC, TO_TIMESTAMP(%l::DOUBLE PRECISION))", Buy, "replay", 0, 0 },
+	{ "SELECT * FROM p2k12_transfer(%d, %s, %s::NUMERIC, %s, %s)", Transfer, 0, 0, 0 },
+	{ "SELECT * FROM p2k12_transfer(%d, %s, %s::NUMERIC, %s, %s, TO_TIMESTAMP(%l::DOUBLE PRECISION))", Transfer, "replay", 0, 0 },
+	{ "SELECT * FROM p2k12_add_stock(%d, %s::INTEGER, %s::NUMERIC, %s::INTEGER)", AddStock, 0, 0, 0 },
+	{ "SELECT * FROM p2k12_return_deposit(%d, %s::NUMERIC)", ReturnDeposit, 0, 0, 0 },
+	{ "SELECT * FROM p2k12_undo(%d, %s::INTEGER)", UndoTransaction, 0, 0, 0 },
+
+	/* The rest of the string is LASTLOG_SINCE, paging and ORDER BY */
+	{ "SELECT * FROM p2k12_account_history(%d, ", History, 0, 1, 0 },
+
+	/* The rest of the string is LASTLOG_SINCE and the other arguments */
+	{ "SELECT * FROM p2k12_product_sales(", Sales, 0, 1, 0 },
+
+	/* Checkins and journal keys */
+	{ "INSERT INTO checkins (account, type) VALUES (%d, %s)", InsertCheckinNow, 0, 0, 0 },
+	{ "INSERT INTO checkins (account, type, date) VALUES (%d, %s, TO_TIMESTAMP(%l::DOUBLE PRECISION))", InsertDatedCheckin, 0, 0, 0 },
+	{ "SELECT date, type FROM checkins WHERE account=%d", ListCheckins, 0, 0, 0 },
+	{ "INSERT INTO journal_keys (key) VALUES (%s)", InsertKey, 0, 0, 0 },
+	{ "SELECT 1 FROM journal_keys WHERE key = %s", FindKey, 0, 0, 0 },
+
+	/* Memberships */
+	{ "SELECT p2k12_become_member(%d, %s)", BecomeMember, 0, 0, 0 },
+	{ "SELECT p2k12_become_office_user(%d)", BecomeOfficeUser, 0, 0, 0 },
+	{ "SELECT p2k12_create_member (%s, %s, %s)", CreateMember, 0, 0, 0 }
+};
+
+#define STATEMENT_COUNT (sizeof(statements) / sizeof(statements[0]))
+
+static const struct statement *
+FindStatement(const char *format)
+{
+	static struct index index;
+	const struct statement *statement;
+	size_t position = 0, i;
+	long row;
+
+	if (!index.size)
+	{
+		for (i = 0; i < STATEMENT_COUNT; ++i)
+		{
+			if (!statements[i].prefix)
+				IndexAdd(&index, Hash(statements[i].format, 0), i);
+		}
+	}
+
+	while (-1 != (row = IndexNext(&index, Hash(format, 0), &position)))
+	{
+		if (!strcmp(statements[row].format, format))
+			return &statements[row];
+	}
+
+	for (i = 0; i < STATEMENT_COUNT; ++i)
+	{
+		statement = &statements[i];
+
+		if (statement->prefix && !strncmp(format, statement->format, strlen(statement->format)))
+			return statement;
+	}
+
+	return 0;
+}
+
+static PGresult *
+MemoryExecute(void *handle, const char *format, const char *const *argv, struct SQL_BackendStatus *status)
+{
+	struct memory *db = handle;
+	const struct statement *found;
+	struct statement statement;
+	struct mark mark;
+	PGresult *res;
+
+	if (!(found = FindStatement(format)))
+	{
+		Error(status, "0A000", "statement not supported by the memory backend: %.60s", format);
+
+		if (ARRAY_COUNT(&db->marks))
+			db->failed = 1;
+
+		return 0;
+	}
+
+	/* Handlers of prefixes get the rest of the statement as format */
+	statement = *found;
+
+	if (statement.prefix)
+		statement.format = format + strlen(found->format);
+
+	if (!statement.control)
+	{
+		if (db->failed)
+		{
+			Error(status, "25P02", "current transaction is aborted, commands ignored until end of transaction block");
+
+			return 0;
+		}
+
+		Mark(db, &mark, 0);
+	}
+
+	res = statement.run(db, &statement, argv, status);
+
+	if (!res)
+	{
+		/* A failed statement leaves nothing behind */
+		if (!statement.control)
+			Undo(db, &mark);
+
+		if (ARRAY_COUNT(&db->marks))
+			db->failed = 1;
+	}
+	else if (!statement.control && !ARRAY_COUNT(&db->marks))
+		EndTransaction(db);
+
+	return res;
+}
+
+static PGTransactionStatusType
+MemoryTransactionStatus(void *handle)
+{
+	struct memory *db = handle;
+
+	if (!ARRAY_COUNT(&db->marks))
+		return PQTRANS_IDLE;
+
+	return db->failed ? PQTRANS_INERROR : PQTRANS_INTRANS;
+}
+
+/* The accounts of the baseline data, two users of whom one is a member,
+ * and a few products in stock.  */
+static void
+Seed(struct memory *db)
+{
+	static const struct
+	{
+		const char *name;
+		int stock;
+		long long amount;
+	} products[] =
+	{
+		{ "Club-Mate", 20, 50000 },
+		{ "Cola", 24, 36000 },
+		{ "Potetgull", 10, 25000 }
+	};
+	struct SQL_BackendStatus status;
+	int deficit, product, transaction, alice;
+	size_t i;
+
+	deficit = AddAccount(db, "deficit", "p2k12", &status);
+	AddAccount(db, "deposit", "p2k12", &status);
+	AddAccount(db, "donations", "p2k12", &status);
+
+	alice = AddAccount(db, "alice", "user", &status);
+	InsertMember(db, alice, "Alice", "alice@example.com", 500, 0, &status);
+	AddAccount(db, "bob", "user", &status);
+
+	for (i = 0; i < sizeof(products) / sizeof(products[0]); ++i)
+	{
+		product = AddAccount(db, products[i].name, "product", &status);
+		transaction = AddTransaction(db, Now(), "add stock");
+
+		PQclear(InsertLine(db, transaction, product, deficit, products[i].amount, products[i].stock, &status));
+	}
+}
+
+static void *
+MemoryOpen(const char *connect_string)
+{
+	(void) connect_string;
+
+	if (!shared_db)
+	{
+		if (!(shared_db = calloc(1, sizeof(*shared_db))))
+			errx(EXIT_FAILURE, "calloc failed");
+
+		ARRAY_INIT(&shared_db->accounts);
+		ARRAY_INIT(&shared_db->transactions);
+		ARRAY_INIT(&shared_db->lines);
+		ARRAY_INIT(&shared_db->checkins);
+		ARRAY_INIT(&shared_db->members);
+		ARRAY_INIT(&shared_db->journal_keys);
+		ARRAY_INIT(&shared_db->marks);
+
+		Seed(shared_db);
+	}
+
+	++shared_db->references;
+
+	return shared_db;
+}
+
+static void
+MemoryClose(void *handle)
+{
+	struct memory *db = handle;
+	struct mark empty;
+
+	if (--db->references)
+		return;
+
+	EndTransaction(db);
+
+	memset(&empty, 0, sizeof(empty));
+	Undo(db, &empty);
+
+	ARRAY_FREE(&db->accounts);
+	ARRAY_FREE(&db->transactions);
+	ARRAY_FREE(&db->lines);
+	ARRAY_FREE(&db->checkins);
+	ARRAY_FREE(&db->members);
+	ARRAY_FREE(&db->journal_keys);
+	ARRAY_FREE(&db->marks);
+	IndexFree(&db->account_names);
+	IndexFree(&db->journal_key_index);
+
+	free(db->account);
+	free(db);
+
+	shared_db = 0;
+}
+
+const struct SQL_Backend SQL_MemoryBackend =
+{
+	"memory:",
+	MemoryOpen,
+	MemoryClose,
+	MemoryExecute,
+	MemoryTransactionStatus
+};
@@ -0,0 +1,9 @@
+-- Keys of ledger mutations made by the terminals, so that entries from the
+-- offline journal are applied at most once.
+CREATE TABLE journal_keys(
+    key         TEXT        PRIMARY KEY,
+    date        TIMESTAMPTZ NOT NULL DEFAULT now(),
+    transaction INT         REFERENCES transactions
+);
+
+GRANT SELECT, INSERT ON journal_keys to p2k12_pos;
@@ -0,0 +1,45 @@
+CREATE OR REPLACE VIEW user_balances AS
+ SELECT a.id,
+    a.name,
+    (COALESCE(d.amount, (0)::numeric) - COALESCE(c.amount, (0)::numeric)) AS balance
+   FROM ((accounts a
+     LEFT JOIN ( SELECT transaction_lines.debit_account AS account,
+            sum(transaction_lines.amount) AS amount,
+            transaction_lines.currency
+           FROM transaction_lines
+          GROUP BY transaction_lines.debit_account, transaction_lines.currency) d ON ((d.account = a.id)))
+     LEFT JOIN ( SELECT transaction_lines.credit_account AS account,
+            sum(transaction_lines.amount) AS amount,
+            transaction_lines.currency
+           FROM transaction_lines
+          GROUP BY transaction_lines.credit_account, transaction_lines.currency) c ON ((c.account = a.id)));
+
+CREATE OR REPLACE VIEW all_balances AS
+ SELECT a.id,
+    a.type,
+    a.name,
+    (COALESCE(d.amount, (0)::numeric) - COALESCE(c.amount, (0)::numeric)) AS balance,
+    (COALESCE(d.stock, (0)::bigint) - COALESCE(c.stock, (0)::bigint)) AS stock
+   FROM ((accounts a
+     LEFT JOIN ( SELECT transaction_lines.debit_account AS account,
+            sum(transaction_lines.amount) AS amount,
+            transaction_lines.currency,
+            sum(transaction_lines.stock) AS stock
+           FROM transaction_lines
+          GROUP BY transaction_lines.debit_account, transaction_lines.currency) d ON ((d.account = a.id)))
+     LEFT JOIN ( SELECT transaction_lines.credit_account AS account,
+            sum(transaction_lines.amount) AS amount,
+            transaction_lines.currency,
+            sum(transaction_lines.stock) AS stock
+           FROM transaction_lines
+          GROUP BY transaction_lines.credit_account, transaction_lines.currency) c ON ((c.account = a.id)))
+  ORDER BY a.type, lower(a.name);
+
+DROP FUNCTION IF EXISTS p2k12_check_account_balances();
+DROP FUNCTION IF EXISTS p2k12_rebuild_account_balances();
+DROP VIEW IF EXISTS ledger_balances;
+DROP TRIGGER IF EXISTS account_balances_truncate ON transaction_lines;
+DROP TRIGGER IF EXISTS account_balances_row ON transaction_lines;
+DROP FUNCTION IF EXISTS p2k12_account_balances_trigger();
+DROP FUNCTION IF EXISTS p2k12_post_line(INT, INT, NUMERIC, BIGINT);
+DROP TABLE IF EXISTS account_balances;
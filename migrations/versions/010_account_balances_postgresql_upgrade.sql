@@ -0,0 +1,140 @@
+-- Balance and stock of every account with ledger lines, kept current by
+-- triggers on transaction_lines so that balance lookups do not aggregate
+-- the whole ledger.  Accounts without lines have no row.
+CREATE TABLE account_balances(
+    account INT     PRIMARY KEY REFERENCES accounts,
+    balance NUMERIC NOT NULL DEFAULT 0,
+    stock   BIGINT  NOT NULL DEFAULT 0
+);
+
+GRANT SELECT ON account_balances TO p2k12_pos;
+
+-- Adds amount and stock to the debit account and subtracts them from the
+-- credit account.  Rows are locked in account order, so that concurrent
+-- transfers in opposite directions cannot deadlock.
+CREATE OR REPLACE FUNCTION p2k12_post_line(
+    debit_id INT,
+    credit_id INT,
+    line_amount NUMERIC,
+    line_stock BIGINT
+    ) RETURNS VOID AS $$
+DECLARE
+  account_id INT;
+BEGIN
+  -- A line from an account to itself changes nothing
+  IF debit_id = credit_id
+  THEN
+    RETURN;
+  END IF;
+
+  FOREACH account_id IN ARRAY ARRAY[LEAST(debit_id, credit_id), GREATEST(debit_id, credit_id)]
+  LOOP
+    INSERT INTO account_balances AS ab (account, balance, stock)
+    VALUES (account_id,
+            CASE WHEN account_id = debit_id THEN line_amount ELSE -line_amount END,
+            CASE WHEN account_id = debit_id THEN line_stock ELSE -line_stock END)
+    ON CONFLICT (account) DO UPDATE
+    SET balance = ab.balance + EXCLUDED.balance,
+        stock = ab.stock + EXCLUDED.stock;
+  END LOOP;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+CREATE OR REPLACE FUNCTION p2k12_account_balances_trigger() RETURNS TRIGGER AS $$
+BEGIN
+  IF TG_OP = 'TRUNCATE'
+  THEN
+    DELETE FROM account_balances;
+
+    RETURN NULL;
+  END IF;
+
+  IF TG_OP IN ('UPDATE', 'DELETE')
+  THEN
+    PERFORM p2k12_post_line(OLD.credit_account, OLD.debit_account, OLD.amount, OLD.stock);
+  END IF;
+
+  IF TG_OP IN ('INSERT', 'UPDATE')
+  THEN
+    PERFORM p2k12_post_line(NEW.debit_account, NEW.credit_account, NEW.amount, NEW.stock);
+  END IF;
+
+  RETURN NULL;
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+CREATE TRIGGER account_balances_row
+AFTER INSERT OR UPDATE OR DELETE ON transaction_lines
+FOR EACH ROW EXECUTE PROCEDURE p2k12_account_balances_trigger();
+
+CREATE TRIGGER account_balances_truncate
+AFTER TRUNCATE ON transaction_lines
+FOR EACH STATEMENT EXECUTE PROCEDURE p2k12_account_balances_trigger();
+
+-- The balances computed from scratch, as the views used to
+CREATE OR REPLACE VIEW ledger_balances AS
+  SELECT account, SUM(balance) AS balance, SUM(stock) AS stock
+  FROM (SELECT debit_account AS account, amount AS balance, stock::BIGINT AS stock
+        FROM transaction_lines
+        UNION ALL
+        SELECT credit_account, -amount, -stock::BIGINT
+        FROM transaction_lines) lines
+  GROUP BY account;
+
+-- Recomputes account_balances from the ledger, e.g. after loading data
+-- with triggers disabled.  Returns the number of accounts with lines.
+CREATE OR REPLACE FUNCTION p2k12_rebuild_account_balances() RETURNS INT AS $$
+DECLARE
+  account_count INT;
+BEGIN
+  -- Keep new lines out until the table is consistent again
+  LOCK TABLE transaction_lines IN SHARE MODE;
+
+  DELETE FROM account_balances;
+
+  INSERT INTO account_balances (account, balance, stock)
+  SELECT account, balance, stock FROM ledger_balances;
+
+  GET DIAGNOSTICS account_count = ROW_COUNT;
+
+  RETURN account_count;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+-- Accounts whose stored balance or stock differs from the ledger.  No rows
+-- means account_balances is consistent.
+CREATE OR REPLACE FUNCTION p2k12_check_account_balances()
+RETURNS TABLE(account INT, balance NUMERIC, ledger_balance NUMERIC, stock BIGINT, ledger_stock BIGINT) AS $$
+  SELECT COALESCE(ab.account, lb.account),
+         COALESCE(ab.balance, 0), COALESCE(lb.balance, 0),
+         COALESCE(ab.stock, 0), COALESCE(lb.stock, 0)::BIGINT
+  FROM account_balances ab
+  FULL JOIN ledger_balances lb ON lb.account = ab.account
+  WHERE COALESCE(ab.balance, 0) <> COALESCE(lb.balance, 0)
+     OR COALESCE(ab.stock, 0) <> COALESCE(lb.stock, 0);
+$$
+LANGUAGE 'sql'
+STABLE;
+
+SELECT p2k12_rebuild_account_balances();
+
+CREATE OR REPLACE VIEW all_balances AS
+  SELECT a.id,
+         a.type,
+         a.name,
+         COALESCE(ab.balance, 0) AS balance,
+         COALESCE(ab.stock, 0) AS stock
+  FROM accounts a
+  LEFT JOIN account_balances ab ON ab.account = a.id
+  ORDER BY a.type, LOWER(a.name);
+
+CREATE OR REPLACE VIEW user_balances AS
+  SELECT a.id,
+         a.name,
+         COALESCE(ab.balance, 0) AS balance
+  FROM accounts a
+  LEFT JOIN account_balances ab ON ab.account = a.id;
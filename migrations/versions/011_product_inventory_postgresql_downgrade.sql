@@ -0,0 +1,29 @@
+CREATE OR REPLACE VIEW product_stock AS
+ SELECT a.id,
+    a.name,
+    (COALESCE((d.stock)::numeric, (0)::numeric) - COALESCE((c.stock)::numeric, (0)::numeric)) AS stock,
+    (COALESCE(d.amount, (0)::numeric) - COALESCE(c.amount, (0)::numeric)) AS amount
+   FROM ((accounts a
+     LEFT JOIN ( SELECT transaction_lines.debit_account AS account,
+            sum(transaction_lines.stock) AS stock,
+            sum(transaction_lines.amount) AS amount,
+            transaction_lines.currency
+           FROM transaction_lines
+          GROUP BY transaction_lines.debit_account, transaction_lines.currency) d ON ((d.account = a.id)))
+     LEFT JOIN ( SELECT transaction_lines.credit_account AS account,
+            sum(transaction_lines.stock) AS stock,
+            sum(transaction_lines.amount) AS amount
+           FROM transaction_lines
+          GROUP BY transaction_lines.credit_account, transaction_lines.currency) c ON ((c.account = a.id)))
+  WHERE (a.type = 'product'::text);
+
+DROP FUNCTION IF EXISTS p2k12_check_product_inventory();
+DROP FUNCTION IF EXISTS p2k12_rebuild_product_inventory();
+DROP TRIGGER IF EXISTS product_inventory_truncate ON transaction_lines;
+DROP TRIGGER IF EXISTS product_inventory_row ON transaction_lines;
+DROP TRIGGER IF EXISTS product_inventory_account ON accounts;
+DROP TABLE IF EXISTS product_inventory;
+DROP FUNCTION IF EXISTS p2k12_product_unit_price_trigger();
+DROP FUNCTION IF EXISTS p2k12_product_inventory_trigger();
+DROP FUNCTION IF EXISTS p2k12_product_inventory_account_trigger();
+DROP FUNCTION IF EXISTS p2k12_post_product_line(INT, INT, NUMERIC, BIGINT);
@@ -0,0 +1,160 @@
+-- Stock, total value and unit price of every product, kept current by
+-- triggers on accounts and transaction_lines so that listing and pricing
+-- products do not aggregate the whole ledger.  unit_price is NULL while
+-- stock is zero.
+CREATE TABLE product_inventory(
+    product    INT           PRIMARY KEY REFERENCES accounts,
+    name       TEXT          NOT NULL,
+    stock      BIGINT        NOT NULL DEFAULT 0,
+    amount     NUMERIC       NOT NULL DEFAULT 0,
+    unit_price NUMERIC(10,2)
+);
+
+-- The products in stock, by name, as listed by "ls"
+CREATE INDEX product_inventory_in_stock ON product_inventory (name) WHERE stock > 0;
+
+GRANT SELECT ON product_inventory TO p2k12_pos;
+
+CREATE OR REPLACE FUNCTION p2k12_product_inventory_account_trigger() RETURNS TRIGGER AS $$
+BEGIN
+  IF NEW.type = 'product'
+  THEN
+    INSERT INTO product_inventory (product, name)
+    VALUES (NEW.id, NEW.name)
+    ON CONFLICT (product) DO UPDATE
+    SET name = EXCLUDED.name;
+  ELSIF TG_OP = 'UPDATE' AND OLD.type = 'product'
+  THEN
+    DELETE FROM product_inventory WHERE product = NEW.id;
+  END IF;
+
+  RETURN NULL;
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+CREATE TRIGGER product_inventory_account
+AFTER INSERT OR UPDATE OF name, type ON accounts
+FOR EACH ROW EXECUTE PROCEDURE p2k12_product_inventory_account_trigger();
+
+-- Moves stock and value into the debit account and out of the credit
+-- account, where those are products.  Rows are locked in account order,
+-- as in p2k12_post_line.
+CREATE OR REPLACE FUNCTION p2k12_post_product_line(
+    debit_id INT,
+    credit_id INT,
+    line_amount NUMERIC,
+    line_stock BIGINT
+    ) RETURNS VOID AS $$
+DECLARE
+  product_id INT;
+BEGIN
+  IF debit_id = credit_id
+  THEN
+    RETURN;
+  END IF;
+
+  FOREACH product_id IN ARRAY ARRAY[LEAST(debit_id, credit_id), GREATEST(debit_id, credit_id)]
+  LOOP
+    UPDATE product_inventory
+    SET stock = stock + CASE WHEN product_id = debit_id THEN line_stock ELSE -line_stock END,
+        amount = amount + CASE WHEN product_id = debit_id THEN line_amount ELSE -line_amount END
+    WHERE product = product_id;
+  END LOOP;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+CREATE OR REPLACE FUNCTION p2k12_product_inventory_trigger() RETURNS TRIGGER AS $$
+BEGIN
+  IF TG_OP = 'TRUNCATE'
+  THEN
+    UPDATE product_inventory SET stock = 0, amount = 0;
+
+    RETURN NULL;
+  END IF;
+
+  IF TG_OP IN ('UPDATE', 'DELETE')
+  THEN
+    PERFORM p2k12_post_product_line(OLD.credit_account, OLD.debit_account, OLD.amount, OLD.stock);
+  END IF;
+
+  IF TG_OP IN ('INSERT', 'UPDATE')
+  THEN
+    PERFORM p2k12_post_product_line(NEW.debit_account, NEW.credit_account, NEW.amount, NEW.stock);
+  END IF;
+
+  RETURN NULL;
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+CREATE TRIGGER product_inventory_row
+AFTER INSERT OR UPDATE OR DELETE ON transaction_lines
+FOR EACH ROW EXECUTE PROCEDURE p2k12_product_inventory_trigger();
+
+CREATE TRIGGER product_inventory_truncate
+AFTER TRUNCATE ON transaction_lines
+FOR EACH STATEMENT EXECUTE PROCEDURE p2k12_product_inventory_trigger();
+
+-- The unit price follows every change of stock or value
+CREATE OR REPLACE FUNCTION p2k12_product_unit_price_trigger() RETURNS TRIGGER AS $$
+BEGIN
+  NEW.unit_price = NEW.amount / NULLIF(NEW.stock, 0);
+
+  RETURN NEW;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+CREATE TRIGGER product_inventory_unit_price
+BEFORE INSERT OR UPDATE ON product_inventory
+FOR EACH ROW EXECUTE PROCEDURE p2k12_product_unit_price_trigger();
+
+-- Recomputes product_inventory from accounts and the ledger.  Returns the
+-- number of products.
+CREATE OR REPLACE FUNCTION p2k12_rebuild_product_inventory() RETURNS INT AS $$
+DECLARE
+  product_count INT;
+BEGIN
+  LOCK TABLE transaction_lines IN SHARE MODE;
+
+  DELETE FROM product_inventory;
+
+  INSERT INTO product_inventory (product, name, stock, amount)
+  SELECT a.id, a.name, COALESCE(lb.stock, 0), COALESCE(lb.balance, 0)
+  FROM accounts a
+  LEFT JOIN ledger_balances lb ON lb.account = a.id
+  WHERE a.type = 'product';
+
+  GET DIAGNOSTICS product_count = ROW_COUNT;
+
+  RETURN product_count;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+-- Products whose stored stock or value differs from the ledger
+CREATE OR REPLACE FUNCTION p2k12_check_product_inventory()
+RETURNS TABLE(product INT, stock BIGINT, ledger_stock BIGINT, amount NUMERIC, ledger_amount NUMERIC) AS $$
+  SELECT pi.product,
+         pi.stock, COALESCE(lb.stock, 0)::BIGINT,
+         pi.amount, COALESCE(lb.balance, 0)
+  FROM product_inventory pi
+  LEFT JOIN ledger_balances lb ON lb.account = pi.product
+  WHERE pi.stock <> COALESCE(lb.stock, 0)
+     OR pi.amount <> COALESCE(lb.balance, 0);
+$$
+LANGUAGE 'sql'
+STABLE;
+
+SELECT p2k12_rebuild_product_inventory();
+
+CREATE OR REPLACE VIEW product_stock AS
+  SELECT product AS id,
+         name,
+         stock::NUMERIC AS stock,
+         amount
+  FROM product_inventory;
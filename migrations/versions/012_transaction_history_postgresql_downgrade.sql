@@ -0,0 +1,5 @@
+DROP FUNCTION IF EXISTS p2k12_account_history(INT, TIMESTAMPTZ, INT, INT);
+DROP INDEX IF EXISTS transactions_date;
+DROP INDEX IF EXISTS transaction_lines_credit_account;
+DROP INDEX IF EXISTS transaction_lines_debit_account;
+DROP INDEX IF EXISTS transaction_lines_transaction;
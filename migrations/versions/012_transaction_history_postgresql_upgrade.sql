@@ -0,0 +1,48 @@
+-- Access paths for the history of an account and the lines of a
+-- transaction.  The account indexes include the transaction, so that the
+-- transactions of an account are found from the index alone.
+CREATE INDEX transaction_lines_transaction ON transaction_lines (transaction);
+CREATE INDEX transaction_lines_debit_account ON transaction_lines (debit_account, transaction);
+CREATE INDEX transaction_lines_credit_account ON transaction_lines (credit_account, transaction);
+CREATE INDEX transactions_date ON transactions (date, id);
+
+-- The lines of the transactions involving account_id that are dated after
+-- since, in the shape of pretty_transaction_lines.  Transactions are paged
+-- newest first by (date, id): with before_transaction, only those before
+-- that one are considered, and at most max_transactions of them.  A page
+-- never ends in the middle of a transaction.
+CREATE OR REPLACE FUNCTION p2k12_account_history(
+    account_id INT,
+    since TIMESTAMPTZ,
+    before_transaction INT DEFAULT NULL,
+    max_transactions INT DEFAULT NULL
+    ) RETURNS SETOF pretty_transaction_lines AS $$
+  WITH page AS (
+    SELECT t.id, t.date
+    FROM transactions t
+    WHERE t.id IN (SELECT transaction FROM transaction_lines WHERE debit_account = account_id
+                   UNION
+                   SELECT transaction FROM transaction_lines WHERE credit_account = account_id)
+      AND t.date > since
+      AND (before_transaction IS NULL
+           OR (t.date, t.id) < (SELECT b.date, b.id FROM transactions b WHERE b.id = before_transaction))
+    ORDER BY t.date DESC, t.id DESC
+    LIMIT max_transactions
+  )
+  SELECT tl.transaction,
+         tl.debit_account,
+         tl.credit_account,
+         tl.amount,
+         tl.currency,
+         tl.stock,
+         da.name,
+         ca.name,
+         page.date
+  FROM page
+  JOIN transaction_lines tl ON tl.transaction = page.id
+  JOIN accounts da ON da.id = tl.debit_account
+  JOIN accounts ca ON ca.id = tl.credit_account
+  WHERE account_id IN (tl.debit_account, tl.credit_account);
+$$
+LANGUAGE 'sql'
+STABLE;
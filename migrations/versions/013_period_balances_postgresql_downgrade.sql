@@ -0,0 +1,20 @@
+CREATE OR REPLACE VIEW ledger_balances AS
+  SELECT account, SUM(balance) AS balance, SUM(stock) AS stock
+  FROM (SELECT debit_account AS account, amount AS balance, stock::BIGINT AS stock
+        FROM transaction_lines
+        UNION ALL
+        SELECT credit_account, -amount, -stock::BIGINT
+        FROM transaction_lines) lines
+  GROUP BY account;
+
+DROP FUNCTION IF EXISTS p2k12_close_period(TIMESTAMPTZ);
+DROP FUNCTION IF EXISTS p2k12_account_balance_at(INT, TIMESTAMPTZ);
+DROP FUNCTION IF EXISTS p2k12_balances_at(TIMESTAMPTZ);
+DROP TRIGGER IF EXISTS transaction_lines_closed_period ON transaction_lines;
+DROP TRIGGER IF EXISTS transactions_closed_period ON transactions;
+DROP FUNCTION IF EXISTS p2k12_closed_period_lines_trigger();
+DROP FUNCTION IF EXISTS p2k12_closed_period_transactions_trigger();
+DROP FUNCTION IF EXISTS p2k12_check_open_period(TIMESTAMPTZ);
+DROP TABLE IF EXISTS period_balances;
+DROP TABLE IF EXISTS periods;
+DROP FUNCTION IF EXISTS p2k12_immutable_trigger();
@@ -0,0 +1,185 @@
+-- Closed accounting periods.  Closing a period records the balance and
+-- stock of every account as of its end, computed from the previous
+-- snapshot and the lines of the period, after which transactions dated in
+-- it can no longer change.  Balances as of any date are then the latest
+-- snapshot plus the lines since, however long the ledger grows.
+CREATE TABLE periods(
+    end_date TIMESTAMPTZ PRIMARY KEY,
+    closed   TIMESTAMPTZ NOT NULL DEFAULT now()
+);
+
+-- Accounts without a row had neither balance nor stock
+CREATE TABLE period_balances(
+    end_date TIMESTAMPTZ REFERENCES periods,
+    account  INT         REFERENCES accounts,
+    balance  NUMERIC     NOT NULL,
+    stock    BIGINT      NOT NULL,
+    PRIMARY KEY (end_date, account)
+);
+
+GRANT SELECT ON periods, period_balances TO p2k12_pos;
+
+CREATE OR REPLACE FUNCTION p2k12_immutable_trigger() RETURNS TRIGGER AS $$
+BEGIN
+  RAISE 'p2k12_period_closed'
+    USING HINT = 'Closed periods cannot change';
+END;
+$$
+LANGUAGE 'plpgsql';
+
+CREATE TRIGGER periods_immutable
+BEFORE UPDATE OR DELETE ON periods
+FOR EACH ROW EXECUTE PROCEDURE p2k12_immutable_trigger();
+
+CREATE TRIGGER period_balances_immutable
+BEFORE UPDATE OR DELETE ON period_balances
+FOR EACH ROW EXECUTE PROCEDURE p2k12_immutable_trigger();
+
+-- Fails if a transaction dated transaction_date falls in a closed period.
+-- Such are e.g. purchases replayed from a terminal's offline journal only
+-- after the period was closed.
+CREATE OR REPLACE FUNCTION p2k12_check_open_period(transaction_date TIMESTAMPTZ) RETURNS VOID AS $$
+DECLARE
+  closed_until TIMESTAMPTZ = (SELECT MAX(end_date) FROM periods);
+BEGIN
+  IF transaction_date <= closed_until
+  THEN
+    RAISE 'p2k12_period_closed'
+      USING HINT = 'The ledger is closed until ' || closed_until;
+  END IF;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+CREATE OR REPLACE FUNCTION p2k12_closed_period_transactions_trigger() RETURNS TRIGGER AS $$
+BEGIN
+  IF TG_OP IN ('UPDATE', 'DELETE')
+  THEN
+    PERFORM p2k12_check_open_period(OLD.date);
+  END IF;
+
+  IF TG_OP IN ('INSERT', 'UPDATE')
+  THEN
+    PERFORM p2k12_check_open_period(NEW.date);
+  END IF;
+
+  RETURN NULL;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+CREATE TRIGGER transactions_closed_period
+AFTER INSERT OR UPDATE OR DELETE ON transactions
+FOR EACH ROW EXECUTE PROCEDURE p2k12_closed_period_transactions_trigger();
+
+CREATE OR REPLACE FUNCTION p2k12_closed_period_lines_trigger() RETURNS TRIGGER AS $$
+BEGIN
+  IF TG_OP IN ('UPDATE', 'DELETE')
+  THEN
+    PERFORM p2k12_check_open_period((SELECT date FROM transactions WHERE id = OLD.transaction));
+  END IF;
+
+  IF TG_OP IN ('INSERT', 'UPDATE')
+  THEN
+    PERFORM p2k12_check_open_period((SELECT date FROM transactions WHERE id = NEW.transaction));
+  END IF;
+
+  RETURN NULL;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+CREATE TRIGGER transaction_lines_closed_period
+AFTER INSERT OR UPDATE OR DELETE ON transaction_lines
+FOR EACH ROW EXECUTE PROCEDURE p2k12_closed_period_lines_trigger();
+
+-- Balance and stock of every account as of as_of, from the latest
+-- snapshot at or before it and the lines dated since.
+CREATE OR REPLACE FUNCTION p2k12_balances_at(as_of TIMESTAMPTZ)
+RETURNS TABLE(account INT, balance NUMERIC, stock BIGINT) AS $$
+  WITH snapshot AS (
+    SELECT MAX(end_date) AS end_date FROM periods WHERE end_date <= as_of
+  )
+  SELECT changes.account, SUM(changes.balance), SUM(changes.stock)::BIGINT
+  FROM (SELECT pb.account, pb.balance, pb.stock
+        FROM snapshot
+        JOIN period_balances pb ON pb.end_date = snapshot.end_date
+        UNION ALL
+        SELECT tl.debit_account, tl.amount, tl.stock::BIGINT
+        FROM snapshot, transactions t
+        JOIN transaction_lines tl ON tl.transaction = t.id
+        WHERE t.date > COALESCE(snapshot.end_date, '-infinity') AND t.date <= as_of
+        UNION ALL
+        SELECT tl.credit_account, -tl.amount, -tl.stock::BIGINT
+        FROM snapshot, transactions t
+        JOIN transaction_lines tl ON tl.transaction = t.id
+        WHERE t.date > COALESCE(snapshot.end_date, '-infinity') AND t.date <= as_of) changes
+  GROUP BY changes.account;
+$$
+LANGUAGE 'sql'
+STABLE;
+
+-- The same for one account, using the account indexes of transaction_lines
+CREATE OR REPLACE FUNCTION p2k12_account_balance_at(account_id INT, as_of TIMESTAMPTZ)
+RETURNS TABLE(balance NUMERIC, stock BIGINT) AS $$
+  WITH snapshot AS (
+    SELECT MAX(end_date) AS end_date FROM periods WHERE end_date <= as_of
+  )
+  SELECT COALESCE(SUM(changes.balance), 0), COALESCE(SUM(changes.stock), 0)::BIGINT
+  FROM (SELECT pb.balance, pb.stock
+        FROM snapshot
+        JOIN period_balances pb ON pb.end_date = snapshot.end_date AND pb.account = account_id
+        UNION ALL
+        SELECT CASE WHEN tl.debit_account = account_id THEN tl.amount ELSE -tl.amount END,
+               CASE WHEN tl.debit_account = account_id THEN tl.stock ELSE -tl.stock END
+        FROM snapshot, transaction_lines tl
+        JOIN transactions t ON t.id = tl.transaction
+        WHERE account_id IN (tl.debit_account, tl.credit_account)
+          AND tl.debit_account <> tl.credit_account
+          AND t.date > COALESCE(snapshot.end_date, '-infinity') AND t.date <= as_of) changes;
+$$
+LANGUAGE 'sql'
+STABLE;
+
+-- Closes the period ending at period_end, which must be over and later
+-- than the last one closed.  Run e.g. monthly with
+-- SELECT p2k12_close_period(DATE_TRUNC('month', now())).  Returns the
+-- number of accounts in the snapshot.
+CREATE OR REPLACE FUNCTION p2k12_close_period(period_end TIMESTAMPTZ) RETURNS INT AS $$
+DECLARE
+  previous_end TIMESTAMPTZ = (SELECT MAX(end_date) FROM periods);
+  account_count INT;
+BEGIN
+  IF period_end > now()
+  THEN
+    RAISE 'p2k12_period_not_over'
+      USING HINT = 'Only periods that have ended can be closed';
+  END IF;
+
+  IF period_end <= previous_end
+  THEN
+    RAISE 'p2k12_period_closed'
+      USING HINT = 'The ledger is already closed until ' || previous_end;
+  END IF;
+
+  -- Nothing may be added to the period while it is summed up
+  LOCK TABLE transactions, transaction_lines IN SHARE MODE;
+
+  INSERT INTO periods (end_date) VALUES (period_end);
+
+  INSERT INTO period_balances (end_date, account, balance, stock)
+  SELECT period_end, account, balance, stock
+  FROM p2k12_balances_at(period_end)
+  WHERE balance <> 0 OR stock <> 0;
+
+  GET DIAGNOSTICS account_count = ROW_COUNT;
+
+  RETURN account_count;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+-- The ledger as of now reads the latest snapshot and the open period only
+CREATE OR REPLACE VIEW ledger_balances AS
+  SELECT account, balance, stock::NUMERIC AS stock
+  FROM p2k12_balances_at('infinity');
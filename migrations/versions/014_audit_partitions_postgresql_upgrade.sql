@@ -0,0 +1,232 @@
+-- Partitions audit.logged_actions by month of action_tstamp_tx, so that
+-- old months can be detached and archived instead of deleted row by row,
+-- and replaces its timestamp indexes with BRIN indexes, which are tiny and
+-- nearly free to maintain on a table written in timestamp order.  Needs
+-- PostgreSQL 11 or later.
+--
+-- The existing table becomes the partition for everything up to the end
+-- of the current month, named after that month like the others.
+
+-- Kept by the downgrade, along with the partitions archived in it
+CREATE SCHEMA IF NOT EXISTS audit_archive;
+REVOKE ALL ON SCHEMA audit_archive FROM public;
+
+COMMENT ON SCHEMA audit_archive IS 'Partitions of audit.logged_actions detached by audit.archive_partitions()';
+
+ALTER TABLE audit.logged_actions RENAME TO logged_actions_legacy;
+
+-- Attaching gives the table the partitioned indexes instead
+ALTER TABLE audit.logged_actions_legacy DROP CONSTRAINT logged_actions_pkey;
+DROP INDEX audit.logged_actions_relid_idx;
+DROP INDEX audit.logged_actions_action_tstamp_tx_stm_idx;
+DROP INDEX audit.logged_actions_action_idx;
+
+CREATE TABLE audit.logged_actions (
+    LIKE audit.logged_actions_legacy INCLUDING DEFAULTS INCLUDING CONSTRAINTS INCLUDING COMMENTS
+) PARTITION BY RANGE (action_tstamp_tx);
+
+ALTER TABLE audit.logged_actions ADD CONSTRAINT logged_actions_pkey PRIMARY KEY (event_id, action_tstamp_tx);
+ALTER SEQUENCE audit.logged_actions_event_id_seq OWNED BY audit.logged_actions.event_id;
+
+REVOKE ALL ON audit.logged_actions FROM public;
+
+COMMENT ON TABLE audit.logged_actions IS 'History of auditable actions on audited tables, from audit.if_modified_func(), partitioned by month';
+
+CREATE INDEX logged_actions_action_tstamp_tx_brin ON audit.logged_actions USING BRIN (action_tstamp_tx);
+CREATE INDEX logged_actions_action_tstamp_stm_brin ON audit.logged_actions USING BRIN (action_tstamp_stm);
+
+-- relid is scattered over every block, where BRIN summaries are useless,
+-- so the history of one table is looked up in a B-tree instead
+CREATE INDEX logged_actions_relid_tstamp_idx ON audit.logged_actions (relid, action_tstamp_tx);
+
+DO $$
+DECLARE
+  month_start TIMESTAMPTZ = DATE_TRUNC('month', now());
+BEGIN
+  EXECUTE format('ALTER TABLE audit.logged_actions_legacy RENAME TO %%I',
+                 'logged_actions_' || to_char(month_start, 'YYYYMM'));
+  EXECUTE format('ALTER TABLE audit.logged_actions ATTACH PARTITION audit.%%I FOR VALUES FROM (MINVALUE) TO (%%L)',
+                 'logged_actions_' || to_char(month_start, 'YYYYMM'), month_start + INTERVAL '1 month');
+END;
+$$;
+
+-- Catches events no monthly partition has been created for yet, so that
+-- audited writes never fail because audit.maintain() has not run
+CREATE TABLE audit.logged_actions_default PARTITION OF audit.logged_actions DEFAULT;
+
+-- Creates the partition for the month containing day unless it exists,
+-- moving into it any events of that month the default partition caught.
+-- Returns its name.
+CREATE OR REPLACE FUNCTION audit.create_partition(day DATE) RETURNS TEXT AS $$
+DECLARE
+  month_start TIMESTAMPTZ = DATE_TRUNC('month', day);
+  month_end TIMESTAMPTZ = DATE_TRUNC('month', day) + INTERVAL '1 month';
+  partition_name TEXT = 'logged_actions_' || to_char(month_start, 'YYYYMM');
+  caught BOOLEAN;
+BEGIN
+  IF to_regclass('audit.' || partition_name) IS NOT NULL
+  THEN
+    RETURN partition_name;
+  END IF;
+
+  -- A partition cannot be created for rows the default partition holds
+  SELECT EXISTS (SELECT 1
+                 FROM audit.logged_actions_default
+                 WHERE action_tstamp_tx >= month_start AND action_tstamp_tx < month_end)
+  INTO caught;
+
+  IF caught
+  THEN
+    ALTER TABLE audit.logged_actions DETACH PARTITION audit.logged_actions_default;
+  END IF;
+
+  EXECUTE format('CREATE TABLE audit.%%I PARTITION OF audit.logged_actions FOR VALUES FROM (%%L) TO (%%L)',
+                 partition_name, month_start, month_end);
+
+  IF caught
+  THEN
+    EXECUTE format('INSERT INTO audit.%%I SELECT * FROM audit.logged_actions_default '
+                   'WHERE action_tstamp_tx >= %%L AND action_tstamp_tx < %%L',
+                   partition_name, month_start, month_end);
+
+    DELETE FROM audit.logged_actions_default
+    WHERE action_tstamp_tx >= month_start AND action_tstamp_tx < month_end;
+
+    ALTER TABLE audit.logged_actions ATTACH PARTITION audit.logged_actions_default DEFAULT;
+  END IF;
+
+  RETURN partition_name;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+-- Detaches the monthly partitions that end no later than older_than and
+-- moves them to the audit_archive schema, from where they can be dumped
+-- and dropped.  Returns their names.
+CREATE OR REPLACE FUNCTION audit.archive_partitions(older_than TIMESTAMPTZ) RETURNS SETOF TEXT AS $$
+DECLARE
+  partition_name TEXT;
+BEGIN
+  FOR partition_name IN
+    SELECT c.relname
+    FROM pg_inherits i
+    JOIN pg_class c ON c.oid = i.inhrelid
+    WHERE i.inhparent = 'audit.logged_actions'::REGCLASS
+      AND c.relname ~ '^logged_actions_[0-9]{6}$'
+      AND to_date(substring(c.relname FROM '[0-9]{6}$'), 'YYYYMM') + INTERVAL '1 month' <= older_than
+    ORDER BY c.relname
+  LOOP
+    EXECUTE format('ALTER TABLE audit.logged_actions DETACH PARTITION audit.%%I', partition_name);
+    EXECUTE format('ALTER TABLE audit.%%I SET SCHEMA audit_archive', partition_name);
+    RETURN NEXT partition_name;
+  END LOOP;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+-- Creates the partitions for this month and the next two, and archives
+-- those older than retention unless it is NULL.  Run daily, e.g.
+-- psql -c "SELECT audit.maintain()" from cron.
+CREATE OR REPLACE FUNCTION audit.maintain(retention INTERVAL DEFAULT '2 years') RETURNS VOID AS $$
+BEGIN
+  PERFORM audit.create_partition((now() + months * INTERVAL '1 month')::DATE)
+  FROM generate_series(0, 2) months;
+
+  IF retention IS NOT NULL
+  THEN
+    PERFORM audit.archive_partitions(now() - retention);
+  END IF;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+SELECT audit.maintain(NULL);
+
+-- As in migration 004, except that the query text is logged only for the
+-- first event of each transaction, later ones having NULL, and that
+-- runtime variables are read without a subtransaction per row.
+CREATE OR REPLACE FUNCTION audit.if_modified_func() RETURNS TRIGGER AS $body$
+DECLARE
+    audit_row audit.logged_actions;
+    include_values boolean;
+    log_diffs boolean;
+    h_old hstore;
+    h_new hstore;
+    excluded_cols text[] = ARRAY[]::text[];
+    rt_key text;
+BEGIN
+    IF TG_WHEN <> 'AFTER' THEN
+        RAISE EXCEPTION 'audit.if_modified_func() may only run as an AFTER trigger';
+    END IF;
+
+    audit_row = ROW(
+        nextval('audit.logged_actions_event_id_seq'), -- event_id
+        TG_TABLE_SCHEMA::text,                        -- schema_name
+        TG_TABLE_NAME::text,                          -- table_name
+        TG_RELID,                                     -- relation OID for much quicker searches
+        session_user::text,                           -- session_user_name
+        current_timestamp,                            -- action_tstamp_tx
+        statement_timestamp(),                        -- action_tstamp_stm
+        clock_timestamp(),                            -- action_tstamp_clk
+        txid_current(),                               -- transaction ID
+        current_setting('application_name'),          -- client application
+        inet_client_addr(),                           -- client_addr
+        inet_client_port(),                           -- client_port
+        current_query(),                              -- top-level query or queries (if multistatement) from client
+        substring(TG_OP,1,1),                         -- action
+        NULL, NULL,                                   -- row_data, changed_fields
+        'f',                                          -- statement_only
+        hstore(ARRAY[]::text[])                       -- runtime_variables
+        );
+
+    IF NOT TG_ARGV[0]::boolean IS DISTINCT FROM 'f'::boolean THEN
+        audit_row.client_query = NULL;
+    END IF;
+
+    IF TG_ARGV[1] IS NOT NULL THEN
+        excluded_cols = TG_ARGV[1]::text[];
+    END IF;
+
+    IF TG_ARGV[2] IS NOT NULL THEN
+        FOREACH rt_key IN ARRAY TG_ARGV[2]::text[]
+        LOOP
+            -- NULL if the key is not set
+            audit_row.runtime_variables = audit_row.runtime_variables || hstore(rt_key, current_setting(rt_key, true));
+        END LOOP;
+    END IF;
+
+    IF (TG_OP = 'UPDATE' AND TG_LEVEL = 'ROW') THEN
+        audit_row.row_data = hstore(OLD.*) - excluded_cols;
+        audit_row.changed_fields =  (hstore(NEW.*) - audit_row.row_data) - excluded_cols;
+        IF audit_row.changed_fields = hstore('') THEN
+            -- All changed fields are ignored. Skip this update.
+            RETURN NULL;
+        END IF;
+    ELSIF (TG_OP = 'DELETE' AND TG_LEVEL = 'ROW') THEN
+        audit_row.row_data = hstore(OLD.*) - excluded_cols;
+    ELSIF (TG_OP = 'INSERT' AND TG_LEVEL = 'ROW') THEN
+        audit_row.row_data = hstore(NEW.*) - excluded_cols;
+    ELSIF (TG_LEVEL = 'STATEMENT' AND TG_OP IN ('INSERT','UPDATE','DELETE','TRUNCATE')) THEN
+        audit_row.statement_only = 't';
+    ELSE
+        RAISE EXCEPTION '[audit.if_modified_func] - Trigger func added as trigger for unhandled case: %%, %%',TG_OP, TG_LEVEL;
+        RETURN NULL;
+    END IF;
+
+    -- Later events of this transaction leave the text to the first one
+    -- with their transaction_id.
+    IF audit_row.client_query IS NOT NULL THEN
+        IF current_setting('audit.query_logged_txid', true) = audit_row.transaction_id::text THEN
+            audit_row.client_query = NULL;
+        ELSE
+            PERFORM set_config('audit.query_logged_txid', audit_row.transaction_id::text, true);
+        END IF;
+    END IF;
+
+    INSERT INTO audit.logged_actions VALUES (audit_row.*);
+    RETURN NULL;
+END;
+$body$
+LANGUAGE plpgsql
+SECURITY DEFINER
+SET search_path = pg_catalog, public;
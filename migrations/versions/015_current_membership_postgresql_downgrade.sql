@@ -0,0 +1,35 @@
+CREATE OR REPLACE FUNCTION p2k12_become_member(
+    account_id INT,
+    price INT
+    ) RETURNS VOID AS $$
+BEGIN
+  INSERT INTO members (full_name, email, price, account)
+  SELECT full_name, email, price, account
+  FROM members
+  WHERE account = account_id
+  ORDER BY date DESC
+  LIMIT 1;
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+CREATE OR REPLACE VIEW active_members AS
+ SELECT DISTINCT ON (m.account) m.id,
+    m.date,
+    m.full_name,
+    m.email,
+    m.price,
+    m.recurrence,
+    m.account,
+    m.organization,
+    m.flag
+   FROM members m
+  ORDER BY m.account, m.id DESC;
+
+DROP FUNCTION IF EXISTS p2k12_become_office_user(INT);
+DROP TRIGGER IF EXISTS current_membership_row ON members;
+DROP FUNCTION IF EXISTS p2k12_current_membership_trigger();
+DROP FUNCTION IF EXISTS p2k12_refresh_membership(INT);
+DROP INDEX IF EXISTS members_account;
+DROP TABLE IF EXISTS current_membership;
@@ -0,0 +1,96 @@
+-- The latest members row of every account, kept current by a trigger on
+-- members so that the membership check made before each p2k12 command is
+-- a primary key lookup.  members stays the append-only history.
+CREATE TABLE current_membership(
+    account INT          PRIMARY KEY REFERENCES accounts,
+    member  INT          NOT NULL,
+    price   NUMERIC(8,0) NOT NULL,
+    flag    VARCHAR(10)
+);
+
+GRANT SELECT ON current_membership TO p2k12_pos;
+
+CREATE INDEX members_account ON members (account, id);
+
+-- Sets the row of account_id from its latest members row, if any
+CREATE OR REPLACE FUNCTION p2k12_refresh_membership(account_id INT) RETURNS VOID AS $$
+BEGIN
+  INSERT INTO current_membership (account, member, price, flag)
+  SELECT account, id, price, flag
+  FROM members
+  WHERE account = account_id
+  ORDER BY id DESC
+  LIMIT 1
+  ON CONFLICT (account) DO UPDATE
+  SET member = EXCLUDED.member, price = EXCLUDED.price, flag = EXCLUDED.flag;
+
+  IF NOT FOUND
+  THEN
+    DELETE FROM current_membership WHERE account = account_id;
+  END IF;
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+CREATE OR REPLACE FUNCTION p2k12_current_membership_trigger() RETURNS TRIGGER AS $$
+BEGIN
+  IF TG_OP IN ('UPDATE', 'DELETE')
+  THEN
+    PERFORM p2k12_refresh_membership(OLD.account);
+  END IF;
+
+  IF TG_OP IN ('INSERT', 'UPDATE')
+  THEN
+    PERFORM p2k12_refresh_membership(NEW.account);
+  END IF;
+
+  RETURN NULL;
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+CREATE TRIGGER current_membership_row
+AFTER INSERT OR UPDATE OR DELETE ON members
+FOR EACH ROW EXECUTE PROCEDURE p2k12_current_membership_trigger();
+
+INSERT INTO current_membership (account, member, price, flag)
+SELECT DISTINCT ON (account) account, id, price, flag
+FROM members
+ORDER BY account, id DESC;
+
+CREATE OR REPLACE VIEW active_members AS
+  SELECT m.id, m.date, m.full_name, m.email, m.price, m.recurrence, m.account, m.organization, m.flag
+  FROM current_membership cm
+  JOIN members m ON m.id = cm.member;
+
+CREATE OR REPLACE FUNCTION p2k12_become_member(
+    account_id INT,
+    price INT
+    ) RETURNS VOID AS $$
+BEGIN
+  INSERT INTO members (full_name, email, price, account)
+  SELECT m.full_name, m.email, p2k12_become_member.price, m.account
+  FROM current_membership cm
+  JOIN members m ON m.id = cm.member
+  WHERE cm.account = account_id;
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+-- Keeps the membership of account_id and flags it as an office user
+CREATE OR REPLACE FUNCTION p2k12_become_office_user(
+    account_id INT
+    ) RETURNS VOID AS $$
+BEGIN
+  INSERT INTO members (full_name, email, price, account, flag)
+  SELECT m.full_name, m.email, m.price, m.account, 'm_office'
+  FROM current_membership cm
+  JOIN members m ON m.id = cm.member
+  WHERE cm.account = account_id;
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
@@ -0,0 +1,7 @@
+DROP FUNCTION IF EXISTS p2k12_undo(INT, INT);
+DROP FUNCTION IF EXISTS p2k12_return_deposit(INT, NUMERIC);
+DROP FUNCTION IF EXISTS p2k12_add_stock(INT, INT, NUMERIC, INT);
+DROP FUNCTION IF EXISTS p2k12_transfer(INT, TEXT, NUMERIC, TEXT, TEXT, TIMESTAMPTZ);
+DROP FUNCTION IF EXISTS p2k12_buy(INT, INT, INT, TEXT, NUMERIC, TIMESTAMPTZ);
+DROP FUNCTION IF EXISTS p2k12_record_journal_key(TEXT, INT);
+DROP FUNCTION IF EXISTS p2k12_ledger_result(INT, INT, INT);
@@ -0,0 +1,237 @@
+-- The ledger mutations made by p2k12, each validating its arguments and
+-- writing the transaction, its lines and optionally the journal key the
+-- mutation was made under in a single call.  Each returns the ID of the
+-- new transaction, the balance of the account afterwards as p2k12 shows
+-- it, and the unit price of the product involved, if any.
+
+CREATE OR REPLACE FUNCTION p2k12_ledger_result(
+    transaction_id INT,
+    account_id INT,
+    product_id INT
+    ) RETURNS TABLE(transaction INT, balance NUMERIC, unit_price NUMERIC) AS $$
+  SELECT transaction_id,
+         -COALESCE((SELECT ab.balance FROM account_balances ab WHERE ab.account = account_id), 0),
+         (SELECT pi.unit_price FROM product_inventory pi WHERE pi.product = product_id);
+$$
+LANGUAGE 'sql'
+STABLE;
+
+-- Records the key of a journaled mutation along with its transaction
+CREATE OR REPLACE FUNCTION p2k12_record_journal_key(
+    journal_key TEXT,
+    transaction_id INT
+    ) RETURNS VOID AS $$
+BEGIN
+  IF journal_key IS NOT NULL
+  THEN
+    INSERT INTO journal_keys (key, transaction) VALUES (journal_key, transaction_id);
+  END IF;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+-- Buys count items of a product, priced at the current stock value unless
+-- amount gives the price of all of them
+CREATE OR REPLACE FUNCTION p2k12_buy(
+    account_id INT,
+    product_id INT,
+    count INT,
+    journal_key TEXT DEFAULT NULL,
+    amount NUMERIC DEFAULT NULL,
+    transaction_date TIMESTAMPTZ DEFAULT now()
+    ) RETURNS TABLE(transaction INT, balance NUMERIC, unit_price NUMERIC) AS $$
+DECLARE
+  inventory product_inventory%%ROWTYPE;
+  new_transaction INT;
+BEGIN
+  IF count IS NULL OR count <= 0
+  THEN
+    RAISE 'p2k12_invalid_count'
+      USING HINT = 'The count must be a positive integer';
+  END IF;
+
+  SELECT * INTO inventory FROM product_inventory pi WHERE pi.product = product_id;
+
+  IF NOT FOUND
+  THEN
+    RAISE 'p2k12_unknown_product'
+      USING HINT = 'There is no product with that ID';
+  END IF;
+
+  IF amount IS NULL
+  THEN
+    IF inventory.stock = 0
+    THEN
+      RAISE 'p2k12_out_of_stock'
+        USING HINT = 'The product is out of stock';
+    END IF;
+
+    amount = count * inventory.amount / inventory.stock;
+  END IF;
+
+  INSERT INTO transactions (date, reason)
+  VALUES (transaction_date, 'buy')
+  RETURNING id INTO new_transaction;
+
+  INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency, stock)
+  VALUES (new_transaction, account_id, product_id, amount, 'NOK', count);
+
+  PERFORM p2k12_record_journal_key(journal_key, new_transaction);
+
+  RETURN QUERY SELECT * FROM p2k12_ledger_result(new_transaction, account_id, product_id);
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+-- Moves amount from account_id to the account called counterpart for
+-- reason 'give', or the other way round for 'take'
+CREATE OR REPLACE FUNCTION p2k12_transfer(
+    account_id INT,
+    counterpart TEXT,
+    amount NUMERIC,
+    reason TEXT,
+    journal_key TEXT DEFAULT NULL,
+    transaction_date TIMESTAMPTZ DEFAULT now()
+    ) RETURNS TABLE(transaction INT, balance NUMERIC, unit_price NUMERIC) AS $$
+DECLARE
+  counterpart_id INT = (SELECT a.id FROM accounts a WHERE a.name = counterpart);
+  new_transaction INT;
+BEGIN
+  IF reason IS NULL OR reason NOT IN ('give', 'take')
+  THEN
+    RAISE 'p2k12_invalid_reason'
+      USING HINT = 'A transfer is either give or take';
+  END IF;
+
+  IF counterpart_id IS NULL
+  THEN
+    RAISE 'p2k12_unknown_account'
+      USING HINT = 'There is no account with that name';
+  END IF;
+
+  IF amount IS NULL OR amount < 0
+  THEN
+    RAISE 'p2k12_invalid_amount'
+      USING HINT = 'The amount cannot be negative';
+  END IF;
+
+  INSERT INTO transactions (date, reason)
+  VALUES (transaction_date, reason)
+  RETURNING id INTO new_transaction;
+
+  IF reason = 'give'
+  THEN
+    INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency)
+    VALUES (new_transaction, account_id, counterpart_id, amount, 'NOK');
+  ELSE
+    INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency)
+    VALUES (new_transaction, counterpart_id, account_id, amount, 'NOK');
+  END IF;
+
+  PERFORM p2k12_record_journal_key(journal_key, new_transaction);
+
+  RETURN QUERY SELECT * FROM p2k12_ledger_result(new_transaction, account_id, NULL);
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+-- Adds count items of a product worth amount in total, paid by account_id
+CREATE OR REPLACE FUNCTION p2k12_add_stock(
+    account_id INT,
+    product_id INT,
+    amount NUMERIC,
+    count INT
+    ) RETURNS TABLE(transaction INT, balance NUMERIC, unit_price NUMERIC) AS $$
+DECLARE
+  new_transaction INT;
+BEGIN
+  IF NOT EXISTS (SELECT 1 FROM product_inventory pi WHERE pi.product = product_id)
+  THEN
+    RAISE 'p2k12_unknown_product'
+      USING HINT = 'There is no product with that ID';
+  END IF;
+
+  IF amount IS NULL OR amount <= 0
+  THEN
+    RAISE 'p2k12_invalid_amount'
+      USING HINT = 'The amount must be positive';
+  END IF;
+
+  IF count IS NULL OR count <= 0
+  THEN
+    RAISE 'p2k12_invalid_count'
+      USING HINT = 'The count must be a positive integer';
+  END IF;
+
+  INSERT INTO transactions (reason)
+  VALUES ('add stock')
+  RETURNING id INTO new_transaction;
+
+  INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency, stock)
+  VALUES (new_transaction, product_id, account_id, amount, 'NOK', count);
+
+  RETURN QUERY SELECT * FROM p2k12_ledger_result(new_transaction, account_id, product_id);
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+-- Charges account_id amount for a deposit item taken from storage
+CREATE OR REPLACE FUNCTION p2k12_return_deposit(
+    account_id INT,
+    amount NUMERIC
+    ) RETURNS TABLE(transaction INT, balance NUMERIC, unit_price NUMERIC) AS $$
+DECLARE
+  deposit_id INT = (SELECT a.id FROM accounts a WHERE a.name = 'deposit' LIMIT 1);
+  new_transaction INT;
+BEGIN
+  IF amount IS NULL OR amount <= 0
+  THEN
+    RAISE 'p2k12_invalid_amount'
+      USING HINT = 'The amount must be positive';
+  END IF;
+
+  INSERT INTO transactions (reason)
+  VALUES ('return deposit')
+  RETURNING id INTO new_transaction;
+
+  INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency, stock)
+  VALUES (new_transaction, account_id, deposit_id, amount, 'NOK', 1);
+
+  RETURN QUERY SELECT * FROM p2k12_ledger_result(new_transaction, account_id, NULL);
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+-- Reverses the lines of transaction_id in a new transaction.  The balance
+-- returned is that of account_id.
+CREATE OR REPLACE FUNCTION p2k12_undo(
+    account_id INT,
+    transaction_id INT
+    ) RETURNS TABLE(transaction INT, balance NUMERIC, unit_price NUMERIC) AS $$
+DECLARE
+  new_transaction INT;
+BEGIN
+  IF NOT EXISTS (SELECT 1 FROM transactions t WHERE t.id = transaction_id)
+  THEN
+    RAISE 'p2k12_unknown_transaction'
+      USING HINT = 'There is no transaction with that ID';
+  END IF;
+
+  INSERT INTO transactions (reason)
+  VALUES ('undo ' || transaction_id)
+  RETURNING id INTO new_transaction;
+
+  INSERT INTO transaction_lines (transaction, debit_account, credit_account, amount, currency, stock)
+  SELECT new_transaction, tl.credit_account, tl.debit_account, tl.amount, tl.currency, tl.stock
+  FROM transaction_lines tl
+  WHERE tl.transaction = transaction_id;
+
+  RETURN QUERY SELECT * FROM p2k12_ledger_result(new_transaction, account_id, NULL);
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
@@ -0,0 +1,15 @@
+DROP FUNCTION IF EXISTS p2k12_member_sales(TIMESTAMPTZ, TIMESTAMPTZ, INT);
+DROP FUNCTION IF EXISTS p2k12_product_sales(TIMESTAMPTZ, TIMESTAMPTZ, INT);
+DROP FUNCTION IF EXISTS p2k12_sales_bounds(TIMESTAMPTZ, TIMESTAMPTZ);
+DROP FUNCTION IF EXISTS p2k12_rebuild_sales_rollups();
+DROP TRIGGER IF EXISTS sales_rollups_truncate ON transaction_lines;
+DROP TRIGGER IF EXISTS sales_rollups_row ON transaction_lines;
+DROP FUNCTION IF EXISTS p2k12_sales_rollups_trigger();
+DROP FUNCTION IF EXISTS p2k12_post_sale(INT, INT, INT, NUMERIC, BIGINT, INT);
+DROP FUNCTION IF EXISTS p2k12_add_sale(TIMESTAMPTZ, INT, INT, BIGINT, NUMERIC);
+DROP VIEW IF EXISTS sales_lines;
+DROP FUNCTION IF EXISTS p2k12_sale_sign(TEXT, TEXT, TEXT);
+DROP TABLE IF EXISTS member_sales_daily;
+DROP TABLE IF EXISTS member_sales_hourly;
+DROP TABLE IF EXISTS product_sales_daily;
+DROP TABLE IF EXISTS product_sales_hourly;
@@ -0,0 +1,294 @@
+-- Units and amounts sold per hour and per day, by product and by member,
+-- kept current by triggers on transaction_lines so that sales reports do
+-- not aggregate the whole ledger.  Days are in CET, the time zone p2k12
+-- uses.
+--
+-- A sale is a line from a user account to a product account, as in
+-- scripts/gen-stats.sh, except in transactions undoing another one: there
+-- a line from a product back to a user takes a sale back, and the other
+-- direction undoes adding stock.  Changing the date or reason of a
+-- transaction that has lines is not tracked; run
+-- p2k12_rebuild_sales_rollups() after doing so.
+CREATE TABLE product_sales_hourly(
+    hour    TIMESTAMPTZ,
+    product INT         REFERENCES accounts,
+    units   BIGINT      NOT NULL,
+    amount  NUMERIC     NOT NULL,
+    PRIMARY KEY (hour, product)
+);
+
+CREATE TABLE product_sales_daily(
+    day     DATE,
+    product INT     REFERENCES accounts,
+    units   BIGINT  NOT NULL,
+    amount  NUMERIC NOT NULL,
+    PRIMARY KEY (day, product)
+);
+
+CREATE TABLE member_sales_hourly(
+    hour    TIMESTAMPTZ,
+    account INT         REFERENCES accounts,
+    units   BIGINT      NOT NULL,
+    amount  NUMERIC     NOT NULL,
+    PRIMARY KEY (hour, account)
+);
+
+CREATE TABLE member_sales_daily(
+    day     DATE,
+    account INT     REFERENCES accounts,
+    units   BIGINT  NOT NULL,
+    amount  NUMERIC NOT NULL,
+    PRIMARY KEY (day, account)
+);
+
+GRANT SELECT ON product_sales_hourly, product_sales_daily, member_sales_hourly, member_sales_daily TO p2k12_pos;
+
+-- 1 for a sale, -1 for one taken back and 0 for any other line
+CREATE OR REPLACE FUNCTION p2k12_sale_sign(
+    reason TEXT,
+    debit_type TEXT,
+    credit_type TEXT
+    ) RETURNS INT AS $$
+  SELECT CASE
+         WHEN reason LIKE 'undo %%'
+         THEN CASE WHEN debit_type = 'product' AND credit_type = 'user' THEN -1 ELSE 0 END
+         WHEN debit_type = 'user' AND credit_type = 'product'
+         THEN 1
+         ELSE 0
+         END;
+$$
+LANGUAGE 'sql'
+IMMUTABLE;
+
+-- The sales in the ledger, with the units and amount taken back negative
+CREATE OR REPLACE VIEW sales_lines AS
+  SELECT t.date,
+         CASE WHEN s.sign > 0 THEN tl.credit_account ELSE tl.debit_account END AS product,
+         CASE WHEN s.sign > 0 THEN tl.debit_account ELSE tl.credit_account END AS account,
+         s.sign * tl.stock::BIGINT AS units,
+         s.sign * tl.amount AS amount
+  FROM transaction_lines tl
+  JOIN transactions t ON t.id = tl.transaction
+  JOIN accounts d ON d.id = tl.debit_account
+  JOIN accounts c ON c.id = tl.credit_account
+  CROSS JOIN LATERAL (SELECT p2k12_sale_sign(t.reason, d.type, c.type) AS sign) s
+  WHERE s.sign <> 0;
+
+-- Adds a sale to the hourly and daily rollups of its product and member
+CREATE OR REPLACE FUNCTION p2k12_add_sale(
+    sale_date TIMESTAMPTZ,
+    product_id INT,
+    account_id INT,
+    sale_units BIGINT,
+    sale_amount NUMERIC
+    ) RETURNS VOID AS $$
+DECLARE
+  sale_hour TIMESTAMPTZ = DATE_TRUNC('hour', sale_date);
+  sale_day DATE = (sale_date AT TIME ZONE 'CET')::DATE;
+BEGIN
+  INSERT INTO product_sales_hourly AS s (hour, product, units, amount)
+  VALUES (sale_hour, product_id, sale_units, sale_amount)
+  ON CONFLICT (hour, product) DO UPDATE
+  SET units = s.units + EXCLUDED.units, amount = s.amount + EXCLUDED.amount;
+
+  INSERT INTO product_sales_daily AS s (day, product, units, amount)
+  VALUES (sale_day, product_id, sale_units, sale_amount)
+  ON CONFLICT (day, product) DO UPDATE
+  SET units = s.units + EXCLUDED.units, amount = s.amount + EXCLUDED.amount;
+
+  INSERT INTO member_sales_hourly AS s (hour, account, units, amount)
+  VALUES (sale_hour, account_id, sale_units, sale_amount)
+  ON CONFLICT (hour, account) DO UPDATE
+  SET units = s.units + EXCLUDED.units, amount = s.amount + EXCLUDED.amount;
+
+  INSERT INTO member_sales_daily AS s (day, account, units, amount)
+  VALUES (sale_day, account_id, sale_units, sale_amount)
+  ON CONFLICT (day, account) DO UPDATE
+  SET units = s.units + EXCLUDED.units, amount = s.amount + EXCLUDED.amount;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+-- Adds a line to the rollups if it is a sale, or with direction -1 removes
+-- it again
+CREATE OR REPLACE FUNCTION p2k12_post_sale(
+    line_transaction INT,
+    debit_id INT,
+    credit_id INT,
+    line_amount NUMERIC,
+    line_stock BIGINT,
+    direction INT
+    ) RETURNS VOID AS $$
+DECLARE
+  sale_date TIMESTAMPTZ;
+  sign INT;
+BEGIN
+  SELECT t.date, p2k12_sale_sign(t.reason, d.type, c.type)
+  INTO sale_date, sign
+  FROM transactions t, accounts d, accounts c
+  WHERE t.id = line_transaction AND d.id = debit_id AND c.id = credit_id;
+
+  IF sign IS NULL OR sign = 0
+  THEN
+    RETURN;
+  END IF;
+
+  PERFORM p2k12_add_sale(sale_date,
+                         CASE WHEN sign > 0 THEN credit_id ELSE debit_id END,
+                         CASE WHEN sign > 0 THEN debit_id ELSE credit_id END,
+                         direction * sign * line_stock,
+                         direction * sign * line_amount);
+END;
+$$
+LANGUAGE 'plpgsql';
+
+CREATE OR REPLACE FUNCTION p2k12_sales_rollups_trigger() RETURNS TRIGGER AS $$
+BEGIN
+  IF TG_OP = 'TRUNCATE'
+  THEN
+    DELETE FROM product_sales_hourly;
+    DELETE FROM product_sales_daily;
+    DELETE FROM member_sales_hourly;
+    DELETE FROM member_sales_daily;
+
+    RETURN NULL;
+  END IF;
+
+  IF TG_OP IN ('UPDATE', 'DELETE')
+  THEN
+    PERFORM p2k12_post_sale(OLD.transaction, OLD.debit_account, OLD.credit_account, OLD.amount, OLD.stock, -1);
+  END IF;
+
+  IF TG_OP IN ('INSERT', 'UPDATE')
+  THEN
+    PERFORM p2k12_post_sale(NEW.transaction, NEW.debit_account, NEW.credit_account, NEW.amount, NEW.stock, 1);
+  END IF;
+
+  RETURN NULL;
+END;
+$$
+LANGUAGE 'plpgsql'
+SECURITY DEFINER;
+
+CREATE TRIGGER sales_rollups_row
+AFTER INSERT OR UPDATE OR DELETE ON transaction_lines
+FOR EACH ROW EXECUTE PROCEDURE p2k12_sales_rollups_trigger();
+
+CREATE TRIGGER sales_rollups_truncate
+AFTER TRUNCATE ON transaction_lines
+FOR EACH STATEMENT EXECUTE PROCEDURE p2k12_sales_rollups_trigger();
+
+-- Recomputes the rollups from the ledger.  Returns the number of hourly
+-- product rows.
+CREATE OR REPLACE FUNCTION p2k12_rebuild_sales_rollups() RETURNS INT AS $$
+DECLARE
+  row_count INT;
+BEGIN
+  -- Keep new lines out until the tables are consistent again
+  LOCK TABLE transaction_lines IN SHARE MODE;
+
+  DELETE FROM product_sales_hourly;
+  DELETE FROM product_sales_daily;
+  DELETE FROM member_sales_hourly;
+  DELETE FROM member_sales_daily;
+
+  INSERT INTO product_sales_daily (day, product, units, amount)
+  SELECT (date AT TIME ZONE 'CET')::DATE, product, SUM(units), SUM(amount)
+  FROM sales_lines
+  GROUP BY 1, 2;
+
+  INSERT INTO member_sales_hourly (hour, account, units, amount)
+  SELECT DATE_TRUNC('hour', date), account, SUM(units), SUM(amount)
+  FROM sales_lines
+  GROUP BY 1, 2;
+
+  INSERT INTO member_sales_daily (day, account, units, amount)
+  SELECT (date AT TIME ZONE 'CET')::DATE, account, SUM(units), SUM(amount)
+  FROM sales_lines
+  GROUP BY 1, 2;
+
+  INSERT INTO product_sales_hourly (hour, product, units, amount)
+  SELECT DATE_TRUNC('hour', date), product, SUM(units), SUM(amount)
+  FROM sales_lines
+  GROUP BY 1, 2;
+
+  GET DIAGNOSTICS row_count = ROW_COUNT;
+
+  RETURN row_count;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+SELECT p2k12_rebuild_sales_rollups();
+
+-- The whole hours from since to until, and the CET days entirely within
+-- them, which are read from the daily rollups instead of the hourly ones
+CREATE OR REPLACE FUNCTION p2k12_sales_bounds(
+    since TIMESTAMPTZ,
+    until TIMESTAMPTZ
+    ) RETURNS TABLE(first_hour TIMESTAMPTZ, end_hour TIMESTAMPTZ, first_day DATE, end_day DATE) AS $$
+  SELECT DATE_TRUNC('hour', since),
+         DATE_TRUNC('hour', until),
+         (since AT TIME ZONE 'CET')::DATE
+           + CASE WHEN ((since AT TIME ZONE 'CET')::DATE::TIMESTAMP AT TIME ZONE 'CET') < DATE_TRUNC('hour', since)
+                  THEN 1 ELSE 0 END,
+         (DATE_TRUNC('hour', until) AT TIME ZONE 'CET')::DATE;
+$$
+LANGUAGE 'sql'
+STABLE;
+
+-- Products by amount sold from since to until, at most max_rows of them
+CREATE OR REPLACE FUNCTION p2k12_product_sales(
+    since TIMESTAMPTZ,
+    until TIMESTAMPTZ,
+    max_rows INT DEFAULT NULL
+    ) RETURNS TABLE(product INT, name TEXT, units BIGINT, amount NUMERIC) AS $$
+  WITH sales AS (
+    SELECT d.product, d.units, d.amount
+    FROM p2k12_sales_bounds(since, until) b
+    JOIN product_sales_daily d ON d.day >= b.first_day AND d.day < b.end_day
+    UNION ALL
+    SELECT h.product, h.units, h.amount
+    FROM p2k12_sales_bounds(since, until) b
+    JOIN product_sales_hourly h ON h.hour >= b.first_hour AND h.hour < b.end_hour
+    WHERE (h.hour AT TIME ZONE 'CET')::DATE < b.first_day
+       OR (h.hour AT TIME ZONE 'CET')::DATE >= b.end_day
+  )
+  SELECT s.product, a.name, SUM(s.units)::BIGINT, SUM(s.amount)
+  FROM sales s
+  JOIN accounts a ON a.id = s.product
+  GROUP BY s.product, a.name
+  HAVING SUM(s.units) <> 0 OR SUM(s.amount) <> 0
+  ORDER BY SUM(s.amount) DESC, s.product
+  LIMIT max_rows;
+$$
+LANGUAGE 'sql'
+STABLE;
+
+-- Members by amount bought from since to until, at most max_rows of them
+CREATE OR REPLACE FUNCTION p2k12_member_sales(
+    since TIMESTAMPTZ,
+    until TIMESTAMPTZ,
+    max_rows INT DEFAULT NULL
+    ) RETURNS TABLE(account INT, name TEXT, units BIGINT, amount NUMERIC) AS $$
+  WITH sales AS (
+    SELECT d.account, d.units, d.amount
+    FROM p2k12_sales_bounds(since, until) b
+    JOIN member_sales_daily d ON d.day >= b.first_day AND d.day < b.end_day
+    UNION ALL
+    SELECT h.account, h.units, h.amount
+    FROM p2k12_sales_bounds(since, until) b
+    JOIN member_sales_hourly h ON h.hour >= b.first_hour AND h.hour < b.end_hour
+    WHERE (h.hour AT TIME ZONE 'CET')::DATE < b.first_day
+       OR (h.hour AT TIME ZONE 'CET')::DATE >= b.end_day
+  )
+  SELECT s.account, a.name, SUM(s.units)::BIGINT, SUM(s.amount)
+  FROM sales s
+  JOIN accounts a ON a.id = s.account
+  GROUP BY s.account, a.name
+  HAVING SUM(s.units) <> 0 OR SUM(s.amount) <> 0
+  ORDER BY SUM(s.amount) DESC, s.account
+  LIMIT max_rows;
+$$
+LANGUAGE 'sql'
+STABLE;
@@ -0,0 +1,2 @@
+DROP FUNCTION IF EXISTS p2k12_search_products(TEXT, INT);
+DROP INDEX IF EXISTS product_inventory_name_trgm;
@@ -0,0 +1,50 @@
+-- Product search for "products PATTERN", tolerant of typos and of words
+-- given in any order, using a trigram index on product names.
+CREATE EXTENSION IF NOT EXISTS pg_trgm;
+
+CREATE INDEX product_inventory_name_trgm ON product_inventory USING GIN (name gin_trgm_ops);
+
+-- The products matching any word of pattern, either as a substring of the
+-- name or with a word_similarity() of at least
+-- pg_trgm.word_similarity_threshold, best first.  Each word scores 1 if
+-- it is a substring and its similarity otherwise.  Without words, all
+-- products by ID.
+CREATE OR REPLACE FUNCTION p2k12_search_products(
+    pattern TEXT,
+    max_rows INT DEFAULT NULL
+    ) RETURNS TABLE(product INT, name TEXT, stock BIGINT, amount NUMERIC) AS $$
+BEGIN
+  IF COALESCE(btrim(pattern), '') = ''
+  THEN
+    RETURN QUERY
+    SELECT pi.product, pi.name, pi.stock, pi.amount
+    FROM product_inventory pi
+    ORDER BY pi.product
+    LIMIT max_rows;
+
+    RETURN;
+  END IF;
+
+  RETURN QUERY
+  WITH words AS (
+    -- Wildcards typed by the user are matched literally
+    SELECT w.word,
+           '%%' || replace(replace(replace(w.word, '\', '\\'), '%%', '\%%'), '_', '\_') || '%%' AS like_pattern
+    FROM (SELECT DISTINCT regexp_split_to_table(lower(btrim(pattern)), '\s+') AS word) w
+  ), matches AS (
+    SELECT pi.product AS match_product,
+           GREATEST(word_similarity(w.word, pi.name),
+                    CASE WHEN pi.name ILIKE w.like_pattern THEN 1 ELSE 0 END) AS score
+    FROM words w
+    JOIN product_inventory pi ON pi.name ILIKE w.like_pattern OR w.word <%% pi.name
+  )
+  SELECT pi.product, pi.name, pi.stock, pi.amount
+  FROM matches m
+  JOIN product_inventory pi ON pi.product = m.match_product
+  GROUP BY pi.product
+  ORDER BY SUM(m.score) DESC, similarity(pattern, pi.name) DESC, pi.product
+  LIMIT max_rows;
+END;
+$$
+LANGUAGE 'plpgsql'
+STABLE;
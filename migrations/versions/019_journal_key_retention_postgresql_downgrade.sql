@@ -0,0 +1,2 @@
+DROP FUNCTION IF EXISTS p2k12_prune_journal_keys(INTERVAL);
+DROP INDEX IF EXISTS journal_keys_date;
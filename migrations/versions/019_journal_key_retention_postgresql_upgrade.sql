@@ -0,0 +1,22 @@
+-- Retention for journal_keys, which otherwise gain a row for every online
+-- purchase, transfer and checkin.
+CREATE INDEX journal_keys_date ON journal_keys (date);
+
+-- Deletes the keys recorded more than retention ago and returns how many.
+-- A key only has to outlive the journal entry it guards: terminals replay
+-- their journal within minutes of the database coming back, so the default
+-- leaves ample room for one that stays offline for weeks.  Run daily
+-- alongside audit.maintain(), e.g.
+-- psql -c "SELECT p2k12_prune_journal_keys()" from cron.
+CREATE OR REPLACE FUNCTION p2k12_prune_journal_keys(retention INTERVAL DEFAULT '90 days') RETURNS BIGINT AS $$
+DECLARE
+  pruned BIGINT;
+BEGIN
+  DELETE FROM journal_keys WHERE date < now() - retention;
+
+  GET DIAGNOSTICS pruned = ROW_COUNT;
+
+  RETURN pruned;
+END;
+$$
+LANGUAGE 'plpgsql';
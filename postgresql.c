@@ -3,109 +3,805 @@
 #endif
 
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <syslog.h>
 
 #include <postgresql/libpq-fe.h>
 
+#include "array.h"
+#include "backend.h"
 #include "postgresql.h"
 
-static PGconn *pg; /* Database connection handle */
-static PGresult *pgresult;
-static int tuple_count;
-static char *current_account = NULL;
+/* Statements are prepared once per connection and looked up by their
+ * printf-style format string, which fully determines the query text.  */
+
+#define STATEMENT_CACHE_SIZE 256
+
+/* Latencies are kept in log-linear histograms: exact below
+ * 2 * HISTOGRAM_SUB microseconds, then HISTOGRAM_SUB buckets per power of
+ * two, which bounds the error to 1 / HISTOGRAM_SUB.  */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXPONENT 35
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB)
+
+struct statement_stats
+{
+	unsigned long calls, errors, rows;
+	unsigned long long total_usec, max_usec;
+	unsigned int histogram[HISTOGRAM_BUCKETS];
+};
+
+struct statement
+{
+	char *format;
+	char name[16];
+	int prepared;
+
+	struct statement_stats stats;
+};
+
+enum pipeline_item_type
+{
+	PIPELINE_INTERNAL,
+	PIPELINE_PREPARE,
+	PIPELINE_QUERY,
+	PIPELINE_TXID
+};
+
+/* A message sent in the current attempt of a pipelined transaction.
+ * Queries refer to their entry in the list of queued statements.  */
+struct pipeline_item
+{
+	enum pipeline_item_type type;
+	struct statement *stmt;
+	size_t statement;
+};
+
+/* A query rewritten from printf-style format to $n placeholders.  The
+ * buffers are sized up front so that pointers into them stay valid.  */
+struct number
+{
+	char text[128];
+};
+
+struct query
+{
+	ARRAY(char) text;
+	ARRAY(const char *) args;
+	ARRAY(int) lengths;
+	ARRAY(int) formats;
+	ARRAY(struct number) numbers;
+	struct statement *stmt;
+
+	/* Set for %S arguments, which are never logged */
+	ARRAY(int) secret;
+
+	/* The printf-style format, for backends other than libpq */
+	const char *format;
+};
+
+/* A statement queued with SQL_PipelineQuery, kept for replay */
+struct pipeline_statement
+{
+	struct query q;
+	PGresult *result;
+};
+
+enum async_state
+{
+	ASYNC_IDLE,
+	ASYNC_PREPARING,
+	ASYNC_EXECUTING,
+	ASYNC_DONE
+};
+
+/* Everything a session needs.  A connection may be used by one thread at
+ * a time; distinct connections share no state.  */
+struct SQL_Connection
+{
+	PGconn *pg;
+
+	/* Set if the connect string names a backend other than a PostgreSQL
+	 * server; pg is then NULL.  backend_fd stands in for the socket of
+	 * the asynchronous interface, and is always readable.  */
+	const struct SQL_Backend *backend;
+	void *backend_db;
+	struct SQL_BackendStatus backend_status;
+	int backend_fd;
+
+	/* Result of the most recent SQL_ConnQuery */
+	PGresult *pgresult;
+	int tuple_count;
+
+	/* Value of "p2k12.account", restored after reconnecting */
+	char *account;
+
+	unsigned long reconnects;
+
+	struct statement statement_cache[STATEMENT_CACHE_SIZE];
+	unsigned int statement_count;
+	unsigned long statement_hits, statement_misses;
+
+	/* Statements that did not fit in the cache */
+	struct statement_stats uncached_stats;
+
+	ARRAY(struct pipeline_statement) pipeline;
+	ARRAY(struct pipeline_item) pipeline_sent;
+	const char *pipeline_begin;
+	int pipeline_failed, pipeline_invalid, pipeline_commit_sent;
+
+	/* Begun inside a transaction, so run in a savepoint instead */
+	int pipeline_nested;
+	long long pipeline_txid;
+
+	/* SQLSTATE of the first error since the last transaction began */
+	char sqlstate[6];
+
+	/* Set while SQL_ConnTransaction runs its unit of work */
+	int in_transaction;
+
+	/* The open transaction died with the connection */
+	int transaction_lost;
+
+	/* Query sent with SQL_ConnSendQuery and not yet picked up */
+	enum async_state async_state;
+	struct query async_query;
+	PGresult *async_result;
+	int async_failed, async_affected_rows;
+	unsigned long long async_start;
+
+	/* Slow query log; disabled while slow_usec is 0 */
+	char *connect_string;
+	unsigned long long slow_usec;
+	char *slow_log_path;
+
+	/* Read-only connection for capturing plans of slow queries */
+	PGconn *plan_pg;
+	char *plan_query;
+
+	/* Deadlines; zero means none */
+	unsigned long long statement_usec, reconnect_usec;
+	unsigned long long command_deadline;
+
+	/* Set when a query could not even be cancelled */
+	int needs_reset;
+	int reconnecting;
+	unsigned int jitter_seed;
+
+	/* When reconnecting last gave up, or 0 while the server is
+	 * reachable; see SQL_ConnOffline.  */
+	unsigned long long offline_since;
+
+	/* The last query or pipeline failed for want of the server, not
+	 * because of anything it contained.  */
+	int unavailable;
+
+	/* Hot standby that takes reads while it is fresh enough; NULL if
+	 * none is configured.  While replica_retry is set, it is down and
+	 * not tried again before that time.  */
+	struct SQL_Connection *replica;
+	unsigned long long replica_lag_usec, replica_checked, replica_retry;
+	int replica_fresh;
+
+	/* WAL position the replica must have replayed to see our writes,
+	 * and whether it has to be fetched again after a later write.  */
+	char write_lsn[32];
+	int write_pending;
+
+	/* Connection running the SQL_ConnSendQuery query */
+	struct SQL_Connection *async_conn;
+
+	/* On a replica: the last query failed in a way that the primary
+	 * would not, and is to be run there instead.  */
+	int is_replica, failover;
+
+	/* Used by no session: failures go to syslog, see Report */
+	int background;
+};
+
+static struct SQL_Connection *default_connection;
+
+/* Tells the user about a failure on conn, or syslog if conn is used in
+ * the background, where stdout may be anyone's session.  */
+static void
+Report(struct SQL_Connection *conn, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+
+	if (conn->background)
+		vsyslog(LOG_ERR, fmt, ap);
+	else
+		vprintf(fmt, ap);
+
+	va_end(ap);
+}
+
+static const struct SQL_Backend *const backends[] =
+{
+	&SQL_MemoryBackend
+};
+
+/* How long to keep trying to reconnect, unless configured otherwise */
+#define DEFAULT_RECONNECT_USEC 30000000ULL
+
+/* How long a cancelled query may take to end before the session is
+ * abandoned.  */
+#define CANCEL_GRACE_USEC 2000000ULL
+
+#define BACKOFF_MIN_USEC 100000ULL
+#define BACKOFF_MAX_USEC 5000000ULL
+
+/* A server that is known to be down gets one attempt this short per
+ * reconnect, so that callers are not held up for the whole budget.  */
+#define OFFLINE_PROBE_USEC 500000ULL
+
+/* Transactions are run at most this many times */
+#define TRANSACTION_MAX_ATTEMPTS 5
+
+/* Savepoints standing in for transactions begun inside another one */
+#define PIPELINE_SAVEPOINT "p2k12_pipeline"
+#define TRANSACTION_SAVEPOINT "p2k12_transaction"
+
+/* A replica that is down is left alone this long, and may take this
+ * long to connect again.  */
+#define REPLICA_RETRY_USEC 30000000ULL
+#define REPLICA_CONNECT_USEC 1000000ULL
+
+static void FreeQuery(struct query *q);
+
+static void FinishAsync(struct SQL_Connection *conn);
+
+static const char *BeginStatement(enum SQL_Isolation isolation);
+
+static PGTransactionStatusType TransactionStatus(struct SQL_Connection *conn);
+
+static int IsSelect(const char *query);
+
+static struct statement *
+LookupStatement(struct SQL_Connection *conn, const char *format)
+{
+	struct statement *stmt;
+	unsigned int hash = 2166136261u, i;
+	const char *c;
+
+	for (c = format; *c; ++c)
+		hash = (hash ^ (unsigned char) *c) * 16777619u;
+
+	for (i = 0; i < STATEMENT_CACHE_SIZE; ++i)
+	{
+		stmt = &conn->statement_cache[(hash + i) % STATEMENT_CACHE_SIZE];
+
+		if (!stmt->format)
+			break;
+
+		if (!strcmp(stmt->format, format))
+			return stmt;
+	}
+
+	/* Keep the table sparse; overflow statements are simply not cached */
+	if (conn->statement_count >= STATEMENT_CACHE_SIZE * 3 / 4)
+		return 0;
+
+	if (!(stmt->format = strdup(format)))
+		return 0;
+
+	snprintf(stmt->name, sizeof(stmt->name), "p2k12_%u", conn->statement_count++);
+	stmt->prepared = 0;
+
+	return stmt;
+}
+
+static void
+ForgetPreparedStatements(struct SQL_Connection *conn)
+{
+	unsigned int i;
+
+	for (i = 0; i < STATEMENT_CACHE_SIZE; ++i)
+		conn->statement_cache[i].prepared = 0;
+}
+
+void SQL_ConnStatementCacheStats(struct SQL_Connection *conn, unsigned long *hits, unsigned long *misses)
+{
+	*hits = conn->statement_hits;
+	*misses = conn->statement_misses;
+}
+
+static unsigned long long
+Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int
+HistogramBucket(unsigned long long usec)
+{
+	unsigned int exponent = 0;
+
+	if (usec < 2 * HISTOGRAM_SUB)
+		return usec;
+
+	while ((usec >> exponent) > 1)
+		++exponent;
+
+	if (exponent > HISTOGRAM_MAX_EXPONENT)
+		return HISTOGRAM_BUCKETS - 1;
+
+	return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB
+	       + ((usec >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+/* Largest value that falls in the given bucket */
+static unsigned long long
+HistogramUpperBound(unsigned int bucket)
+{
+	unsigned int exponent, sub;
+
+	if (bucket < 2 * HISTOGRAM_SUB)
+		return bucket;
+
+	exponent = bucket / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+	sub = bucket % HISTOGRAM_SUB;
+
+	return ((unsigned long long) (HISTOGRAM_SUB + sub + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+/* Rows returned by a result, or -1 if it is NULL or failed */
+static long
+ResultRows(const PGresult *res)
+{
+	switch (PQresultStatus(res))
+	{
+	case PGRES_COMMAND_OK:
+	case PGRES_TUPLES_OK:
+	case PGRES_SINGLE_TUPLE:
+
+		return PQntuples(res);
+
+	default:
+
+		return -1;
+	}
+}
+
+/* Accounts one execution of stmt, or of an uncached statement if stmt
+ * is NULL.  A row count of -1 means the execution failed.  Returns the
+ * elapsed time in microseconds.  */
+static unsigned long long
+RecordExecution(struct SQL_Connection *conn, struct statement *stmt, unsigned long long start, long rows)
+{
+	struct statement_stats *stats = stmt ? &stmt->stats : &conn->uncached_stats;
+	unsigned long long usec = Now() - start;
+
+	++stats->calls;
+	stats->total_usec += usec;
+
+	if (usec > stats->max_usec)
+		stats->max_usec = usec;
+
+	++stats->histogram[HistogramBucket(usec)];
+
+	if (rows == -1)
+		++stats->errors;
+	else
+		stats->rows += rows;
+
+	/* Anything run on the primary but a plain SELECT outside a
+	 * transaction may have written.  SELECTs calling functions that
+	 * write are refused by the replica, see ReplicaFailed.  */
+	if (conn->replica
+	    && (!stmt || !IsSelect(stmt->format) || TransactionStatus(conn) != PQTRANS_IDLE))
+		conn->write_pending = 1;
+
+	return usec;
+}
+
+static unsigned long long
+Percentile(const struct statement_stats *stats, double fraction)
+{
+	unsigned long long wanted, seen = 0, bound;
+	unsigned int i;
+
+	wanted = (unsigned long long) (fraction * stats->calls + 0.999999);
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		if ((seen += stats->histogram[i]) >= wanted)
+			break;
+	}
+
+	bound = HistogramUpperBound(i);
+
+	return (bound < stats->max_usec) ? bound : stats->max_usec;
+}
+
+static int
+CompareTotalTime(const void *lhs, const void *rhs)
+{
+	const struct statement *a = *(const struct statement **) lhs;
+	const struct statement *b = *(const struct statement **) rhs;
+
+	if (a->stats.total_usec != b->stats.total_usec)
+		return (a->stats.total_usec < b->stats.total_usec) ? 1 : -1;
+
+	return 0;
+}
+
+static void
+PrintStatementStats(FILE *file, const struct statement_stats *stats, const char *format)
+{
+	fprintf(file, "%7lu %6lu %8lu %8.1f %8.1f %8.1f %8.1f  %.60s%s\n",
+	        stats->calls, stats->errors, stats->rows,
+	        Percentile(stats, 0.50) / 1000.0, Percentile(stats, 0.95) / 1000.0,
+	        Percentile(stats, 0.99) / 1000.0, stats->max_usec / 1000.0,
+	        format, (strlen(format) > 60) ? "..." : "");
+}
+
+void SQL_ConnPrintStats(struct SQL_Connection *conn, FILE *file)
+{
+	struct statement *sorted[STATEMENT_CACHE_SIZE];
+	unsigned long errors = conn->uncached_stats.errors;
+	unsigned int i, count = 0;
+
+	for (i = 0; i < STATEMENT_CACHE_SIZE; ++i)
+	{
+		if (conn->statement_cache[i].stats.calls)
+		{
+			sorted[count++] = &conn->statement_cache[i];
+			errors += conn->statement_cache[i].stats.errors;
+		}
+	}
+
+	qsort(sorted, count, sizeof(*sorted), CompareTotalTime);
+
+	fprintf(file, "Statement cache: %lu hits, %lu misses.  Errors: %lu.  Reconnects: %lu\n",
+	        conn->statement_hits, conn->statement_misses, errors, conn->reconnects);
+	fprintf(file, "%7s %6s %8s %8s %8s %8s %8s  %s\n",
+	        "Calls", "Errors", "Rows", "p50 ms", "p95 ms", "p99 ms", "Max ms", "Query");
+
+	for (i = 0; i < count; ++i)
+		PrintStatementStats(file, &sorted[i]->stats, sorted[i]->format);
+
+	if (conn->uncached_stats.calls)
+		PrintStatementStats(file, &conn->uncached_stats, "(not cached)");
+
+	if (conn->replica)
+	{
+		fprintf(file, "\nReplica%s:\n", conn->replica_retry ? " (down)" : "");
+		SQL_ConnPrintStats(conn->replica, file);
+	}
+}
+
+/* Allocates a connection and starts connecting, waiting until done */
+static struct SQL_Connection *
+NewConnection(const char *connect_string)
+{
+	struct SQL_Connection *conn;
+	size_t i;
+
+	if (!(conn = calloc(1, sizeof(*conn))))
+		errx(EXIT_FAILURE, "calloc failed");
+
+	ARRAY_INIT(&conn->pipeline);
+	ARRAY_INIT(&conn->pipeline_sent);
+
+	conn->reconnect_usec = DEFAULT_RECONNECT_USEC;
+	conn->jitter_seed = getpid() ^ time(0);
+	conn->async_conn = conn;
+	strcpy(conn->write_lsn, "0/0");
+
+	if (!(conn->connect_string = strdup(connect_string)))
+		errx(EXIT_FAILURE, "strdup failed");
+
+	conn->backend_fd = -1;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i)
+	{
+		if (!strncmp(connect_string, backends[i]->prefix, strlen(backends[i]->prefix)))
+			conn->backend = backends[i];
+	}
+
+	if (!conn->backend)
+		conn->pg = PQconnectdb(connect_string);
+	else if (!(conn->backend_db = conn->backend->open(connect_string)))
+		snprintf(conn->backend_status.error, sizeof(conn->backend_status.error), "could not open %s", connect_string);
+	else if (-1 == (conn->backend_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)))
+		err(EXIT_FAILURE, "/dev/null");
+
+	return conn;
+}
+
+/* Whether the session is usable, whatever the backend */
+static int
+Connected(struct SQL_Connection *conn)
+{
+	if (conn->backend)
+		return conn->backend_db != 0;
+
+	return PQstatus(conn->pg) == CONNECTION_OK;
+}
+
+static PGTransactionStatusType
+TransactionStatus(struct SQL_Connection *conn)
+{
+	if (conn->backend)
+		return conn->backend_db ? conn->backend->transaction_status(conn->backend_db) : PQTRANS_UNKNOWN;
+
+	return PQtransactionStatus(conn->pg);
+}
+
+static const char *
+ErrorMessage(struct SQL_Connection *conn)
+{
+	if (conn->backend)
+		return conn->backend_status.error;
+
+	return PQerrorMessage(conn->pg);
+}
+
+/* Rows affected by a command.  Backends cannot set the command status
+ * of the results they build, so theirs is kept beside them.  */
+static int
+AffectedRows(struct SQL_Connection *conn, const PGresult *res)
+{
+	const char *count;
+
+	if (!conn->backend)
+		return strtol(PQcmdTuples((PGresult *) res), 0, 0);
+
+	if (!(count = strrchr(conn->backend_status.tag, ' ')))
+		return 0;
+
+	return strtol(count + 1, 0, 10);
+}
+
+static const char *
+CommandStatus(struct SQL_Connection *conn, PGresult *res)
+{
+	if (conn->backend)
+		return conn->backend_status.tag;
+
+	return PQcmdStatus(res);
+}
+
+struct SQL_Connection *SQL_Connect(const char *connect_string)
+{
+	struct SQL_Connection *conn;
+
+	conn = NewConnection(connect_string);
+
+	if (!Connected(conn))
+	{
+		warnx("PostgreSQL connection failed: %s", ErrorMessage(conn));
+
+		SQL_Disconnect(conn);
+
+		return 0;
+	}
+
+	return conn;
+}
+
+struct SQL_Connection *SQL_ConnectBackground(const char *connect_string)
+{
+	struct SQL_Connection *conn;
+
+	conn = NewConnection(connect_string);
+	conn->background = 1;
+
+	if (!Connected(conn))
+	{
+		syslog(LOG_ERR, "PostgreSQL connection failed: %s", ErrorMessage(conn));
+
+		SQL_Disconnect(conn);
+
+		return 0;
+	}
+
+	return conn;
+}
+
+void SQL_Disconnect(struct SQL_Connection *conn)
+{
+	size_t i;
+
+	if (!conn)
+		return;
+
+	for (i = 0; i < ARRAY_COUNT(&conn->pipeline); ++i)
+	{
+		PQclear(ARRAY_GET(&conn->pipeline, i).result);
+		FreeQuery(&ARRAY_GET(&conn->pipeline, i).q);
+	}
+
+	ARRAY_FREE(&conn->pipeline);
+	ARRAY_FREE(&conn->pipeline_sent);
+
+	for (i = 0; i < STATEMENT_CACHE_SIZE; ++i)
+		free(conn->statement_cache[i].format);
+
+	if (conn->async_state == ASYNC_PREPARING || conn->async_state == ASYNC_EXECUTING)
+		FreeQuery(&conn->async_query);
+
+	PQclear(conn->async_result);
+	PQclear(conn->pgresult);
+	PQfinish(conn->pg);
+
+	if (conn->backend_db)
+		conn->backend->close(conn->backend_db);
+
+	if (conn->backend_fd != -1)
+		close(conn->backend_fd);
+
+	if (conn->plan_pg)
+		PQfinish(conn->plan_pg);
+
+	free(conn->plan_query);
+	free(conn->slow_log_path);
+	free(conn->connect_string);
+	free(conn->account);
+
+	SQL_Disconnect(conn->replica);
+
+	free(conn);
+}
 
 void SQL_Init(const char *connect_string)
 {
 	printf("SQL_Init: %s\n", connect_string);
-	pg = PQconnectdb(connect_string);
 
-	if (PQstatus(pg) != CONNECTION_OK)
-		errx(EXIT_FAILURE, "PostgreSQL connection failed: %s", PQerrorMessage(pg));
+	if (!(default_connection = SQL_Connect(connect_string)))
+		exit(EXIT_FAILURE);
+}
+
+struct SQL_Connection *SQL_DefaultConnection()
+{
+	return default_connection;
+}
+
+void SQL_SetDefaultConnection(struct SQL_Connection *conn)
+{
+	default_connection = conn;
 }
 
+static PGresult *ExecuteF(struct SQL_Connection *conn, const char *fmt, ...);
+
+static int IsRetryable(const char *sqlstate);
+
 static
-void SetP2k12Account()
+int SetP2k12Account(struct SQL_Connection *conn)
 {
-  char buf[1000];
+  PGresult *res;
 
-  if (current_account)
+  if (conn->account)
   {
-    snprintf(buf, 1000, "SET \"p2k12.account\" TO %s", current_account);
-
-    if (-1 == SQL_Query(buf))
-    {
-      errx (EXIT_FAILURE, "Could not set current user on session %s", current_account);
-    }
+    /* SET cannot take parameters; set_config() can, which keeps the
+     * statement text constant and lets it be prepared once.  */
+    res = ExecuteF(conn, "SELECT set_config('p2k12.account', %s, false)", conn->account);
   }
   else
   {
-    if (-1 == SQL_Query("SET \"p2k12.account\" TO DEFAULT"))
-    {
-      errx (EXIT_FAILURE, "Could not set current user on session");
-    }
+    res = ExecuteF(conn, "SET \"p2k12.account\" TO DEFAULT");
   }
+
+  if (!res)
+    return -1;
+
+  PQclear(res);
+
+  return 0;
 }
 
-void SQL_SetP2k12Account(const char *account)
+void SQL_ConnSetP2k12Account(struct SQL_Connection *conn, const char *account)
 {
-  free(current_account);
-  current_account = NULL;
+  free(conn->account);
+  conn->account = NULL;
 
   if (account)
   {
-    current_account = strdup (account);
+    conn->account = strdup (account);
   }
   else
   {
-    current_account = NULL;
+    conn->account = NULL;
   }
 
-  SetP2k12Account();
+  if (-1 == SetP2k12Account(conn))
+  {
+    if (account)
+      errx (EXIT_FAILURE, "Could not set current user on session %s", account);
+    else
+      errx (EXIT_FAILURE, "Could not set current user on session");
+  }
 }
 
-int SQL_Query(const char *fmt, ...)
+void SQL_SetP2k12Account(const char *account)
 {
-	char query[4096];
-	static char numbufs[10][128];
-	const char *args[10];
-	int lengths[10];
-	int formats[10];
-	const char *c;
-	int argcount = 0;
-	va_list ap;
-	int rowsaffected, is_size_t = 0;
+  SQL_ConnSetP2k12Account(default_connection, account);
+}
+
+static void
+FreeQuery(struct query *q)
+{
+	ARRAY_FREE(&q->text);
+	ARRAY_FREE(&q->args);
+	ARRAY_FREE(&q->lengths);
+	ARRAY_FREE(&q->formats);
+	ARRAY_FREE(&q->numbers);
+	ARRAY_FREE(&q->secret);
+}
 
-	char *o, *end;
+static int
+FormatQuery(struct SQL_Connection *conn, struct query *q, const char *fmt, va_list ap)
+{
+	struct number *number;
+	const char *c;
+	size_t argmax = 0;
+	int is_size_t = 0;
 
-	o = query;
-	end = o + sizeof(query);
+	ARRAY_INIT(&q->text);
+	ARRAY_INIT(&q->args);
+	ARRAY_INIT(&q->lengths);
+	ARRAY_INIT(&q->formats);
+	ARRAY_INIT(&q->numbers);
+	ARRAY_INIT(&q->secret);
 
-	if (pgresult)
+	for (c = fmt; *c; ++c)
 	{
-		PQclear(pgresult);
-		pgresult = 0;
+		if (c[0] == '%')
+		{
+			if (c[1] == '%')
+				++c;
+			else
+				++argmax;
+		}
 	}
 
-	va_start(ap, fmt);
+	/* Each "$n" is at most as long as "%" plus the digits of n */
+	ARRAY_RESERVE(&q->text, strlen(fmt) + argmax * 16 + 1);
+	ARRAY_RESERVE(&q->args, argmax);
+	ARRAY_RESERVE(&q->lengths, argmax);
+	ARRAY_RESERVE(&q->formats, argmax);
+	ARRAY_RESERVE(&q->numbers, argmax);
+	ARRAY_RESERVE(&q->secret, argmax);
+
+	if (-1 == ARRAY_RESULT(&q->text) || -1 == ARRAY_RESULT(&q->args)
+	    || -1 == ARRAY_RESULT(&q->lengths) || -1 == ARRAY_RESULT(&q->formats)
+	    || -1 == ARRAY_RESULT(&q->numbers) || -1 == ARRAY_RESULT(&q->secret))
+		errx(EXIT_FAILURE, "ARRAY_RESERVE failed");
 
 	for (c = fmt; *c; )
 	{
 		if ('%' == c[0] && '%' == c[1])
 		{
-			assert(o + 2 < end);
-
-			*o++ = *c++;
-			*o++ = *c++;
+			ARRAY_ADD(&q->text, *c++);
+			ARRAY_ADD(&q->text, *c++);
 		}
 		else if ('%' == c[0])
 		{
+			const char *arg;
+			int length, format = 0, secret = 0;
+			char placeholder[16];
+
 			is_size_t = 0;
 
 			++c;
@@ -116,63 +812,66 @@ int SQL_Query(const char *fmt, ...)
 				++c;
 			}
 
+			number = &ARRAY_GET(&q->numbers, ARRAY_COUNT(&q->args));
+
 			switch (*c)
 			{
+			case 'S':
+
+				secret = 1;
+
+				/* fall through */
+
 			case 's':
 
-				args[argcount] = va_arg(ap, const char*);
-				if (args[argcount])
-					lengths[argcount] = strlen(args[argcount]);
+				arg = va_arg(ap, const char*);
+				if (arg)
+					length = strlen(arg);
 				else
-					lengths[argcount] = 0;
-				formats[argcount] = 0;
+					length = 0;
 
 				break;
 
 			case 'd':
 
-				snprintf(numbufs[argcount], 127, "%d", va_arg(ap, int));
-				args[argcount] = numbufs[argcount];
-				lengths[argcount] = strlen(args[argcount]);
-				formats[argcount] = 0;
+				snprintf(number->text, 127, "%d", va_arg(ap, int));
+				arg = number->text;
+				length = strlen(arg);
 
 				break;
 
 			case 'u':
 
 				if (is_size_t)
-					snprintf(numbufs[argcount], 127, "%llu", (unsigned long long) va_arg(ap, size_t));
+					snprintf(number->text, 127, "%llu", (unsigned long long) va_arg(ap, size_t));
 				else
-					snprintf(numbufs[argcount], 127, "%u", va_arg(ap, unsigned int));
-				args[argcount] = numbufs[argcount];
-				lengths[argcount] = strlen(args[argcount]);
-				formats[argcount] = 0;
+					snprintf(number->text, 127, "%u", va_arg(ap, unsigned int));
+				arg = number->text;
+				length = strlen(arg);
 
 				break;
 
 			case 'l':
 
-				snprintf(numbufs[argcount], 127, "%lld", va_arg(ap, long long));
-				args[argcount] = numbufs[argcount];
-				lengths[argcount] = strlen(args[argcount]);
-				formats[argcount] = 0;
+				snprintf(number->text, 127, "%lld", va_arg(ap, long long));
+				arg = number->text;
+				length = strlen(arg);
 
 				break;
 
 			case 'f':
 
-				snprintf(numbufs[argcount], 127, "%f", va_arg(ap, double));
-				args[argcount] = numbufs[argcount];
-				lengths[argcount] = strlen(args[argcount]);
-				formats[argcount] = 0;
+				snprintf(number->text, 127, "%f", va_arg(ap, double));
+				arg = number->text;
+				length = strlen(arg);
 
 				break;
 
 			case 'B':
 
-				args[argcount] = va_arg(ap, const char *);
-				lengths[argcount] = va_arg(ap, size_t);
-				formats[argcount] = 1;
+				arg = va_arg(ap, const char *);
+				length = va_arg(ap, size_t);
+				format = 1;
 
 				break;
 
@@ -180,83 +879,2818 @@ int SQL_Query(const char *fmt, ...)
 
 				assert(!"unknown format character");
 
+				FreeQuery(q);
+
 				return -1;
 			}
 
 			++c;
-			++argcount;
 
-			assert(o + 3 < end);
+			ARRAY_ADD(&q->args, arg);
+			ARRAY_ADD(&q->lengths, length);
+			ARRAY_ADD(&q->formats, format);
+			ARRAY_ADD(&q->secret, secret);
 
-			*o++ = '$';
-			if (argcount >= 10)
-				*o++ = '0' + (argcount / 10);
-			*o++ = '0' + (argcount % 10);
+			snprintf(placeholder, sizeof(placeholder), "$%zu", ARRAY_COUNT(&q->args));
+			ARRAY_ADD_SEVERAL(&q->text, placeholder, strlen(placeholder));
 		}
 		else
 		{
-			assert(o + 1 < end);
-
-			*o++ = *c++;
+			ARRAY_ADD(&q->text, *c++);
 		}
 	}
 
-	va_end(ap);
+	ARRAY_ADD(&q->text, 0);
 
-	*o = 0;
+	q->stmt = LookupStatement(conn, fmt);
+	q->format = fmt;
 
-	for (;;)
-	{
-		pgresult = PQexecParams(pg, query, argcount, 0, args, lengths, formats, 0);
+	return 0;
+}
 
-		if (PQresultStatus(pgresult) != PGRES_FATAL_ERROR)
-			break;
+#define QUERY_TEXT(q) (&ARRAY_GET(&(q)->text, 0))
+#define QUERY_ARGS(q) ARRAY_COUNT(&(q)->args), ARRAY_DATA(&(q)->args), ARRAY_DATA(&(q)->lengths), ARRAY_DATA(&(q)->formats)
 
-		PQclear(pgresult);
-		pgresult = 0;
+/* Runs a query on a backend other than libpq, which completes it at once */
+static PGresult *
+BackendExecute(struct SQL_Connection *conn, struct query *q)
+{
+	PGresult *res;
 
-		printf ("PostgreSQL query failed: %s\n", PQerrorMessage(pg));
-#if P2K12_MODE == dev
-		printf ("Failed query: %s\n", query);
-#endif
+	memset(&conn->backend_status, 0, sizeof(conn->backend_status));
 
-		if (PQstatus(pg) != CONNECTION_OK)
-		{
-			syslog(LOG_INFO, "Resetting database connection");
+	res = conn->backend->execute(conn->backend_db, q->format, (const char *const *) ARRAY_DATA(&q->args),
+	                             &conn->backend_status);
 
-			for (;;)
-			{
-				PQreset(pg);
+	if (!res && !conn->sqlstate[0])
+		memcpy(conn->sqlstate, conn->backend_status.sqlstate, sizeof(conn->sqlstate));
 
-				if (PQstatus(pg) == CONNECTION_OK)
-					break;
+	return res;
+}
 
-				usleep (1000000);
-			}
+/* Deadline for a statement started now: the statement timeout, or the
+ * end of the current command if that comes first.  Zero means none.  */
+static unsigned long long
+StatementDeadline(struct SQL_Connection *conn)
+{
+	unsigned long long deadline = 0;
 
-			syslog(LOG_INFO, "Database connection OK");
+	if (conn->statement_usec)
+		deadline = Now() + conn->statement_usec;
+
+	if (conn->command_deadline && (!deadline || conn->command_deadline < deadline))
+		deadline = conn->command_deadline;
+
+	return deadline;
+}
+
+/* Waits for the socket until the deadline.  Returns 0 when ready and -1
+ * on timeout.  */
+static int
+WaitSocket(PGconn *pg, short events, unsigned long long deadline)
+{
+	struct pollfd pfd;
+	unsigned long long now;
+	int timeout = -1;
+
+	for (;;)
+	{
+		if (deadline)
+		{
+			if ((now = Now()) >= deadline)
+				return -1;
+
+			timeout = (deadline - now + 999) / 1000;
+		}
+
+		pfd.fd = PQsocket(pg);
+		pfd.events = events;
+
+		switch (poll(&pfd, 1, timeout))
+		{
+		case -1:
+
+			if (errno != EINTR && errno != EAGAIN)
+				err(EXIT_FAILURE, "poll failed");
+
+			break;
+
+		case 0:
+
+			break;
+
+		default:
+
+			return 0;
+		}
+	}
+}
+
+static void
+Cancel(struct SQL_Connection *conn)
+{
+	PGcancel *cancel;
+	char error[256];
+
+	if (!(cancel = PQgetCancel(conn->pg)))
+		return;
+
+	if (!PQcancel(cancel, error, sizeof(error)))
+		syslog(LOG_WARNING, "Cancelling query failed: %s", error);
+
+	PQfreeCancel(cancel);
+}
+
+/* Waits until a result can be read without blocking.  When the deadline
+ * passes, the query is cancelled and given a short grace period to end;
+ * if it does not, the session is marked for reset and -1 returned.  */
+static int
+AwaitResult(struct SQL_Connection *conn, unsigned long long *deadline, int *timed_out)
+{
+	while (PQisBusy(conn->pg))
+	{
+		if (-1 == WaitSocket(conn->pg, POLLIN, *deadline))
+		{
+			if (*timed_out)
+			{
+				conn->needs_reset = 1;
+
+				return -1;
+			}
+
+			Cancel(conn);
+
+			*timed_out = 1;
+			*deadline = Now() + CANCEL_GRACE_USEC;
 
-      SetP2k12Account();
 			continue;
 		}
 
+		if (!PQconsumeInput(conn->pg))
+			break;
+	}
+
+	return 0;
+}
+
+/* Like PQexec after a PQsend* call, but bounded by the deadline.  Returns
+ * the last result, or NULL if the query had to be abandoned.  */
+static PGresult *
+WaitResult(struct SQL_Connection *conn, unsigned long long deadline, int *timed_out)
+{
+	PGresult *res, *result = 0;
+
+	for (;;)
+	{
+		if (-1 == AwaitResult(conn, &deadline, timed_out))
+		{
+			PQclear(result);
+
+			return 0;
+		}
+
+		if (!(res = PQgetResult(conn->pg)))
+			return result;
+
+		PQclear(result);
+		result = res;
+	}
+}
+
+/* Resets the connection without blocking past the deadline */
+static int
+Reset(struct SQL_Connection *conn, unsigned long long deadline)
+{
+	PostgresPollingStatusType status = PGRES_POLLING_WRITING;
+
+	if (!PQresetStart(conn->pg))
+		return -1;
+
+	for (;;)
+	{
+		switch (status)
+		{
+		case PGRES_POLLING_OK:
+
+			return 0;
+
+		case PGRES_POLLING_READING:
+
+			if (-1 == WaitSocket(conn->pg, POLLIN, deadline))
+				return -1;
+
+			break;
+
+		case PGRES_POLLING_WRITING:
+
+			if (-1 == WaitSocket(conn->pg, POLLOUT, deadline))
+				return -1;
+
+			break;
+
+		default:
+
+			return -1;
+		}
+
+		status = PQresetPoll(conn->pg);
+	}
+}
+
+/* Tries to reconnect, backing off exponentially with jitter, until the
+ * reconnect budget or the current command runs out.  Restores session
+ * state on success.  Returns -1 on failure.  */
+static int
+Reconnect(struct SQL_Connection *conn)
+{
+	unsigned long long deadline = 0, delay = BACKOFF_MIN_USEC, backoff;
+
+	/* A replica is not waited for; see ConnectReplica */
+	if (conn->reconnecting || conn->is_replica)
+		return -1;
+
+	syslog(LOG_INFO, "Resetting database connection");
+
+	++conn->reconnects;
+
+	if (conn->reconnect_usec)
+		deadline = Now() + conn->reconnect_usec;
+
+	if (conn->command_deadline && (!deadline || conn->command_deadline < deadline))
+		deadline = conn->command_deadline;
+
+	if (conn->offline_since && (!deadline || Now() + OFFLINE_PROBE_USEC < deadline))
+		deadline = Now() + OFFLINE_PROBE_USEC;
+
+	while (-1 == Reset(conn, deadline))
+	{
+		backoff = delay + rand_r(&conn->jitter_seed) % (delay / 2 + 1);
+
+		if (conn->offline_since)
+			return -1;
+
+		if (deadline && Now() + backoff >= deadline)
+		{
+			syslog(LOG_WARNING, "Giving up on database connection: %s", PQerrorMessage(conn->pg));
+			Report(conn, "Database connection lost; please try again later\n");
+
+			conn->offline_since = Now();
+
+			return -1;
+		}
+
+		usleep (backoff);
+
+		if ((delay *= 2) > BACKOFF_MAX_USEC)
+			delay = BACKOFF_MAX_USEC;
+	}
+
+	syslog(LOG_INFO, "Database connection OK");
+
+	conn->needs_reset = 0;
+	conn->offline_since = 0;
+
+	/* Prepared statements do not survive the new session */
+	ForgetPreparedStatements(conn);
+
+	conn->reconnecting = 1;
+
+	if (-1 == SetP2k12Account(conn))
+	{
+		conn->reconnecting = 0;
+
+		/* Never run queries as the wrong account */
+		conn->needs_reset = 1;
+
 		return -1;
 	}
 
-	tuple_count = PQntuples(pgresult);
-	rowsaffected = strtol(PQcmdTuples(pgresult), 0, 0);
+	conn->reconnecting = 0;
 
-	return rowsaffected;
+	return 0;
 }
 
-int SQL_RowCount()
+static int
+InTransactionBlock(struct SQL_Connection *conn)
 {
-	return tuple_count;
+	return TransactionStatus(conn) == PQTRANS_INTRANS
+	       || TransactionStatus(conn) == PQTRANS_INERROR;
 }
 
-const char *SQL_Value(unsigned int row, unsigned int column)
+/* Makes sure the connection can take a new query */
+static int
+EnsureConnection(struct SQL_Connection *conn)
+{
+	if (Connected(conn) && !conn->needs_reset)
+		return 0;
+
+	return Reconnect(conn);
+}
+
+void SQL_ConnSetTimeouts(struct SQL_Connection *conn, unsigned int statement_ms, unsigned int reconnect_ms)
+{
+	conn->statement_usec = statement_ms * 1000ULL;
+	conn->reconnect_usec = reconnect_ms * 1000ULL;
+
+	if (conn->replica)
+		SQL_ConnSetTimeouts(conn->replica, statement_ms, reconnect_ms);
+}
+
+void SQL_SetTimeouts(unsigned int statement_ms, unsigned int reconnect_ms)
+{
+	SQL_ConnSetTimeouts(default_connection, statement_ms, reconnect_ms);
+}
+
+void SQL_ConnSetCommandDeadline(struct SQL_Connection *conn, unsigned int budget_ms)
+{
+	conn->command_deadline = budget_ms ? Now() + budget_ms * 1000ULL : 0;
+
+	if (conn->replica)
+		conn->replica->command_deadline = conn->command_deadline;
+}
+
+void SQL_SetCommandDeadline(unsigned int budget_ms)
 {
-	assert(row < (unsigned int) tuple_count);
+	SQL_ConnSetCommandDeadline(default_connection, budget_ms);
+}
+
+int SQL_ConnOffline(struct SQL_Connection *conn)
+{
+	return conn->offline_since != 0;
+}
+
+int SQL_Offline()
+{
+	return SQL_ConnOffline(default_connection);
+}
+
+int SQL_ConnUnavailable(struct SQL_Connection *conn)
+{
+	return conn->unavailable;
+}
+
+int SQL_Unavailable()
+{
+	return SQL_ConnUnavailable(default_connection);
+}
+
+/* Slow query log.  Plans are captured by running EXPLAIN with the same
+ * parameters on a second connection, whose result is picked up by later
+ * calls so the session never waits for it.  */
+
+static void
+LogSlowQuery(struct SQL_Connection *conn, const char *fmt, ...)
+{
+	va_list ap;
+	FILE *file;
+	char date[32];
+	time_t now;
+
+	va_start(ap, fmt);
+	vsyslog(LOG_WARNING, fmt, ap);
+	va_end(ap);
+
+	if (!conn->slow_log_path || !(file = fopen(conn->slow_log_path, "a")))
+		return;
+
+	now = time(0);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+	fprintf(file, "%s ", date);
+	va_start(ap, fmt);
+	vfprintf(file, fmt, ap);
+	va_end(ap);
+	fputc('\n', file);
+
+	fclose(file);
+}
+
+static void
+PlanDone(struct SQL_Connection *conn)
+{
+	free(conn->plan_query);
+	conn->plan_query = 0;
+}
+
+static void
+PollPlan(struct SQL_Connection *conn)
+{
+	PGresult *res;
+	int i;
+
+	if (!conn->plan_query)
+		return;
+
+	if (!PQconsumeInput(conn->plan_pg))
+	{
+		LogSlowQuery(conn, "Plan capture failed: %s", PQerrorMessage(conn->plan_pg));
+
+		PQfinish(conn->plan_pg);
+		conn->plan_pg = 0;
+		PlanDone(conn);
+
+		return;
+	}
+
+	while (!PQisBusy(conn->plan_pg))
+	{
+		if (!(res = PQgetResult(conn->plan_pg)))
+		{
+			PlanDone(conn);
+
+			return;
+		}
+
+		if (PQresultStatus(res) == PGRES_TUPLES_OK)
+		{
+			LogSlowQuery(conn, "Plan for slow query %.60s:", conn->plan_query);
+
+			for (i = 0; i < PQntuples(res); ++i)
+				LogSlowQuery(conn, "  %s", PQgetvalue(res, i, 0));
+		}
+		else
+			LogSlowQuery(conn, "Plan capture failed: %s", PQresultErrorMessage(res));
+
+		PQclear(res);
+	}
+}
+
+static int
+IsSelect(const char *query)
+{
+	while (isspace((unsigned char) *query) || *query == '(')
+		++query;
+
+	return !strncasecmp(query, "SELECT", 6);
+}
+
+static void
+CapturePlan(struct SQL_Connection *conn, const struct query *q)
+{
+	static const char *keywords[] = { "dbname", "options", 0 };
+	const char *values[] = { conn->connect_string, "-c default_transaction_read_only=on", 0 };
+	const char **args;
+	char *explain;
+	size_t i;
+
+	PollPlan(conn);
+
+	/* One plan at a time */
+	if (conn->plan_query)
+		return;
+
+	if (!conn->plan_pg)
+	{
+		conn->plan_pg = PQconnectdbParams(keywords, values, 1);
+
+		if (PQstatus(conn->plan_pg) != CONNECTION_OK)
+		{
+			LogSlowQuery(conn, "Plan capture failed: %s", PQerrorMessage(conn->plan_pg));
+
+			PQfinish(conn->plan_pg);
+			conn->plan_pg = 0;
 
-	return PQgetvalue(pgresult, row, column);
+			return;
+		}
+	}
+
+	/* ANALYZE runs the statement, which only a SELECT may do on a
+	 * read-only connection.  */
+	if (!(explain = malloc(strlen(QUERY_TEXT(q)) + 32)))
+		return;
+
+	/* Secrets are not sent again; the plan is made for NULL instead */
+	if (!(args = calloc(ARRAY_COUNT(&q->args) + 1, sizeof(*args))))
+	{
+		free(explain);
+
+		return;
+	}
+
+	for (i = 0; i < ARRAY_COUNT(&q->args); ++i)
+		args[i] = ARRAY_GET(&q->secret, i) ? 0 : ARRAY_GET(&q->args, i);
+
+	sprintf(explain, "EXPLAIN %s%s", IsSelect(QUERY_TEXT(q)) ? "(ANALYZE, BUFFERS) " : "", QUERY_TEXT(q));
+
+	/* libpq copies the parameters into its send buffer */
+	if (PQsendQueryParams(conn->plan_pg, explain, ARRAY_COUNT(&q->args), 0,
+	                      args, ARRAY_DATA(&q->lengths), ARRAY_DATA(&q->formats), 0))
+		conn->plan_query = strdup(QUERY_TEXT(q));
+	else
+		LogSlowQuery(conn, "Plan capture failed: %s", PQerrorMessage(conn->plan_pg));
+
+	free(args);
+	free(explain);
+}
+
+static void
+SlowQuery(struct SQL_Connection *conn, const struct query *q, unsigned long long usec)
+{
+	char *parameters = 0;
+	size_t size, i;
+	FILE *f;
+
+	if (!(f = open_memstream(&parameters, &size)))
+		return;
+
+	for (i = 0; i < ARRAY_COUNT(&q->args); ++i)
+	{
+		if (ARRAY_GET(&q->secret, i))
+			fprintf(f, "%s$%zu = <secret>", i ? ", " : "", i + 1);
+		else if (ARRAY_GET(&q->formats, i))
+			fprintf(f, "%s$%zu = <%d bytes>", i ? ", " : "", i + 1, ARRAY_GET(&q->lengths, i));
+		else
+			fprintf(f, "%s$%zu = '%s'", i ? ", " : "", i + 1, ARRAY_GET(&q->args, i));
+	}
+
+	fclose(f);
+
+	LogSlowQuery(conn, "Slow query (%.1f ms): %s; parameters: %s",
+	             usec / 1000.0, QUERY_TEXT(q), *parameters ? parameters : "none");
+
+	free(parameters);
+
+	CapturePlan(conn, q);
+}
+
+void SQL_ConnSetSlowQueryLog(struct SQL_Connection *conn, unsigned int threshold_ms, const char *path)
+{
+	conn->slow_usec = (unsigned long long) threshold_ms * 1000;
+
+	free(conn->slow_log_path);
+	conn->slow_log_path = path ? strdup(path) : 0;
+
+	if (conn->replica)
+		SQL_ConnSetSlowQueryLog(conn->replica, threshold_ms, path);
+}
+
+void SQL_SetSlowQueryLog(unsigned int threshold_ms, const char *path)
+{
+	SQL_ConnSetSlowQueryLog(default_connection, threshold_ms, path);
+}
+
+/* On a replica, a query failing because the replica went away or because
+ * the statement writes is run again on the primary, and not reported.  */
+static int
+Failover(struct SQL_Connection *conn, const char *sqlstate)
+{
+	if (!conn->is_replica)
+		return 0;
+
+	/* 25006: read_only_sql_transaction */
+	if (PQstatus(conn->pg) != CONNECTION_OK || conn->needs_reset
+	    || (sqlstate && !strcmp(sqlstate, "25006")))
+		conn->failover = 1;
+
+	return conn->failover;
+}
+
+/* Runs a query, reconnecting as needed.  Results are in text format if
+ * result_format is 0 and binary if it is 1.  Returns NULL on failure */
+static PGresult *
+Execute(struct SQL_Connection *conn, int result_format, const char *fmt, va_list ap)
+{
+	struct query q;
+	struct statement *stmt;
+	PGresult *res = 0;
+	unsigned long long start, usec, deadline;
+	int reprepared = 0, prepared, timed_out = 0, in_block, ends_block;
+	const char *sqlstate;
+
+	assert(!PQpipelineStatus(conn->pg));
+
+	FinishAsync(conn);
+	PollPlan(conn);
+
+	ends_block = !strcmp(fmt, "COMMIT") || !strcmp(fmt, "ROLLBACK");
+
+	if (conn->transaction_lost)
+	{
+		/* Running the rest of the transaction on a new session would
+		 * apply it partially.  ROLLBACK or COMMIT ends the block.  */
+		if (conn->in_transaction || strcmp(fmt, "ROLLBACK"))
+		{
+			if (!conn->in_transaction)
+				Report(conn, "PostgreSQL query failed: the transaction was lost with the database connection\n");
+
+			if (ends_block && !conn->in_transaction)
+				conn->transaction_lost = 0;
+
+			return 0;
+		}
+
+		conn->transaction_lost = 0;
+	}
+
+	in_block = InTransactionBlock(conn);
+
+	start = Now();
+	deadline = StatementDeadline(conn);
+
+	conn->unavailable = 0;
+
+	if (-1 == FormatQuery(conn, &q, fmt, ap))
+		return 0;
+
+	stmt = q.stmt;
+
+	if (conn->backend)
+	{
+		if (!(res = BackendExecute(conn, &q))
+		    && (!conn->in_transaction || !IsRetryable(conn->backend_status.sqlstate)))
+		{
+			Report(conn, "PostgreSQL query failed: %s\n", ErrorMessage(conn));
+#if P2K12_MODE == dev
+			Report(conn, "Failed query: %s\n", QUERY_TEXT(&q));
+#endif
+		}
+
+		RecordExecution(conn, stmt, start, ResultRows(res));
+		FreeQuery(&q);
+
+		return res;
+	}
+
+	for (;;)
+	{
+		if (-1 == EnsureConnection(conn))
+		{
+			res = 0;
+
+			break;
+		}
+
+		if (stmt && !stmt->prepared)
+		{
+			res = PQsendPrepare(conn->pg, stmt->name, QUERY_TEXT(&q), ARRAY_COUNT(&q.args), 0)
+			      ? WaitResult(conn, deadline, &timed_out) : 0;
+
+			if ((prepared = (PQresultStatus(res) == PGRES_COMMAND_OK)))
+			{
+				PQclear(res);
+				stmt->prepared = 1;
+				++conn->statement_misses;
+			}
+		}
+		else
+		{
+			prepared = 1;
+
+			if (stmt)
+				++conn->statement_hits;
+		}
+
+		if (prepared)
+		{
+			if (stmt)
+				res = PQsendQueryPrepared(conn->pg, stmt->name, QUERY_ARGS(&q), result_format)
+				      ? WaitResult(conn, deadline, &timed_out) : 0;
+			else
+				res = PQsendQueryParams(conn->pg, QUERY_TEXT(&q), ARRAY_COUNT(&q.args), 0,
+				                        ARRAY_DATA(&q.args), ARRAY_DATA(&q.lengths), ARRAY_DATA(&q.formats), result_format)
+				      ? WaitResult(conn, deadline, &timed_out) : 0;
+		}
+
+		if (PQresultStatus(res) != PGRES_FATAL_ERROR)
+			break;
+
+		sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+
+		/* The server forgot our statement, e.g. after DISCARD ALL */
+		if (stmt && stmt->prepared && !reprepared)
+		{
+			if (sqlstate && !strcmp(sqlstate, "26000"))
+			{
+				PQclear(res);
+				res = 0;
+				stmt->prepared = 0;
+				reprepared = 1;
+
+				continue;
+			}
+		}
+
+		if (sqlstate && !conn->sqlstate[0])
+			strncat(conn->sqlstate, sqlstate, sizeof(conn->sqlstate) - 1);
+
+		/* SQL_ConnTransaction retries these quietly */
+		if ((!conn->in_transaction || !IsRetryable(sqlstate)) && !Failover(conn, sqlstate))
+		{
+			if (timed_out)
+				Report(conn, "PostgreSQL query failed: timed out\n");
+			else
+				Report(conn, "PostgreSQL query failed: %s\n", PQerrorMessage(conn->pg));
+#if P2K12_MODE == dev
+			Report(conn, "Failed query: %s\n", QUERY_TEXT(&q));
+#endif
+		}
+
+		PQclear(res);
+		res = 0;
+
+		if (PQstatus(conn->pg) == CONNECTION_OK && !conn->needs_reset)
+			break;
+
+		/* A statement inside a transaction must not run on its own */
+		if (in_block)
+		{
+			if (!ends_block)
+				conn->transaction_lost = 1;
+
+			break;
+		}
+
+		/* Timed out queries are not retried */
+		if (!timed_out && (!deadline || Now() < deadline) && 0 == Reconnect(conn))
+			continue;
+
+		break;
+	}
+
+	if (!res && (timed_out || PQstatus(conn->pg) != CONNECTION_OK || conn->needs_reset))
+		conn->unavailable = 1;
+
+	usec = RecordExecution(conn, stmt, start, ResultRows(res));
+
+	if (conn->slow_usec && usec >= conn->slow_usec)
+		SlowQuery(conn, &q, usec);
+
+	FreeQuery(&q);
+
+	return res;
+}
+
+static PGresult *
+ExecuteF(struct SQL_Connection *conn, const char *fmt, ...)
+{
+	PGresult *res;
+	va_list ap;
+
+	va_start(ap, fmt);
+	res = Execute(conn, 0, fmt, ap);
+	va_end(ap);
+
+	return res;
+}
+
+/* Read replica.  Plain SELECTs outside transactions go to the replica
+ * once it has replayed this session's last write, as found with
+ * pg_current_wal_lsn() on the primary, and lags it by at most half the
+ * staleness bound.  That answer is reused for the other half.  */
+
+static void
+ReplicaDown(struct SQL_Connection *conn)
+{
+	syslog(LOG_WARNING, "Replica unavailable, reading from the primary: %s", PQerrorMessage(conn->replica->pg));
+
+	conn->replica_retry = Now() + REPLICA_RETRY_USEC;
+}
+
+static int
+ConnectReplica(struct SQL_Connection *conn)
+{
+	struct SQL_Connection *replica = conn->replica;
+
+	if (-1 == Reset(replica, Now() + REPLICA_CONNECT_USEC))
+	{
+		ReplicaDown(conn);
+
+		return -1;
+	}
+
+	syslog(LOG_INFO, "Replica connection OK");
+
+	ForgetPreparedStatements(replica);
+	replica->needs_reset = 0;
+
+	conn->replica_retry = 0;
+	conn->replica_checked = 0;
+
+	return 0;
+}
+
+static int
+ReplicaFresh(struct SQL_Connection *conn)
+{
+	PGresult *res;
+	unsigned long long now = Now(), half = conn->replica_lag_usec / 2;
+
+	if (conn->write_pending)
+	{
+		if (!(res = ExecuteF(conn, "SELECT pg_current_wal_lsn()")))
+			return 0;
+
+		snprintf(conn->write_lsn, sizeof(conn->write_lsn), "%s", PQgetvalue(res, 0, 0));
+		PQclear(res);
+
+		conn->write_pending = 0;
+		conn->replica_checked = 0;
+	}
+
+	if (conn->replica_checked && now - conn->replica_checked < half)
+		return conn->replica_fresh;
+
+	/* A replica with nothing left to replay is as fresh as it gets */
+	res = ExecuteF(conn->replica,
+	               "SELECT pg_last_wal_replay_lsn() >= %s::PG_LSN"
+	               " AND (pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn()"
+	               " OR NOW() - pg_last_xact_replay_timestamp() <= %l * INTERVAL '1 microsecond')",
+	               conn->write_lsn, (long long) half);
+
+	conn->replica->failover = 0;
+
+	if (!res)
+	{
+		if (PQstatus(conn->replica->pg) != CONNECTION_OK || conn->replica->needs_reset)
+			ReplicaDown(conn);
+
+		return 0;
+	}
+
+	conn->replica_fresh = !strcmp(PQgetvalue(res, 0, 0), "t");
+	conn->replica_checked = now;
+
+	PQclear(res);
+
+	return conn->replica_fresh;
+}
+
+/* Picks the connection to run a query on */
+static struct SQL_Connection *
+Route(struct SQL_Connection *conn, const char *fmt)
+{
+	if (!conn->replica || !IsSelect(fmt) || conn->in_transaction || conn->transaction_lost
+	    || PQpipelineStatus(conn->pg) || InTransactionBlock(conn))
+		return conn;
+
+	if (conn->replica_retry && (Now() < conn->replica_retry || -1 == ConnectReplica(conn)))
+		return conn;
+
+	return ReplicaFresh(conn) ? conn->replica : conn;
+}
+
+/* After a query on the replica: returns 1 if it is to be run again on
+ * the primary.  */
+static int
+ReplicaFailed(struct SQL_Connection *conn)
+{
+	struct SQL_Connection *replica = conn->replica;
+	int failover = replica->failover;
+
+	replica->failover = 0;
+
+	/* Run again on the primary, the statement may write there */
+	if (failover)
+		conn->write_pending = 1;
+
+	if (PQstatus(replica->pg) != CONNECTION_OK || replica->needs_reset)
+		ReplicaDown(conn);
+
+	return failover;
+}
+
+static PGresult *
+RoutedExecute(struct SQL_Connection *conn, int result_format, const char *fmt, va_list ap)
+{
+	struct SQL_Connection *target;
+	PGresult *res;
+	va_list copy;
+
+	if ((target = Route(conn, fmt)) == conn)
+		return Execute(conn, result_format, fmt, ap);
+
+	va_copy(copy, ap);
+	res = Execute(target, result_format, fmt, copy);
+	va_end(copy);
+
+	if (ReplicaFailed(conn))
+		res = Execute(conn, result_format, fmt, ap);
+
+	return res;
+}
+
+void SQL_ConnSetReplica(struct SQL_Connection *conn, const char *connect_string, unsigned int max_lag_ms)
+{
+	struct SQL_Connection *replica;
+
+	/* Other backends are not replicated */
+	if (conn->backend)
+		return;
+
+	SQL_Disconnect(conn->replica);
+
+	conn->replica = replica = NewConnection(connect_string);
+	conn->replica_lag_usec = max_lag_ms * 1000ULL;
+	conn->replica_checked = 0;
+	conn->replica_retry = 0;
+	conn->write_pending = 1;
+
+	replica->is_replica = 1;
+	replica->statement_usec = conn->statement_usec;
+	replica->command_deadline = conn->command_deadline;
+
+	if (conn->slow_usec)
+		SQL_ConnSetSlowQueryLog(replica, conn->slow_usec / 1000, conn->slow_log_path);
+
+	if (PQstatus(replica->pg) != CONNECTION_OK)
+		ReplicaDown(conn);
+}
+
+void SQL_SetReplica(const char *connect_string, unsigned int max_lag_ms)
+{
+	SQL_ConnSetReplica(default_connection, connect_string, max_lag_ms);
+}
+
+static int
+Query(struct SQL_Connection *conn, const char *fmt, va_list ap)
+{
+	PGresult *res;
+
+	res = RoutedExecute(conn, 0, fmt, ap);
+
+	/* Only now is it safe to drop the previous result, which may have
+	 * provided some of the arguments.  */
+	if (conn->pgresult)
+		PQclear(conn->pgresult);
+
+	conn->pgresult = res;
+
+	if (!conn->pgresult)
+	{
+		conn->tuple_count = 0;
+
+		return -1;
+	}
+
+	conn->tuple_count = PQntuples(conn->pgresult);
+
+	return AffectedRows(conn, conn->pgresult);
+}
+
+int SQL_ConnQuery(struct SQL_Connection *conn, const char *fmt, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, fmt);
+	result = Query(conn, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+int SQL_Query(const char *fmt, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, fmt);
+	result = Query(default_connection, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+int SQL_ConnRowCount(struct SQL_Connection *conn)
+{
+	return conn->tuple_count;
+}
+
+int SQL_RowCount()
+{
+	return SQL_ConnRowCount(default_connection);
+}
+
+const char *SQL_ConnValue(struct SQL_Connection *conn, unsigned int row, unsigned int column)
+{
+	assert(row < (unsigned int) conn->tuple_count);
+
+	return PQgetvalue(conn->pgresult, row, column);
+}
+
+const char *SQL_Value(unsigned int row, unsigned int column)
+{
+	return SQL_ConnValue(default_connection, row, column);
+}
+
+struct SQL_Result
+{
+	PGresult *pgresult;
+	int row_count, affected_rows;
+};
+
+static struct SQL_Result *
+WrapResult(PGresult *res, int affected_rows)
+{
+	struct SQL_Result *result;
+
+	if (!res)
+		return 0;
+
+	if (!(result = malloc(sizeof(*result))))
+		errx(EXIT_FAILURE, "malloc failed");
+
+	result->pgresult = res;
+	result->row_count = PQntuples(res);
+	result->affected_rows = affected_rows;
+
+	return result;
+}
+
+static struct SQL_Result *
+ExecuteResult(struct SQL_Connection *conn, int result_format, const char *fmt, va_list ap)
+{
+	PGresult *res;
+
+	res = RoutedExecute(conn, result_format, fmt, ap);
+
+	return WrapResult(res, res ? AffectedRows(conn, res) : 0);
+}
+
+struct SQL_Result *SQL_ConnExecute(struct SQL_Connection *conn, const char *fmt, ...)
+{
+	struct SQL_Result *result;
+	va_list ap;
+
+	va_start(ap, fmt);
+	result = ExecuteResult(conn, 0, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+struct SQL_Result *SQL_Execute(const char *fmt, ...)
+{
+	struct SQL_Result *result;
+	va_list ap;
+
+	va_start(ap, fmt);
+	result = ExecuteResult(default_connection, 0, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+struct SQL_Result *SQL_ConnExecuteBinary(struct SQL_Connection *conn, const char *fmt, ...)
+{
+	struct SQL_Result *result;
+	va_list ap;
+
+	va_start(ap, fmt);
+	result = ExecuteResult(conn, 1, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+struct SQL_Result *SQL_ExecuteBinary(const char *fmt, ...)
+{
+	struct SQL_Result *result;
+	va_list ap;
+
+	va_start(ap, fmt);
+	result = ExecuteResult(default_connection, 1, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+int SQL_ResultRowCount(const struct SQL_Result *result)
+{
+	return result->row_count;
+}
+
+int SQL_ResultAffectedRows(const struct SQL_Result *result)
+{
+	return result->affected_rows;
+}
+
+const char *SQL_ResultValue(const struct SQL_Result *result, unsigned int row, unsigned int column)
+{
+	assert(row < (unsigned int) result->row_count);
+
+	return PQgetvalue(result->pgresult, row, column);
+}
+
+int SQL_ResultIsNull(const struct SQL_Result *result, unsigned int row, unsigned int column)
+{
+	assert(row < (unsigned int) result->row_count);
+
+	return PQgetisnull(result->pgresult, row, column);
+}
+
+/* Type OIDs from pg_type.h, which is not part of the client headers */
+#define INT8OID 20
+#define INT2OID 21
+#define INT4OID 23
+#define NUMERICOID 1700
+#define TIMESTAMPOID 1114
+#define TIMESTAMPTZOID 1184
+
+/* Seconds from 1970-01-01 to 2000-01-01, the PostgreSQL epoch */
+#define POSTGRES_EPOCH_OFFSET 946684800LL
+
+#define NUMERIC_NEG 0x4000
+
+static long long
+ReadBigEndian(const char *data, size_t size)
+{
+	unsigned long long value = 0;
+	size_t i;
+
+	for (i = 0; i < size; ++i)
+		value = (value << 8) | (unsigned char) data[i];
+
+	/* Sign extend */
+	if (size < sizeof(value) && (value & (1ULL << (size * 8 - 1))))
+		value |= ~0ULL << (size * 8);
+
+	return (long long) value;
+}
+
+/* Multiplies by 10^exponent, truncating if negative.  Returns -1 on
+ * overflow.  */
+static int
+ScaleDecimal(long long *value, int exponent)
+{
+	for (; exponent > 0; --exponent)
+	{
+		if (*value > LLONG_MAX / 10 || *value < LLONG_MIN / 10)
+			return -1;
+
+		*value *= 10;
+	}
+
+	for (; exponent < 0; ++exponent)
+		*value /= 10;
+
+	return 0;
+}
+
+static int
+ParseNumericText(const char *text, int scale, long long *value)
+{
+	long long result = 0;
+	int negative = 0, exponent = scale, seen_point = 0, digits = 0;
+
+	if (*text == '-' || *text == '+')
+		negative = (*text++ == '-');
+
+	for (; *text; ++text)
+	{
+		if (*text == '.' && !seen_point)
+		{
+			seen_point = 1;
+
+			continue;
+		}
+
+		if (*text < '0' || *text > '9')
+			return -1;
+
+		++digits;
+
+		/* Digits beyond the requested scale are truncated */
+		if (seen_point && exponent <= 0)
+			continue;
+
+		if (result > (LLONG_MAX - 9) / 10)
+			return -1;
+
+		result = result * 10 + (*text - '0');
+
+		if (seen_point)
+			--exponent;
+	}
+
+	if (!digits)
+		return -1;
+
+	if (-1 == ScaleDecimal(&result, seen_point ? exponent : scale))
+		return -1;
+
+	*value = negative ? -result : result;
+
+	return 0;
+}
+
+/* Binary numeric: digit count, weight of the first digit, sign and
+ * display scale, each 16 bits, followed by base 10000 digits.  */
+static int
+ParseNumericBinary(const char *data, int length, int scale, long long *value)
+{
+	long long result = 0, term;
+	int ndigits, weight, sign, i;
+
+	if (length < 8)
+		return -1;
+
+	ndigits = ReadBigEndian(data, 2);
+	weight = ReadBigEndian(data + 2, 2);
+	sign = ReadBigEndian(data + 4, 2) & 0xffff;
+
+	if (length < 8 + ndigits * 2 || (sign != 0 && sign != NUMERIC_NEG))
+		return -1;
+
+	for (i = 0; i < ndigits; ++i)
+	{
+		term = ReadBigEndian(data + 8 + i * 2, 2);
+
+		if (-1 == ScaleDecimal(&term, 4 * (weight - i) + scale))
+			return -1;
+
+		if (result > LLONG_MAX - term)
+			return -1;
+
+		result += term;
+	}
+
+	*value = (sign == NUMERIC_NEG) ? -result : result;
+
+	return 0;
+}
+
+int SQL_ResultInt(const struct SQL_Result *result, unsigned int row, unsigned int column, long long *value)
+{
+	const char *data;
+	char *endptr;
+	int length;
+
+	if (SQL_ResultIsNull(result, row, column))
+		return -1;
+
+	data = PQgetvalue(result->pgresult, row, column);
+	length = PQgetlength(result->pgresult, row, column);
+
+	if (!PQfformat(result->pgresult, column))
+	{
+		errno = 0;
+		*value = strtoll(data, &endptr, 10);
+
+		if (errno || endptr == data || *endptr)
+			return ParseNumericText(data, 0, value);
+
+		return 0;
+	}
+
+	switch (PQftype(result->pgresult, column))
+	{
+	case INT2OID:
+	case INT4OID:
+	case INT8OID:
+
+		if (length != 2 && length != 4 && length != 8)
+			return -1;
+
+		*value = ReadBigEndian(data, length);
+
+		return 0;
+
+	case NUMERICOID:
+
+		return ParseNumericBinary(data, length, 0, value);
+	}
+
+	return -1;
+}
+
+int SQL_ResultNumeric(const struct SQL_Result *result, unsigned int row, unsigned int column, int scale, long long *value)
+{
+	const char *data;
+	long long integer;
+
+	if (SQL_ResultIsNull(result, row, column))
+		return -1;
+
+	data = PQgetvalue(result->pgresult, row, column);
+
+	if (!PQfformat(result->pgresult, column))
+		return ParseNumericText(data, scale, value);
+
+	switch (PQftype(result->pgresult, column))
+	{
+	case INT2OID:
+	case INT4OID:
+	case INT8OID:
+
+		if (-1 == SQL_ResultInt(result, row, column, &integer)
+		    || -1 == ScaleDecimal(&integer, scale))
+			return -1;
+
+		*value = integer;
+
+		return 0;
+
+	case NUMERICOID:
+
+		return ParseNumericBinary(data, PQgetlength(result->pgresult, row, column), scale, value);
+	}
+
+	return -1;
+}
+
+/* Text timestamps are expected in the ISO DateStyle, e.g.
+ * "2014-03-01 18:00:00.25+01".  */
+static int
+ParseTimestampText(const char *text, struct timespec *value)
+{
+	struct tm tm;
+	long nsec = 0, scale = 100000000;
+	int offset = 0, hours, minutes = 0, n;
+
+	memset(&tm, 0, sizeof(tm));
+
+	if (6 != sscanf(text, "%d-%d-%d %d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+	                &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n))
+		return -1;
+
+	text += n;
+
+	if (*text == '.')
+	{
+		for (++text; *text >= '0' && *text <= '9'; ++text)
+		{
+			nsec += (*text - '0') * scale;
+			scale /= 10;
+		}
+	}
+
+	if (*text == '+' || *text == '-')
+	{
+		if (1 > sscanf(text + 1, "%2d:%2d", &hours, &minutes))
+			return -1;
+
+		offset = (hours * 60 + minutes) * 60;
+
+		if (*text == '-')
+			offset = -offset;
+	}
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+
+	value->tv_sec = timegm(&tm) - offset;
+	value->tv_nsec = nsec;
+
+	return 0;
+}
+
+int SQL_ResultTimestamp(const struct SQL_Result *result, unsigned int row, unsigned int column, struct timespec *value)
+{
+	long long usec;
+
+	if (SQL_ResultIsNull(result, row, column))
+		return -1;
+
+	if (!PQfformat(result->pgresult, column))
+		return ParseTimestampText(PQgetvalue(result->pgresult, row, column), value);
+
+	switch (PQftype(result->pgresult, column))
+	{
+	case TIMESTAMPOID:
+	case TIMESTAMPTZOID:
+
+		if (8 != PQgetlength(result->pgresult, row, column))
+			return -1;
+
+		/* Microseconds since the PostgreSQL epoch */
+		usec = ReadBigEndian(PQgetvalue(result->pgresult, row, column), 8);
+
+		value->tv_sec = usec / 1000000 + POSTGRES_EPOCH_OFFSET;
+		value->tv_nsec = (usec % 1000000) * 1000;
+
+		if (value->tv_nsec < 0)
+		{
+			value->tv_nsec += 1000000000;
+			--value->tv_sec;
+		}
+
+		return 0;
+	}
+
+	return -1;
+}
+
+void SQL_ResultFree(struct SQL_Result *result)
+{
+	if (!result)
+		return;
+
+	PQclear(result->pgresult);
+	free(result);
+}
+
+/* Asynchronous queries.  Only one may be in flight per connection; a
+ * synchronous call made meanwhile first waits for it to complete, and
+ * its result is kept for SQL_ConnAsyncResult.  */
+
+static int
+AsyncSendExecute(struct SQL_Connection *conn)
+{
+	struct query *q = &conn->async_query;
+
+	conn->async_state = ASYNC_EXECUTING;
+
+	if (q->stmt)
+		return PQsendQueryPrepared(conn->pg, q->stmt->name, QUERY_ARGS(q), 0);
+
+	return PQsendQueryParams(conn->pg, QUERY_TEXT(q), ARRAY_COUNT(&q->args), 0,
+	                         ARRAY_DATA(&q->args), ARRAY_DATA(&q->lengths), ARRAY_DATA(&q->formats), 0);
+}
+
+static void
+AsyncComplete(struct SQL_Connection *conn)
+{
+	RecordExecution(conn, conn->async_query.stmt, conn->async_start,
+	                conn->async_failed ? -1 : ResultRows(conn->async_result));
+
+	if (conn->async_failed)
+	{
+		if (!Failover(conn, 0))
+		{
+			Report(conn, "PostgreSQL query failed: %s\n", ErrorMessage(conn));
+#if P2K12_MODE == dev
+			Report(conn, "Failed query: %s\n", QUERY_TEXT(&conn->async_query));
+#endif
+		}
+
+		PQclear(conn->async_result);
+		conn->async_result = 0;
+	}
+	else
+		conn->async_affected_rows = AffectedRows(conn, conn->async_result);
+
+	FreeQuery(&conn->async_query);
+	conn->async_state = ASYNC_DONE;
+}
+
+static int
+AsyncPoll(struct SQL_Connection *conn)
+{
+	PGresult *res;
+
+	if (conn->async_state == ASYNC_IDLE)
+		return -1;
+
+	if (conn->async_state == ASYNC_DONE)
+		return 1;
+
+	if (!PQconsumeInput(conn->pg))
+	{
+		conn->async_failed = 1;
+		AsyncComplete(conn);
+
+		return 1;
+	}
+
+	while (!PQisBusy(conn->pg))
+	{
+		if (0 != (res = PQgetResult(conn->pg)))
+		{
+			switch (PQresultStatus(res))
+			{
+			case PGRES_COMMAND_OK:
+			case PGRES_TUPLES_OK:
+
+				break;
+
+			default:
+
+				conn->async_failed = 1;
+			}
+
+			if (conn->async_state == ASYNC_PREPARING || conn->async_result)
+				PQclear(res);
+			else
+				conn->async_result = res;
+
+			continue;
+		}
+
+		/* The command is complete */
+		if (conn->async_state == ASYNC_PREPARING && !conn->async_failed)
+		{
+			conn->async_query.stmt->prepared = 1;
+			++conn->statement_misses;
+
+			if (AsyncSendExecute(conn))
+				continue;
+
+			conn->async_failed = 1;
+		}
+		else if (conn->async_state == ASYNC_PREPARING)
+			conn->async_query.stmt->prepared = 0;
+
+		AsyncComplete(conn);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+FinishAsync(struct SQL_Connection *conn)
+{
+	unsigned long long deadline = 0;
+	int timed_out = 0;
+
+	if (conn->statement_usec)
+		deadline = conn->async_start + conn->statement_usec;
+
+	if (conn->command_deadline && (!deadline || conn->command_deadline < deadline))
+		deadline = conn->command_deadline;
+
+	while (0 == AsyncPoll(conn))
+	{
+		if (0 == WaitSocket(conn->pg, POLLIN, deadline))
+			continue;
+
+		if (timed_out)
+		{
+			conn->needs_reset = 1;
+			conn->async_failed = 1;
+			AsyncComplete(conn);
+
+			break;
+		}
+
+		Cancel(conn);
+
+		timed_out = 1;
+		deadline = Now() + CANCEL_GRACE_USEC;
+	}
+}
+
+static int
+SendQuery(struct SQL_Connection *conn, const char *fmt, va_list ap)
+{
+	struct query *q = &conn->async_query;
+
+	assert(!PQpipelineStatus(conn->pg));
+
+	FinishAsync(conn);
+
+	/* An uncollected result of an earlier query is discarded */
+	PQclear(conn->async_result);
+	conn->async_result = 0;
+	conn->async_failed = 0;
+	conn->async_state = ASYNC_IDLE;
+
+	if (-1 == EnsureConnection(conn))
+		return -1;
+
+	if (-1 == FormatQuery(conn, q, fmt, ap))
+		return -1;
+
+	conn->async_start = Now();
+
+	if (conn->backend)
+	{
+		conn->async_state = ASYNC_EXECUTING;
+		conn->async_result = BackendExecute(conn, q);
+		conn->async_failed = !conn->async_result;
+		AsyncComplete(conn);
+
+		return 0;
+	}
+
+	if (q->stmt && !q->stmt->prepared)
+	{
+		conn->async_state = ASYNC_PREPARING;
+
+		if (PQsendPrepare(conn->pg, q->stmt->name, QUERY_TEXT(q), ARRAY_COUNT(&q->args), 0))
+			return 0;
+	}
+	else
+	{
+		if (q->stmt)
+			++conn->statement_hits;
+
+		if (AsyncSendExecute(conn))
+			return 0;
+	}
+
+	conn->async_failed = 1;
+	AsyncComplete(conn);
+
+	return -1;
+}
+
+/* A query that the replica fails to even send goes to the primary; one
+ * lost with the replica later on is reported as failed.  */
+static int
+RoutedSendQuery(struct SQL_Connection *conn, const char *fmt, va_list ap)
+{
+	struct SQL_Connection *target, *previous = conn->async_conn;
+	va_list copy;
+	int result;
+
+	target = Route(conn, fmt);
+
+	/* An uncollected result on the other connection is discarded too */
+	if (previous != target)
+	{
+		FinishAsync(previous);
+		PQclear(previous->async_result);
+		previous->async_result = 0;
+		previous->async_state = ASYNC_IDLE;
+	}
+
+	conn->async_conn = target;
+
+	if (target == conn)
+		return SendQuery(conn, fmt, ap);
+
+	va_copy(copy, ap);
+	result = SendQuery(target, fmt, copy);
+	va_end(copy);
+
+	if (ReplicaFailed(conn) && result == -1)
+	{
+		target->async_state = ASYNC_IDLE;
+		conn->async_conn = conn;
+
+		result = SendQuery(conn, fmt, ap);
+	}
+
+	return result;
+}
+
+int SQL_ConnSendQuery(struct SQL_Connection *conn, const char *fmt, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, fmt);
+	result = RoutedSendQuery(conn, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+int SQL_SendQuery(const char *fmt, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, fmt);
+	result = RoutedSendQuery(default_connection, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+int SQL_ConnSocket(struct SQL_Connection *conn)
+{
+	if (conn->async_conn->backend)
+		return conn->async_conn->backend_fd;
+
+	return PQsocket(conn->async_conn->pg);
+}
+
+int SQL_Socket()
+{
+	return SQL_ConnSocket(default_connection);
+}
+
+int SQL_ConnAsyncPoll(struct SQL_Connection *conn)
+{
+	return AsyncPoll(conn->async_conn);
+}
+
+int SQL_AsyncPoll()
+{
+	return SQL_ConnAsyncPoll(default_connection);
+}
+
+struct SQL_Result *SQL_ConnAsyncResult(struct SQL_Connection *conn)
+{
+	struct SQL_Connection *target = conn->async_conn;
+	PGresult *res;
+
+	FinishAsync(target);
+
+	res = target->async_result;
+	target->async_result = 0;
+	target->async_state = ASYNC_IDLE;
+
+	if (target != conn && ReplicaFailed(conn))
+		Report(conn, "PostgreSQL query failed: replica connection lost\n");
+
+	return WrapResult(res, target->async_affected_rows);
+}
+
+struct SQL_Result *SQL_AsyncResult()
+{
+	return SQL_ConnAsyncResult(default_connection);
+}
+
+/* Streamed queries.  Rows are requested in single-row mode and passed
+ * to the callback as they arrive, so memory use does not grow with the
+ * size of the result.  */
+
+static int
+Stream(struct SQL_Connection *conn, SQL_RowCallback callback, void *arg, const char *fmt, va_list ap)
+{
+	struct query q;
+	struct SQL_Result result;
+	PGresult *res;
+	const char *sqlstate;
+	char error_state[6] = "";
+	unsigned long long start, deadline;
+	int rows = 0, stop = 0, failed = 0, timed_out = 0, i;
+
+	assert(!PQpipelineStatus(conn->pg));
+
+	FinishAsync(conn);
+
+	if (-1 == EnsureConnection(conn))
+		return -1;
+
+	if (-1 == FormatQuery(conn, &q, fmt, ap))
+		return -1;
+
+	start = Now();
+	deadline = StatementDeadline(conn);
+
+	/* Backends return all rows at once */
+	if (conn->backend)
+	{
+		if ((res = BackendExecute(conn, &q)))
+		{
+			result.pgresult = res;
+			result.row_count = PQntuples(res);
+			result.affected_rows = AffectedRows(conn, res);
+
+			for (i = 0; i < result.row_count && !stop; ++i, ++rows)
+				stop = callback(&result, i, arg);
+
+			PQclear(res);
+		}
+		else
+		{
+			failed = 1;
+
+			Report(conn, "PostgreSQL query failed: %s\n", ErrorMessage(conn));
+		}
+
+		RecordExecution(conn, q.stmt, start, failed ? -1 : rows);
+		FreeQuery(&q);
+
+		return failed ? -1 : rows;
+	}
+
+	if (q.stmt && !q.stmt->prepared)
+	{
+		res = PQsendPrepare(conn->pg, q.stmt->name, QUERY_TEXT(&q), ARRAY_COUNT(&q.args), 0)
+		      ? WaitResult(conn, deadline, &timed_out) : 0;
+
+		if (PQresultStatus(res) == PGRES_COMMAND_OK)
+		{
+			q.stmt->prepared = 1;
+			++conn->statement_misses;
+		}
+		else
+			failed = 1;
+
+		PQclear(res);
+	}
+	else if (q.stmt)
+		++conn->statement_hits;
+
+	if (!failed)
+	{
+		if (q.stmt)
+			failed = !PQsendQueryPrepared(conn->pg, q.stmt->name, QUERY_ARGS(&q), 0);
+		else
+			failed = !PQsendQueryParams(conn->pg, QUERY_TEXT(&q), ARRAY_COUNT(&q.args), 0,
+			                            ARRAY_DATA(&q.args), ARRAY_DATA(&q.lengths), ARRAY_DATA(&q.formats), 0);
+
+		/* Without single-row mode the rows arrive in one result, which
+		 * is still handled below.  */
+		if (!failed)
+			PQsetSingleRowMode(conn->pg);
+	}
+
+	/* After the callback asks to stop, the remaining rows are discarded */
+	while (!failed && !(failed = AwaitResult(conn, &deadline, &timed_out))
+	       && (res = PQgetResult(conn->pg)))
+	{
+		switch (PQresultStatus(res))
+		{
+		case PGRES_SINGLE_TUPLE:
+		case PGRES_TUPLES_OK:
+
+			result.pgresult = res;
+			result.row_count = PQntuples(res);
+			result.affected_rows = 0;
+
+			for (i = 0; i < result.row_count && !stop; ++i, ++rows)
+				stop = callback(&result, i, arg);
+
+			break;
+
+		case PGRES_COMMAND_OK:
+
+			break;
+
+		default:
+
+			sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+
+			/* The server forgot our statement; prepare it next time */
+			if (q.stmt && sqlstate && !strcmp(sqlstate, "26000"))
+				q.stmt->prepared = 0;
+
+			if (sqlstate)
+				strncat(error_state, sqlstate, sizeof(error_state) - 1);
+
+			failed = 1;
+
+			/* Read the rest so the connection is ready for the next query */
+			do
+				PQclear(res);
+			while (0 == AwaitResult(conn, &deadline, &timed_out) && (res = PQgetResult(conn->pg)));
+
+			res = 0;
+		}
+
+		PQclear(res);
+	}
+
+	RecordExecution(conn, q.stmt, start, failed ? -1 : rows);
+
+	/* Once rows have been passed on, the query cannot move elsewhere */
+	if (failed && !(rows == 0 && Failover(conn, error_state)))
+	{
+		if (timed_out)
+			Report(conn, "PostgreSQL query failed: timed out\n");
+		else
+			Report(conn, "PostgreSQL query failed: %s\n", PQerrorMessage(conn->pg));
+#if P2K12_MODE == dev
+		Report(conn, "Failed query: %s\n", QUERY_TEXT(&q));
+#endif
+
+		/* Rows may already have been shown, so the query is not retried */
+		if (PQstatus(conn->pg) != CONNECTION_OK)
+			Reconnect(conn);
+	}
+
+	FreeQuery(&q);
+
+	return failed ? -1 : rows;
+}
+
+static int
+RoutedStream(struct SQL_Connection *conn, SQL_RowCallback callback, void *arg, const char *fmt, va_list ap)
+{
+	struct SQL_Connection *target;
+	va_list copy;
+	int result;
+
+	if ((target = Route(conn, fmt)) == conn)
+		return Stream(conn, callback, arg, fmt, ap);
+
+	va_copy(copy, ap);
+	result = Stream(target, callback, arg, fmt, copy);
+	va_end(copy);
+
+	if (ReplicaFailed(conn))
+		result = Stream(conn, callback, arg, fmt, ap);
+
+	return result;
+}
+
+int SQL_ConnStream(struct SQL_Connection *conn, SQL_RowCallback callback, void *arg, const char *fmt, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, fmt);
+	result = RoutedStream(conn, callback, arg, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+int SQL_Stream(SQL_RowCallback callback, void *arg, const char *fmt, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, fmt);
+	result = RoutedStream(default_connection, callback, arg, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+/* Transactions with retry.  Serialization failures, deadlocks and lost
+ * connections abort the whole transaction, which is then run again from
+ * the start.  */
+
+static int
+IsRetryable(const char *sqlstate)
+{
+	return sqlstate && (!strcmp(sqlstate, "40001") || !strcmp(sqlstate, "40P01"));
+}
+
+/* Random delay growing with the attempt, so that transactions that
+ * conflicted do not collide again.  */
+static void
+RetryBackoff(struct SQL_Connection *conn, int attempt)
+{
+	syslog(LOG_INFO, "Retrying transaction, attempt %d", attempt + 1);
+
+	usleep (1000 + rand_r(&conn->jitter_seed) % (attempt * 20000));
+}
+
+/* After the connection was lost with COMMIT possibly sent, asks the
+ * server whether the transaction committed.  Returns 1 if it did, 0 if
+ * it did not, and -1 if that cannot be known.  */
+static int
+CommitOutcome(struct SQL_Connection *conn, long long txid)
+{
+	PGresult *res;
+	int outcome = -1;
+
+	if (!txid || -1 == EnsureConnection(conn))
+		return -1;
+
+	if (!(res = ExecuteF(conn, "SELECT txid_status(%l)", txid)))
+		return -1;
+
+	if (PQntuples(res) == 1 && !PQgetisnull(res, 0, 0))
+	{
+		if (!strcmp(PQgetvalue(res, 0, 0), "committed"))
+			outcome = 1;
+		else if (!strcmp(PQgetvalue(res, 0, 0), "aborted"))
+			outcome = 0;
+	}
+
+	PQclear(res);
+
+	return outcome;
+}
+
+/* Runs one attempt.  Returns 0 if the transaction committed, otherwise
+ * -1 with *retry set if running it again may succeed.  */
+static int
+TransactionAttempt(struct SQL_Connection *conn, enum SQL_Isolation isolation,
+                   SQL_TransactionCallback callback, void *arg, int *retry)
+{
+	PGresult *res;
+	long long txid = 0;
+	int result, unavailable;
+
+	*retry = 0;
+	conn->sqlstate[0] = 0;
+	conn->transaction_lost = 0;
+
+	if (!(res = ExecuteF(conn, BeginStatement(isolation))))
+		return -1;
+
+	PQclear(res);
+
+	conn->in_transaction = 1;
+
+	result = callback(conn, arg);
+
+	if (result == 0 && (res = ExecuteF(conn, "SELECT txid_current()")))
+	{
+		txid = strtoll(PQgetvalue(res, 0, 0), 0, 10);
+		PQclear(res);
+	}
+	else
+		result = -1;
+
+	if (result == 0)
+	{
+		res = ExecuteF(conn, "COMMIT");
+
+		/* COMMIT of a failed transaction reports ROLLBACK */
+		if (res && !strcmp(CommandStatus(conn, res), "COMMIT"))
+		{
+			PQclear(res);
+			conn->in_transaction = 0;
+
+			return 0;
+		}
+
+		PQclear(res);
+
+		if (!res && (conn->needs_reset || !Connected(conn)))
+		{
+			conn->in_transaction = 0;
+
+			switch (CommitOutcome(conn, txid))
+			{
+			case 1:
+
+				return 0;
+
+			case 0:
+
+				*retry = 1;
+
+				return -1;
+
+			default:
+
+				Report(conn, "PostgreSQL transaction failed: connection lost during COMMIT; the transaction may or may not have been applied\n");
+
+				conn->unavailable = 1;
+
+				return -1;
+			}
+		}
+	}
+	else if (!conn->transaction_lost && Connected(conn)
+	         && TransactionStatus(conn) != PQTRANS_IDLE)
+	{
+		/* Keep the reason the unit of work failed */
+		unavailable = conn->unavailable;
+		PQclear(ExecuteF(conn, "ROLLBACK"));
+		conn->unavailable = unavailable;
+	}
+
+	conn->in_transaction = 0;
+
+	*retry = IsRetryable(conn->sqlstate) || conn->transaction_lost
+	         || conn->needs_reset || !Connected(conn);
+
+	return -1;
+}
+
+/* Runs the unit of work once in a savepoint of the enclosing transaction,
+ * which is what a retry would have to repeat.  */
+static int
+NestedTransaction(struct SQL_Connection *conn, SQL_TransactionCallback callback, void *arg)
+{
+	PGresult *res;
+	int unavailable;
+
+	if (!(res = ExecuteF(conn, "SAVEPOINT " TRANSACTION_SAVEPOINT)))
+		return -1;
+
+	PQclear(res);
+
+	if (0 == callback(conn, arg) && (res = ExecuteF(conn, "RELEASE SAVEPOINT " TRANSACTION_SAVEPOINT)))
+	{
+		PQclear(res);
+
+		return 0;
+	}
+
+	if (!conn->transaction_lost && InTransactionBlock(conn))
+	{
+		unavailable = conn->unavailable;
+		PQclear(ExecuteF(conn, "ROLLBACK TO SAVEPOINT " TRANSACTION_SAVEPOINT));
+		conn->unavailable = unavailable;
+	}
+
+	return -1;
+}
+
+int SQL_ConnTransaction(struct SQL_Connection *conn, enum SQL_Isolation isolation,
+                        SQL_TransactionCallback callback, void *arg)
+{
+	int attempt, retry;
+
+	FinishAsync(conn);
+
+	if (conn->transaction_lost)
+	{
+		Report(conn, "PostgreSQL query failed: the transaction was lost with the database connection\n");
+
+		return -1;
+	}
+
+	if (InTransactionBlock(conn))
+		return NestedTransaction(conn, callback, arg);
+
+	assert(!conn->in_transaction);
+
+	for (attempt = 1; ; ++attempt)
+	{
+		if (0 == TransactionAttempt(conn, isolation, callback, arg, &retry))
+			return 0;
+
+		if (!retry)
+			return -1;
+
+		if (attempt == TRANSACTION_MAX_ATTEMPTS)
+		{
+			Report(conn, "PostgreSQL transaction failed after %d attempts\n", attempt);
+
+			return -1;
+		}
+
+		RetryBackoff(conn, attempt);
+	}
+}
+
+int SQL_Transaction(enum SQL_Isolation isolation, SQL_TransactionCallback callback, void *arg)
+{
+	return SQL_ConnTransaction(default_connection, isolation, callback, arg);
+}
+
+/* Pipelined transactions.  Statements are queued between BEGIN and
+ * COMMIT and sent in a single flush; results are read back only when
+ * the pipeline is committed.  The statements are kept so that the whole
+ * transaction can be replayed if it has to be retried.  */
+
+static void
+PipelineClear(struct SQL_Connection *conn)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_COUNT(&conn->pipeline); ++i)
+	{
+		PQclear(ARRAY_GET(&conn->pipeline, i).result);
+		FreeQuery(&ARRAY_GET(&conn->pipeline, i).q);
+	}
+
+	ARRAY_RESET(&conn->pipeline);
+	ARRAY_RESET(&conn->pipeline_sent);
+}
+
+static void
+PipelineAdd(struct SQL_Connection *conn, enum pipeline_item_type type, struct statement *stmt, size_t statement)
+{
+	struct pipeline_item item;
+
+	item.type = type;
+	item.stmt = stmt;
+	item.statement = statement;
+
+	ARRAY_ADD(&conn->pipeline_sent, item);
+
+	if (-1 == ARRAY_RESULT(&conn->pipeline_sent))
+		errx(EXIT_FAILURE, "ARRAY_ADD failed");
+}
+
+static void
+PipelineSendInternal(struct SQL_Connection *conn, const char *query, enum pipeline_item_type type)
+{
+	if (!PQsendQueryParams(conn->pg, query, 0, 0, 0, 0, 0, 0))
+		conn->pipeline_failed = 1;
+
+	PipelineAdd(conn, type, 0, 0);
+}
+
+static void
+PipelineSendStatement(struct SQL_Connection *conn, size_t statement)
+{
+	struct query *q = &ARRAY_GET(&conn->pipeline, statement).q;
+	int result;
+
+	if (q->stmt && !q->stmt->prepared)
+	{
+		if (!PQsendPrepare(conn->pg, q->stmt->name, QUERY_TEXT(q), ARRAY_COUNT(&q->args), 0))
+			conn->pipeline_failed = 1;
+
+		/* Optimistic; undone in SQL_PipelineCommit if the prepare fails */
+		q->stmt->prepared = 1;
+		++conn->statement_misses;
+
+		PipelineAdd(conn, PIPELINE_PREPARE, q->stmt, 0);
+	}
+	else if (q->stmt)
+		++conn->statement_hits;
+
+	if (q->stmt)
+		result = PQsendQueryPrepared(conn->pg, q->stmt->name, QUERY_ARGS(q), 0);
+	else
+		result = PQsendQueryParams(conn->pg, QUERY_TEXT(q), ARRAY_COUNT(&q->args), 0,
+		                           ARRAY_DATA(&q->args), ARRAY_DATA(&q->lengths), ARRAY_DATA(&q->formats), 0);
+
+	if (!result)
+		conn->pipeline_failed = 1;
+
+	PipelineAdd(conn, PIPELINE_QUERY, q->stmt, statement);
+}
+
+/* Starts an attempt: BEGIN followed by every statement queued so far */
+static void
+PipelineStart(struct SQL_Connection *conn)
+{
+	size_t i;
+
+	ARRAY_RESET(&conn->pipeline_sent);
+	conn->pipeline_failed = 0;
+	conn->pipeline_commit_sent = 0;
+	conn->pipeline_txid = 0;
+
+	/* Backends run the statements on commit */
+	if (conn->backend)
+		return;
+
+	if (-1 == EnsureConnection(conn) || !PQenterPipelineMode(conn->pg))
+	{
+		conn->pipeline_failed = 1;
+
+		return;
+	}
+
+	PipelineSendInternal(conn, conn->pipeline_begin, PIPELINE_INTERNAL);
+
+	for (i = 0; !conn->pipeline_failed && i < ARRAY_COUNT(&conn->pipeline); ++i)
+	{
+		PQclear(ARRAY_GET(&conn->pipeline, i).result);
+		ARRAY_GET(&conn->pipeline, i).result = 0;
+
+		PipelineSendStatement(conn, i);
+	}
+}
+
+static const char *
+BeginStatement(enum SQL_Isolation isolation)
+{
+	switch (isolation)
+	{
+	case SQL_REPEATABLE_READ: return "BEGIN ISOLATION LEVEL REPEATABLE READ";
+	case SQL_SERIALIZABLE: return "BEGIN ISOLATION LEVEL SERIALIZABLE";
+	default: return "BEGIN ISOLATION LEVEL READ COMMITTED";
+	}
+}
+
+void SQL_ConnPipelineBegin(struct SQL_Connection *conn, enum SQL_Isolation isolation)
+{
+	assert(!PQpipelineStatus(conn->pg));
+
+	FinishAsync(conn);
+
+	PipelineClear(conn);
+
+	/* Part of a transaction lost with the connection; fail it whole */
+	if (conn->transaction_lost)
+	{
+		conn->pipeline_invalid = 1;
+		conn->pipeline_nested = 1;
+		conn->pipeline_failed = 1;
+
+		return;
+	}
+
+	conn->pipeline_invalid = 0;
+	conn->unavailable = 0;
+	conn->pipeline_nested = InTransactionBlock(conn);
+	conn->pipeline_begin = conn->pipeline_nested ? "SAVEPOINT " PIPELINE_SAVEPOINT : BeginStatement(isolation);
+
+	PipelineStart(conn);
+}
+
+void SQL_PipelineBegin(enum SQL_Isolation isolation)
+{
+	SQL_ConnPipelineBegin(default_connection, isolation);
+}
+
+static int
+PipelineQuery(struct SQL_Connection *conn, const char *fmt, va_list ap)
+{
+	struct pipeline_statement statement;
+
+	if (conn->pipeline_invalid || -1 == FormatQuery(conn, &statement.q, fmt, ap))
+	{
+		conn->pipeline_invalid = 1;
+
+		return -1;
+	}
+
+	statement.result = 0;
+
+	ARRAY_ADD(&conn->pipeline, statement);
+
+	if (-1 == ARRAY_RESULT(&conn->pipeline))
+		errx(EXIT_FAILURE, "ARRAY_ADD failed");
+
+	/* Kept even if this attempt has failed, for the next one */
+	if (!conn->pipeline_failed && !conn->backend)
+		PipelineSendStatement(conn, ARRAY_COUNT(&conn->pipeline) - 1);
+
+	return ARRAY_COUNT(&conn->pipeline) - 1;
+}
+
+int SQL_ConnPipelineQuery(struct SQL_Connection *conn, const char *fmt, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, fmt);
+	result = PipelineQuery(conn, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+int SQL_PipelineQuery(const char *fmt, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, fmt);
+	result = PipelineQuery(default_connection, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+static void
+PipelineRollback(struct SQL_Connection *conn)
+{
+	int timed_out = 0;
+
+	if (!InTransactionBlock(conn))
+		return;
+
+	if (PQsendQuery(conn->pg, conn->pipeline_nested ? "ROLLBACK TO SAVEPOINT " PIPELINE_SAVEPOINT : "ROLLBACK"))
+		PQclear(WaitResult(conn, StatementDeadline(conn), &timed_out));
+}
+
+/* Ends one attempt.  Returns 0 if the transaction committed; otherwise
+ * rolls back and returns -1, setting *retry if running the transaction
+ * again may succeed.  Errors are only reported if it may not.  A nested
+ * pipeline is never retried, since that would take the enclosing
+ * transaction with it.  */
+static int
+PipelineFinish(struct SQL_Connection *conn, int *retry)
+{
+	PGresult *res, *extra;
+	char *error = 0;
+	unsigned long long start, deadline;
+	int timed_out = 0, conflict = 0;
+	size_t i;
+
+	*retry = 0;
+
+	if (!conn->pipeline_failed)
+	{
+		if (conn->pipeline_invalid)
+			PipelineSendInternal(conn, conn->pipeline_nested ? "ROLLBACK TO SAVEPOINT " PIPELINE_SAVEPOINT : "ROLLBACK",
+			                     PIPELINE_INTERNAL);
+		else if (conn->pipeline_nested)
+			PipelineSendInternal(conn, "RELEASE SAVEPOINT " PIPELINE_SAVEPOINT, PIPELINE_INTERNAL);
+		else
+		{
+			/* The transaction id tells whether COMMIT took effect if the
+			 * connection is lost before its result arrives.  */
+			PipelineSendInternal(conn, "SELECT txid_current()", PIPELINE_TXID);
+
+			conn->pipeline_commit_sent = 1;
+			PipelineSendInternal(conn, "COMMIT", PIPELINE_INTERNAL);
+		}
+
+		if (!PQpipelineSync(conn->pg))
+			conn->pipeline_failed = 1;
+	}
+
+	/* Each statement is timed from the flush until its result arrives */
+	start = Now();
+	deadline = StatementDeadline(conn);
+
+	/* Collect one result per message sent, each followed by NULL */
+	for (i = 0; !conn->pipeline_failed && i < ARRAY_COUNT(&conn->pipeline_sent); ++i)
+	{
+		struct pipeline_item *item = &ARRAY_GET(&conn->pipeline_sent, i);
+		const char *sqlstate;
+
+		if (-1 == AwaitResult(conn, &deadline, &timed_out)
+		    || !(res = PQgetResult(conn->pg)))
+		{
+			conn->pipeline_failed = 1;
+
+			break;
+		}
+
+		while (0 != (extra = PQgetResult(conn->pg)))
+			PQclear(extra);
+
+		switch (PQresultStatus(res))
+		{
+		case PGRES_COMMAND_OK:
+		case PGRES_TUPLES_OK:
+
+			if (item->type == PIPELINE_TXID)
+				conn->pipeline_txid = strtoll(PQgetvalue(res, 0, 0), 0, 10);
+
+			break;
+
+		case PGRES_PIPELINE_ABORTED:
+
+			if (item->type == PIPELINE_PREPARE)
+				item->stmt->prepared = 0;
+
+			break;
+
+		default:
+
+			if (item->type == PIPELINE_PREPARE)
+				item->stmt->prepared = 0;
+
+			if (!error)
+			{
+				error = strdup(PQresultErrorMessage(res));
+
+				sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+				conflict = IsRetryable(sqlstate);
+			}
+		}
+
+		if (item->type == PIPELINE_QUERY)
+		{
+			RecordExecution(conn, item->stmt, start, ResultRows(res));
+
+			ARRAY_GET(&conn->pipeline, item->statement).result = res;
+		}
+		else
+			PQclear(res);
+	}
+
+	/* Consume the PGRES_PIPELINE_SYNC result */
+	if (!conn->pipeline_failed && -1 == AwaitResult(conn, &deadline, &timed_out))
+		conn->pipeline_failed = 1;
+	else if (!conn->pipeline_failed && 0 != (res = PQgetResult(conn->pg)))
+		PQclear(res);
+
+	if (PQstatus(conn->pg) != CONNECTION_OK)
+		conn->pipeline_failed = 1;
+
+	if (conn->pipeline_failed)
+	{
+		/* Whatever was sent may or may not have been applied */
+		for (i = 0; i < ARRAY_COUNT(&conn->pipeline_sent); ++i)
+		{
+			struct pipeline_item *item = &ARRAY_GET(&conn->pipeline_sent, i);
+
+			if (item->type == PIPELINE_PREPARE)
+				item->stmt->prepared = 0;
+		}
+
+		free(error);
+
+		syslog(LOG_WARNING, "PostgreSQL pipeline failed: %s", timed_out ? "timed out" : PQerrorMessage(conn->pg));
+
+		/* Resetting the session also rolls back anything uncommitted */
+		if (conn->needs_reset || PQstatus(conn->pg) != CONNECTION_OK || !PQexitPipelineMode(conn->pg))
+		{
+			Reconnect(conn);
+
+			if (conn->pipeline_nested)
+				conn->transaction_lost = 1;
+		}
+		else if (conn->pipeline_nested)
+			PipelineRollback(conn);
+
+		conn->unavailable = !conn->pipeline_invalid;
+
+		if (conn->pipeline_nested)
+		{
+			Report(conn, "PostgreSQL pipeline failed: %s\n", timed_out ? "timed out" : "connection lost");
+
+			return -1;
+		}
+
+		if (!conn->pipeline_commit_sent || conn->pipeline_invalid)
+		{
+			*retry = !timed_out && !conn->pipeline_invalid;
+
+			if (!*retry)
+				Report(conn, "PostgreSQL pipeline failed: %s\n", timed_out ? "timed out" : "connection lost");
+
+			return -1;
+		}
+
+		switch (CommitOutcome(conn, conn->pipeline_txid))
+		{
+		case 1:
+
+			return 0;
+
+		case 0:
+
+			*retry = !timed_out;
+			conn->unavailable = 1;
+
+			if (!*retry)
+				Report(conn, "PostgreSQL pipeline failed: timed out\n");
+
+			return -1;
+
+		default:
+
+			Report(conn, "PostgreSQL pipeline failed: connection lost during COMMIT; the transaction may or may not have been applied\n");
+
+			conn->unavailable = 1;
+
+			return -1;
+		}
+	}
+
+	PQexitPipelineMode(conn->pg);
+
+	if (error || conn->pipeline_invalid)
+	{
+		*retry = conflict && !timed_out && !conn->pipeline_nested;
+		conn->unavailable = timed_out;
+
+		if (!*retry && error)
+			Report(conn, "PostgreSQL query failed: %s\n", timed_out ? "timed out" : error);
+
+		free(error);
+
+		PipelineRollback(conn);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Runs the queued statements one by one on a backend other than libpq */
+static int
+BackendPipelineCommit(struct SQL_Connection *conn)
+{
+	struct pipeline_statement *statement;
+	unsigned long long start;
+	PGresult *res;
+	int failed = conn->pipeline_failed || conn->pipeline_invalid;
+	size_t i;
+
+	if (!failed && !(res = ExecuteF(conn, conn->pipeline_begin)))
+		return -1;
+
+	if (!failed)
+		PQclear(res);
+
+	for (i = 0; !failed && i < ARRAY_COUNT(&conn->pipeline); ++i)
+	{
+		statement = &ARRAY_GET(&conn->pipeline, i);
+
+		start = Now();
+		statement->result = BackendExecute(conn, &statement->q);
+		RecordExecution(conn, statement->q.stmt, start, ResultRows(statement->result));
+
+		if (!statement->result)
+		{
+			Report(conn, "PostgreSQL query failed: %s\n", ErrorMessage(conn));
+
+			failed = 1;
+		}
+	}
+
+	if (failed)
+	{
+		if (InTransactionBlock(conn))
+			PQclear(ExecuteF(conn, conn->pipeline_nested ? "ROLLBACK TO SAVEPOINT " PIPELINE_SAVEPOINT : "ROLLBACK"));
+
+		return -1;
+	}
+
+	if (!(res = ExecuteF(conn, conn->pipeline_nested ? "RELEASE SAVEPOINT " PIPELINE_SAVEPOINT : "COMMIT")))
+		return -1;
+
+	PQclear(res);
+
+	return 0;
+}
+
+int SQL_ConnPipelineCommit(struct SQL_Connection *conn)
+{
+	int attempt, retry, result;
+
+	if (conn->backend)
+		return BackendPipelineCommit(conn);
+
+	for (attempt = 1; ; ++attempt)
+	{
+		if (0 == (result = PipelineFinish(conn, &retry)) || !retry)
+			return result;
+
+		if (attempt == TRANSACTION_MAX_ATTEMPTS)
+		{
+			Report(conn, "PostgreSQL transaction failed after %d attempts\n", attempt);
+
+			return -1;
+		}
+
+		RetryBackoff(conn, attempt);
+
+		PipelineStart(conn);
+	}
+}
+
+int SQL_PipelineCommit()
+{
+	return SQL_ConnPipelineCommit(default_connection);
+}
+
+int SQL_ConnPipelineRowCount(struct SQL_Connection *conn, int statement)
+{
+	assert(statement >= 0 && (size_t) statement < ARRAY_COUNT(&conn->pipeline));
+
+	return PQntuples(ARRAY_GET(&conn->pipeline, statement).result);
+}
+
+int SQL_PipelineRowCount(int statement)
+{
+	return SQL_ConnPipelineRowCount(default_connection, statement);
+}
+
+const char *SQL_ConnPipelineValue(struct SQL_Connection *conn, int statement, unsigned int row, unsigned int column)
+{
+	assert(row < (unsigned int) SQL_ConnPipelineRowCount(conn, statement));
+
+	return PQgetvalue(ARRAY_GET(&conn->pipeline, statement).result, row, column);
+}
+
+const char *SQL_PipelineValue(int statement, unsigned int row, unsigned int column)
+{
+	return SQL_ConnPipelineValue(default_connection, statement, row, column);
+}
+
+/* Connection pool.  A connection is handed out whole, so the account
+ * set on it for one session cannot be seen by another.  An idle
+ * connection already set to the wanted account is preferred, which saves
+ * setting it again; otherwise the one idle the longest is used.  */
+
+struct pool_entry
+{
+	struct SQL_Connection *conn;
+	int in_use;
+	unsigned long long released;
+};
+
+struct SQL_Pool
+{
+	ARRAY(struct pool_entry) entries;
+};
+
+static void
+PoolAdd(struct SQL_Pool *pool, struct SQL_Connection *conn)
+{
+	struct pool_entry entry;
+
+	entry.conn = conn;
+	entry.in_use = 0;
+	entry.released = 0;
+
+	ARRAY_ADD(&pool->entries, entry);
+
+	if (-1 == ARRAY_RESULT(&pool->entries))
+		errx(EXIT_FAILURE, "ARRAY_ADD failed");
+}
+
+struct SQL_Pool *SQL_PoolCreate(struct SQL_Connection *model, unsigned int size)
+{
+	struct SQL_Pool *pool;
+	struct SQL_Connection *conn;
+
+	if (!(pool = calloc(1, sizeof(*pool))))
+		errx(EXIT_FAILURE, "calloc failed");
+
+	ARRAY_INIT(&pool->entries);
+
+	PoolAdd(pool, model);
+
+	while (ARRAY_COUNT(&pool->entries) < size)
+	{
+		/* A smaller pool still works */
+		if (!(conn = SQL_Connect(model->connect_string)))
+			break;
+
+		SQL_ConnSetTimeouts(conn, model->statement_usec / 1000, model->reconnect_usec / 1000);
+
+		if (model->slow_usec)
+			SQL_ConnSetSlowQueryLog(conn, model->slow_usec / 1000, model->slow_log_path);
+
+		if (model->replica)
+			SQL_ConnSetReplica(conn, model->replica->connect_string, model->replica_lag_usec / 1000);
+
+		PoolAdd(pool, conn);
+	}
+
+	return pool;
+}
+
+void SQL_PoolDestroy(struct SQL_Pool *pool)
+{
+	size_t i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < ARRAY_COUNT(&pool->entries); ++i)
+	{
+		if (ARRAY_GET(&pool->entries, i).conn == default_connection)
+			default_connection = 0;
+
+		SQL_Disconnect(ARRAY_GET(&pool->entries, i).conn);
+	}
+
+	ARRAY_FREE(&pool->entries);
+	free(pool);
+}
+
+static int
+SameAccount(const char *a, const char *b)
+{
+	return (!a || !b) ? a == b : !strcmp(a, b);
+}
+
+struct SQL_Connection *SQL_PoolAcquire(struct SQL_Pool *pool, const char *account)
+{
+	struct pool_entry *entry, *best = 0;
+	struct SQL_Connection *conn;
+	size_t i;
+
+	for (i = 0; i < ARRAY_COUNT(&pool->entries); ++i)
+	{
+		entry = &ARRAY_GET(&pool->entries, i);
+
+		if (entry->in_use)
+			continue;
+
+		if (SameAccount(entry->conn->account, account))
+		{
+			best = entry;
+
+			break;
+		}
+
+		if (!best || entry->released < best->released)
+			best = entry;
+	}
+
+	if (!best)
+		return 0;
+
+	conn = best->conn;
+
+	if (!SameAccount(conn->account, account))
+	{
+		free(conn->account);
+		conn->account = account ? strdup(account) : 0;
+
+		if (-1 == SetP2k12Account(conn))
+		{
+			conn->needs_reset = 1;
+
+			/* Start over on a new session next time, unless the server is
+			 * down: the session may still work offline, and reconnecting
+			 * sets the account before any query runs.  */
+			if (!conn->unavailable)
+			{
+				free(conn->account);
+				conn->account = 0;
+
+				return 0;
+			}
+		}
+	}
+
+	best->in_use = 1;
+
+	return conn;
+}
+
+void SQL_PoolRelease(struct SQL_Pool *pool, struct SQL_Connection *conn)
+{
+	size_t i;
+
+	if (!conn)
+		return;
+
+	/* Nothing of the session may carry over to the next one */
+	FinishAsync(conn->async_conn);
+	PQclear(conn->async_conn->async_result);
+	conn->async_conn->async_result = 0;
+	conn->async_conn->async_state = ASYNC_IDLE;
+	conn->transaction_lost = 0;
+	conn->command_deadline = 0;
+
+	if (Connected(conn) && TransactionStatus(conn) != PQTRANS_IDLE)
+		PQclear(ExecuteF(conn, "ROLLBACK"));
+
+	for (i = 0; i < ARRAY_COUNT(&pool->entries); ++i)
+	{
+		struct pool_entry *entry = &ARRAY_GET(&pool->entries, i);
+
+		if (entry->conn == conn)
+		{
+			entry->in_use = 0;
+			entry->released = Now();
+		}
+	}
+}
+
+void SQL_StatementCacheStats(unsigned long *hits, unsigned long *misses)
+{
+	SQL_ConnStatementCacheStats(default_connection, hits, misses);
+}
+
+void SQL_PrintStats(FILE *file)
+{
+	SQL_ConnPrintStats(default_connection, file);
 }
@@ -1,20 +1,241 @@
 #ifndef POSTGRESQL_H_
 #define POSTGRESQL_H_ 1
 
+#include <stdio.h>
+#include <time.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct SQL_Connection;
+
+struct SQL_Result;
+
+struct SQL_Pool;
+
+enum SQL_Isolation
+{
+  SQL_READ_COMMITTED,
+  SQL_REPEATABLE_READ,
+  SQL_SERIALIZABLE
+};
+
+/* Unit of work for SQL_Transaction, returning 0 to commit and -1 to
+ * roll back.  It runs again whenever the transaction is retried.  */
+typedef int (*SQL_TransactionCallback)(struct SQL_Connection *conn, void *arg);
+
+/* Called for each row of a streamed query; a nonzero return value stops
+ * the stream.  */
+typedef int (*SQL_RowCallback)(const struct SQL_Result *result, unsigned int row, void *arg);
+
+/* Connections.  All state, including prepared statements, results and
+ * the "p2k12.account" setting, belongs to one connection, so separate
+ * connections can be used from separate threads.  SQL_Connect returns
+ * NULL on failure.  */
+struct SQL_Connection *SQL_Connect(const char *connect_string);
+
+/* Like SQL_Connect, for a connection used by no session, e.g. from
+ * another thread while stdout belongs to a daemon's session.  Failures on
+ * it are reported to syslog instead of stdout and stderr.  */
+struct SQL_Connection *SQL_ConnectBackground(const char *connect_string);
+
+void SQL_Disconnect(struct SQL_Connection *conn);
+
+void SQL_ConnSetP2k12Account(struct SQL_Connection *conn, const char *account);
+
+int SQL_ConnQuery(struct SQL_Connection *conn, const char *query, ...);
+
+int SQL_ConnRowCount(struct SQL_Connection *conn);
+
+const char *SQL_ConnValue(struct SQL_Connection *conn, unsigned int row, unsigned int column);
+
+struct SQL_Result *SQL_ConnExecute(struct SQL_Connection *conn, const char *query, ...);
+
+struct SQL_Result *SQL_ConnExecuteBinary(struct SQL_Connection *conn, const char *query, ...);
+
+void SQL_ConnPipelineBegin(struct SQL_Connection *conn, enum SQL_Isolation isolation);
+
+int SQL_ConnPipelineQuery(struct SQL_Connection *conn, const char *query, ...);
+
+int SQL_ConnPipelineCommit(struct SQL_Connection *conn);
+
+int SQL_ConnPipelineRowCount(struct SQL_Connection *conn, int statement);
+
+const char *SQL_ConnPipelineValue(struct SQL_Connection *conn, int statement, unsigned int row, unsigned int column);
+
+int SQL_ConnSendQuery(struct SQL_Connection *conn, const char *query, ...);
+
+int SQL_ConnSocket(struct SQL_Connection *conn);
+
+int SQL_ConnAsyncPoll(struct SQL_Connection *conn);
+
+struct SQL_Result *SQL_ConnAsyncResult(struct SQL_Connection *conn);
+
+int SQL_ConnTransaction(struct SQL_Connection *conn, enum SQL_Isolation isolation,
+                        SQL_TransactionCallback callback, void *arg);
+
+int SQL_ConnStream(struct SQL_Connection *conn, SQL_RowCallback callback, void *arg, const char *query, ...);
+
+void SQL_ConnStatementCacheStats(struct SQL_Connection *conn, unsigned long *hits, unsigned long *misses);
+
+void SQL_ConnPrintStats(struct SQL_Connection *conn, FILE *file);
+
+void SQL_ConnSetSlowQueryLog(struct SQL_Connection *conn, unsigned int threshold_ms, const char *path);
+
+void SQL_ConnSetTimeouts(struct SQL_Connection *conn, unsigned int statement_ms, unsigned int reconnect_ms);
+
+void SQL_ConnSetCommandDeadline(struct SQL_Connection *conn, unsigned int budget_ms);
+
+int SQL_ConnOffline(struct SQL_Connection *conn);
+
+int SQL_ConnUnavailable(struct SQL_Connection *conn);
+
+void SQL_ConnSetReplica(struct SQL_Connection *conn, const char *connect_string, unsigned int max_lag_ms);
+
+/* The functions below operate on the connection opened by SQL_Init */
 void SQL_Init(const char *connect_string);
 
+struct SQL_Connection *SQL_DefaultConnection();
+
+/* Makes the SQL_* functions below use conn, e.g. one from a pool */
+void SQL_SetDefaultConnection(struct SQL_Connection *conn);
+
 void SQL_SetP2k12Account(const char *account);
 
+/* Compatibility interface: the result of the most recent SQL_Query is
+ * kept until the next call, and read with SQL_RowCount/SQL_Value.  */
 int SQL_Query(const char *query, ...);
 
 int SQL_RowCount();
 
 const char *SQL_Value(unsigned int row, unsigned int column);
 
+/* Owned results.  SQL_Execute returns NULL on failure; any number of
+ * results may be open at once, each released with SQL_ResultFree.  */
+struct SQL_Result *SQL_Execute(const char *query, ...);
+
+int SQL_ResultRowCount(const struct SQL_Result *result);
+
+int SQL_ResultAffectedRows(const struct SQL_Result *result);
+
+const char *SQL_ResultValue(const struct SQL_Result *result, unsigned int row, unsigned int column);
+
+void SQL_ResultFree(struct SQL_Result *result);
+
+/* Like SQL_Execute, but the result is in binary format and can only be
+ * read with the typed accessors below.  */
+struct SQL_Result *SQL_ExecuteBinary(const char *query, ...);
+
+int SQL_ResultIsNull(const struct SQL_Result *result, unsigned int row, unsigned int column);
+
+/* Typed accessors for text or binary results.  They return 0 on success
+ * and -1 if the value is NULL, of another type or out of range.  Numeric
+ * values are returned multiplied by 10^scale, truncated.  */
+int SQL_ResultInt(const struct SQL_Result *result, unsigned int row, unsigned int column, long long *value);
+
+int SQL_ResultNumeric(const struct SQL_Result *result, unsigned int row, unsigned int column, int scale, long long *value);
+
+int SQL_ResultTimestamp(const struct SQL_Result *result, unsigned int row, unsigned int column, struct timespec *value);
+
+/* Pipelined transaction: BEGIN, the queued statements and COMMIT are sent
+ * in one flush.  SQL_PipelineQuery returns a handle for reading the
+ * statement's result after SQL_PipelineCommit has returned 0.  On the
+ * first error the whole transaction is rolled back and -1 returned.
+ * Like SQL_Transaction, the statements are replayed when retrying, so
+ * their arguments must stay valid until SQL_PipelineCommit returns.
+ * Inside an open transaction the pipeline becomes a savepoint instead,
+ * and is neither committed nor retried on its own.  */
+void SQL_PipelineBegin(enum SQL_Isolation isolation);
+
+int SQL_PipelineQuery(const char *query, ...);
+
+int SQL_PipelineCommit();
+
+int SQL_PipelineRowCount(int statement);
+
+const char *SQL_PipelineValue(int statement, unsigned int row, unsigned int column);
+
+/* Runs callback inside a transaction at the given isolation level.  On
+ * serialization failures, deadlocks and lost connections the transaction
+ * is rolled back and run again, a few times at most.  Queries in the
+ * callback must use conn.  Returns 0 once committed, -1 otherwise.
+ * Inside an open transaction the callback runs once, in a savepoint.  */
+int SQL_Transaction(enum SQL_Isolation isolation, SQL_TransactionCallback callback, void *arg);
+
+/* Asynchronous query.  SQL_SendQuery returns without waiting.  When
+ * SQL_Socket is readable, SQL_AsyncPoll reads what has arrived and
+ * returns 1 once the query is complete, 0 while it is still running and
+ * -1 if nothing is pending.  SQL_AsyncResult returns the result, waiting
+ * for it if necessary, or NULL if the query failed.  */
+int SQL_SendQuery(const char *query, ...);
+
+int SQL_Socket();
+
+int SQL_AsyncPoll();
+
+struct SQL_Result *SQL_AsyncResult();
+
+/* Streamed query.  Rows are passed to the callback as they arrive
+ * instead of being collected in one result.  Returns the number of rows
+ * passed, or -1 on failure.  */
+int SQL_Stream(SQL_RowCallback callback, void *arg, const char *query, ...);
+
+void SQL_StatementCacheStats(unsigned long *hits, unsigned long *misses);
+
+/* Writes calls, errors, rows and latency percentiles for each statement
+ * format, slowest in total first.  */
+void SQL_PrintStats(FILE *file);
+
+/* Queries run with SQL_Query or SQL_Execute that take threshold_ms or
+ * longer are logged with their parameters to syslog, and appended to
+ * path unless it is NULL.  Their plans are captured with EXPLAIN on a
+ * second, read-only connection and logged when ready.  Text passed as
+ * %S instead of %s, e.g. password hashes, is left out of both.  A
+ * threshold of 0 turns the log off.  */
+void SQL_SetSlowQueryLog(unsigned int threshold_ms, const char *path);
+
+/* Deadlines.  A statement running longer than statement_ms is cancelled
+ * on the server and fails as timed out.  A lost connection is retried
+ * with exponential backoff for up to reconnect_ms before queries fail.
+ * SQL_SetCommandDeadline bounds all statements from now until
+ * budget_ms have passed; 0 removes the bound.  0 means no limit.  */
+void SQL_SetTimeouts(unsigned int statement_ms, unsigned int reconnect_ms);
+
+void SQL_SetCommandDeadline(unsigned int budget_ms);
+
+/* Outages.  SQL_Offline returns 1 from when reconnecting gives up until
+ * a query gets through again; meanwhile each query makes one brief
+ * attempt to reconnect instead of using the whole budget.
+ * SQL_Unavailable returns 1 if the last query or pipeline failed because
+ * the server could not be reached or did not answer in time, as opposed
+ * to failing on its own account.  */
+int SQL_Offline();
+
+int SQL_Unavailable();
+
+/* Connection pool for serving many sessions.  The pool takes over
+ * conn and opens up to size - 1 more connections with the same
+ * settings.  SQL_PoolAcquire returns an idle connection with
+ * "p2k12.account" set to account, or NULL if none is available, for use
+ * by one session until SQL_PoolRelease; an open transaction is rolled
+ * back on release.  While the server is down, the account is set once
+ * the connection is back.  */
+struct SQL_Pool *SQL_PoolCreate(struct SQL_Connection *conn, unsigned int size);
+
+struct SQL_Connection *SQL_PoolAcquire(struct SQL_Pool *pool, const char *account);
+
+void SQL_PoolRelease(struct SQL_Pool *pool, struct SQL_Connection *conn);
+
+void SQL_PoolDestroy(struct SQL_Pool *pool);
+
+/* Read replica.  SELECTs run outside transactions go to a hot standby
+ * while it has replayed this session's writes and lags the primary by at
+ * most max_lag_ms, and to the primary otherwise.  A SELECT that turns
+ * out to write is run again on the primary, as is one the replica fails
+ * because it went down; a replica that is down is tried again later.  */
+void SQL_SetReplica(const char *connect_string, unsigned int max_lag_ms);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif